@@ -45,6 +45,12 @@
 /** Temporary buffer size for reading from streams */
 #define Z_BLOB_COPY_BUFSIZE     8192
 
+/** Size of the chunks blobs are stored in while in memory */
+#define Z_BLOB_CHUNK_SIZE       65536
+
+/** Number of chunks needed to store size bytes */
+#define Z_BLOB_CHUNKS(size)     (((size) + Z_BLOB_CHUNK_SIZE - 1) / Z_BLOB_CHUNK_SIZE)
+
 /** Default blob system instance */
 ZBlobSystem  *z_blob_system_default = NULL;
 
@@ -74,54 +80,382 @@ static void Z_BLOB_MEM_FREED(void)
 
 
 /**
- * Writes a blob out to disk, called only from z_blob_system_threadproc()
+ * Reserve memory in a blob system.
  *
  * @param[in] self this
+ * @param[in] delta number of bytes to reserve, negative to release memory
+ * @param[in] check_limit whether to deny reservations exceeding mem_max
  *
- * @warning Caller must hold a lock BOTH on the blob AND the blob system!
+ * @returns TRUE if the reservation was made
+ **/
+static gboolean
+z_blob_system_mem_reserve(ZBlobSystem *self, gssize delta, gboolean check_limit)
+{
+  gsize used;
+
+  do
+    {
+      used = z_blob_system_mem_used(self);
+      if (check_limit && delta > 0 && (used > self->mem_max || (gsize) delta > self->mem_max - used))
+        return FALSE;
+    }
+  while (!g_atomic_pointer_compare_and_exchange(&self->mem_used.ptr, GSIZE_TO_POINTER(used), GSIZE_TO_POINTER(used + delta)));
+  return TRUE;
+}
+
+/**
+ * Resize the mapping of the swap file of a blob.
+ *
+ * @param[in] self this
+ * @param[in] length new length of the swap file, 0 to drop the mapping
+ *
+ * While the blob is in file, the whole swap file is mapped once and the
+ * mapping follows the length of the file as the blob changes it. It is
+ * only used for reading, if the file cannot be mapped, it is read with
+ * pread() instead.
+ *
+ * @warning Caller must hold an exclusive lock on the blob!
  **/
 static void
-z_blob_swap_out(ZBlob *self)
+z_blob_file_map_resize(ZBlob *self, gint64 length)
 {
-  off_t err;
-  gssize written, remain;
+  gchar *map;
 
-  z_enter();
-  g_assert(self);
-  if (!self->storage_locked && !self->is_in_file && self->system)
+  if (self->file_map ? (guint64) length == self->file_map_length : length <= 0)
+    return;
+
+  if (length <= 0 || (guint64) length > G_MAXSIZE)
     {
-      err = lseek(self->fd, 0, SEEK_SET);
-      if (err < 0)
+      if (self->file_map)
+        munmap(self->file_map, self->file_map_length);
+      map = MAP_FAILED;
+    }
+  else if (self->file_map)
+    {
+#ifdef HAVE_MREMAP
+      map = mremap(self->file_map, self->file_map_length, length, MREMAP_MAYMOVE);
+      if (map == MAP_FAILED)
+        munmap(self->file_map, self->file_map_length);
+#else
+      munmap(self->file_map, self->file_map_length);
+      map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+#endif
+    }
+  else
+    {
+      map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+    }
+
+  if (map == MAP_FAILED)
+    {
+      if (length > 0)
+        z_log(NULL, CORE_DEBUG, 6, "Cannot map blob file, using file I/O; file='%s', length='%" G_GINT64_FORMAT "', error='%s'", self->filename, length, g_strerror(errno));
+      self->file_map = NULL;
+      self->file_map_length = 0;
+      return;
+    }
+
+  /* a new mapping starts with the default advice, mremap() keeps the old one */
+  if (map != self->file_map)
+    {
+      self->file_map_advice = MADV_NORMAL;
+      self->file_map_next = 0;
+    }
+  self->file_map = map;
+  self->file_map_length = length;
+}
+
+/**
+ * Advise the kernel on the access pattern of the swap file mapping.
+ *
+ * @param[in] self this
+ * @param[in] pos start of the range accessed through the mapping
+ * @param[in] length length of the range
+ *
+ * An access starting at the page where the previous one ended is
+ * sequential, the kernel is told to read ahead and to reclaim the pages
+ * behind. Anything else switches the mapping to random access. The advice
+ * does not discard data, so it is safe under a shared blob lock; the
+ * tracking is a hint and is updated atomically without further locking.
+ **/
+static void
+z_blob_file_map_advise(ZBlob *self, gint64 pos, gsize length)
+{
+  gint page = getpagesize();
+  gint next, advice, old_advice;
+
+  next = g_atomic_int_get(&self->file_map_next);
+  advice = (pos == 0 || (gint) (pos / page) == next) ? MADV_SEQUENTIAL : MADV_RANDOM;
+  g_atomic_int_set(&self->file_map_next, (gint) ((pos + (gint64) length) / page));
+
+  old_advice = g_atomic_int_get(&self->file_map_advice);
+  if (old_advice != advice && g_atomic_int_compare_and_exchange(&self->file_map_advice, old_advice, advice))
+    madvise(self->file_map, self->file_map_length, advice);
+}
+
+/**
+ * Write a buffer into the swap file of a blob at the given offset.
+ *
+ * @param[in] self this
+ * @param[in] data data to write
+ * @param[in] length length of data
+ * @param[in] pos offset in the swap file
+ *
+ * pwrite() is used even if the swap file is mapped: storing through the
+ * shared mapping would turn a full disk into SIGBUS instead of an error,
+ * and the mapping sees the data through the page cache anyway. pwrite()
+ * leaves the file offset alone, so concurrent accesses to the swap file
+ * need not be serialized by the blob lock.
+ **/
+static void
+z_blob_file_write(ZBlob *self, const gchar *data, gsize length, gint64 pos)
+{
+  gssize written;
+
+  while (length > 0)
+    {
+      written = pwrite(self->fd, data, length, pos);
+      if (written < 0)
         {
-          z_log(NULL, CORE_ERROR, 0, "Blob error, lseek() failed; file='%s', error='%s'", self->filename, g_strerror(errno));
-          g_assert(0);
+          if (errno == EINTR)
+            {
+              continue;
+            }
+          else
+            {
+              z_log(NULL, CORE_ERROR, 0, "Blob error, pwrite() failed; file='%s', error='%s'", self->filename, g_strerror(errno));
+              g_assert(0);
+            }
         }
-      remain = self->size;
-      while (remain > 0)
+      data += written;
+      length -= written;
+      pos += written;
+    }
+}
+
+/**
+ * Read data from the swap file of a blob at the given offset.
+ *
+ * @param[in]  self this
+ * @param[out] data buffer to read into
+ * @param[in]  length bytes to read
+ * @param[in]  pos offset in the swap file
+ *
+ * @returns The amount of data read, less than length only at the end of the file
+ **/
+static gsize
+z_blob_file_read(ZBlob *self, gchar *data, gsize length, gint64 pos)
+{
+  gssize rd;
+  gsize total = 0;
+
+  if (self->file_map && (guint64) pos + length <= self->file_map_length)
+    {
+      z_blob_file_map_advise(self, pos, length);
+      memmove(data, self->file_map + pos, length);
+      return length;
+    }
+
+  while (total < length)
+    {
+      rd = pread(self->fd, data + total, length - total, pos + total);
+      if (rd < 0)
         {
-          written = write(self->fd, self->data, remain);
-          if (written < 0)
+          if (errno == EINTR)
             {
-              if (errno == EINTR)
-                {
-                  continue;
-                }
-              else
-                {
-                  z_log(NULL, CORE_ERROR, 0, "Blob error, write() failed; file='%s', error='%s'", self->filename, g_strerror(errno));
-                  g_assert(0);
-                }
+              continue;
+            }
+          else
+            {
+              z_log(NULL, CORE_ERROR, 0, "Blob error, pread() failed; file='%s', error='%s'", self->filename, g_strerror(errno));
+              g_assert(0);
             }
-          remain -= written;
         }
-      self->is_in_file = 1;
-      g_free(self->data);
-      self->data = NULL;
-      self->stat.swap_count++;
-      self->stat.last_accessed = time(NULL);
-      self->system->mem_used -= self->alloc_size;
-      self->system->disk_used += self->alloc_size;
+      else if (rd == 0)
+        break;
+
+      total += rd;
     }
+  return total;
+}
+
+/**
+ * Get the length of a chunk of a blob.
+ *
+ * @param[in] size allocated size of the blob
+ * @param[in] index index of the chunk
+ *
+ * All chunks but the last one are Z_BLOB_CHUNK_SIZE long, the last one
+ * holds the rest of the allocated size.
+ *
+ * @returns The length of the chunk, 0 if it is beyond the allocated size
+ **/
+static inline gsize
+z_blob_chunk_length(gint64 size, gint64 index)
+{
+  gint64 start = index * Z_BLOB_CHUNK_SIZE;
+
+  if (start >= size)
+    return 0;
+  return MIN(size - start, Z_BLOB_CHUNK_SIZE);
+}
+
+/**
+ * Get a pointer to the memory image of a blob at the given position.
+ *
+ * @param[in]      self this
+ * @param[in]      pos position in the blob
+ * @param[in, out] length length of the range: in=requested, out=available in the chunk
+ *
+ * @warning The blob must be in memory and pos must be below its allocated size!
+ *
+ * @returns Pointer into the chunk holding pos
+ **/
+static inline gchar *
+z_blob_chunk_ptr(ZBlob *self, gint64 pos, gsize *length)
+{
+  gsize offset = pos % Z_BLOB_CHUNK_SIZE;
+
+  *length = MIN(*length, Z_BLOB_CHUNK_SIZE - offset);
+  return self->chunks[pos / Z_BLOB_CHUNK_SIZE] + offset;
+}
+
+/**
+ * Resize the chunk table of a blob kept in memory.
+ *
+ * @param[in] self this
+ * @param[in] old_size the currently allocated size
+ * @param[in] new_size the new allocated size
+ *
+ * Growing appends zero-filled chunks without touching the existing ones,
+ * only a partial last chunk is reallocated.
+ **/
+static void
+z_blob_chunks_resize(ZBlob *self, gint64 old_size, gint64 new_size)
+{
+  gint64 old_count = Z_BLOB_CHUNKS(old_size);
+  gint64 new_count = Z_BLOB_CHUNKS(new_size);
+  gint64 i;
+  gsize old_length, new_length;
+
+  for (i = new_count; i < old_count; i++)
+    g_free(self->chunks[i]);
+
+  self->chunks = g_renew(gchar *, self->chunks, new_count);
+  for (i = 0; i < new_count; i++)
+    {
+      old_length = z_blob_chunk_length(old_size, i);
+      new_length = z_blob_chunk_length(new_size, i);
+      if (old_length == new_length)
+        continue;
+
+      self->chunks[i] = g_renew(gchar, old_length ? self->chunks[i] : NULL, new_length);
+      if (new_length > old_length)
+        memset(self->chunks[i] + old_length, 0, new_length - old_length);
+    }
+}
+
+/**
+ * Copy data into the memory image of a blob.
+ *
+ * @param[in] self this
+ * @param[in] data data to write
+ * @param[in] length length of data
+ * @param[in] pos position in the blob
+ **/
+static void
+z_blob_mem_write(ZBlob *self, const gchar *data, gsize length, gint64 pos)
+{
+  gsize part;
+  gchar *d;
+
+  while (length > 0)
+    {
+      part = length;
+      d = z_blob_chunk_ptr(self, pos, &part);
+      memmove(d, data, part);
+      data += part;
+      length -= part;
+      pos += part;
+    }
+}
+
+/**
+ * Copy data out of the memory image of a blob.
+ *
+ * @param[in]  self this
+ * @param[out] data buffer to read into
+ * @param[in]  length bytes to read
+ * @param[in]  pos position in the blob
+ **/
+static void
+z_blob_mem_read(ZBlob *self, gchar *data, gsize length, gint64 pos)
+{
+  gsize part;
+  gchar *d;
+
+  while (length > 0)
+    {
+      part = length;
+      d = z_blob_chunk_ptr(self, pos, &part);
+      memmove(data, d, part);
+      data += part;
+      length -= part;
+      pos += part;
+    }
+}
+
+/**
+ * Writes the data of a blob out to disk and releases its memory.
+ *
+ * @param[in] self this
+ *
+ * The disk usage of the blob system is not updated, that is left to the
+ * caller.
+ *
+ * @warning Caller must hold a lock on the blob!
+ *
+ * @returns TRUE if the blob has been swapped out
+ **/
+static gboolean
+z_blob_swap_out_data(ZBlob *self)
+{
+  gint64 i;
+
+  z_enter();
+  g_assert(self);
+  if (self->storage_locked || self->is_in_file || !self->system)
+    z_return(FALSE);
+
+  /* chunks are released as soon as they are on disk */
+  for (i = 0; i < Z_BLOB_CHUNKS(self->size); i++)
+    {
+      z_blob_file_write(self, self->chunks[i], z_blob_chunk_length(self->size, i), i * Z_BLOB_CHUNK_SIZE);
+      g_free(self->chunks[i]);
+      self->chunks[i] = NULL;
+    }
+  z_blob_chunks_resize(self, self->alloc_size, 0);
+  z_blob_file_map_resize(self, self->size);
+  self->is_in_file = 1;
+  self->stat.swap_count++;
+  self->stat.last_accessed = time(NULL);
+  z_blob_system_mem_reserve(self->system, -self->alloc_size, FALSE);
+  z_return(TRUE);
+}
+
+/**
+ * Writes a blob out to disk, called only from z_blob_system_threadproc()
+ *
+ * @param[in] self this
+ *
+ * @warning Caller must hold a lock BOTH on the blob AND the blob system!
+ **/
+static void
+z_blob_swap_out(ZBlob *self)
+{
+  z_enter();
+  if (z_blob_swap_out_data(self))
+    self->system->disk_used += self->alloc_size;
   z_return();
 }
 
@@ -139,6 +473,208 @@ z_blob_signal_ready(ZBlob *self)
   g_mutex_unlock(self->mtx_reply);
 }
 
+/**
+ * Default eviction policy: idle time weighted by size.
+ *
+ * @param[in] blob the blob to evaluate
+ * @param[in] now current time
+ *
+ * Big blobs that have not been accessed for a long time are the coldest,
+ * every read or write request makes a blob warmer.
+ *
+ * @returns The coldness of the blob
+ **/
+static gdouble
+z_blob_eviction_score_default(ZBlob *blob, time_t now)
+{
+  gdouble idle, requests;
+
+  idle = MAX(now - blob->stat.last_accessed, 0) + 1;
+  requests = blob->stat.req_rd + blob->stat.req_wr + 1;
+  return idle * blob->alloc_size / requests;
+}
+
+/**
+ * Evaluate the eviction policy of a blob system on a blob.
+ *
+ * @param[in] self this
+ * @param[in] blob the blob to evaluate
+ * @param[in] now current time
+ *
+ * @warning Caller must hold a lock on the blob!
+ *
+ * @returns The coldness of the blob
+ **/
+static gdouble
+z_blob_system_eviction_score(ZBlobSystem *self, ZBlob *blob, time_t now)
+{
+  gdouble score;
+
+  /* readers update the statistics while holding only a shared lock */
+  g_mutex_lock(blob->mtx_stat);
+  score = self->eviction_score(blob, now);
+  g_mutex_unlock(blob->mtx_stat);
+  return score;
+}
+
+/**
+ * Check whether a blob may be evicted from memory.
+ *
+ * @param[in] blob the blob to check
+ *
+ * Blobs not larger than noswap_max are never evicted.
+ *
+ * @warning Caller must hold a lock on the blob!
+ **/
+static inline gboolean
+z_blob_evictable(ZBlob *blob)
+{
+  return !blob->storage_locked && !blob->is_in_file && blob->alloc_size > 0 &&
+         (gsize) blob->alloc_size > blob->system->noswap_max;
+}
+
+/** A blob considered for eviction */
+typedef struct _ZBlobEvictionCandidate
+{
+  ZBlob *blob;
+  gdouble score;
+  gint64 size;                  /**< alloc_size when selected, reserved on disk */
+} ZBlobEvictionCandidate;
+
+/**
+ * Order eviction candidates, coldest first.
+ **/
+static gint
+z_blob_eviction_candidate_compare(gconstpointer a, gconstpointer b)
+{
+  const ZBlobEvictionCandidate *ca = (const ZBlobEvictionCandidate *) a;
+  const ZBlobEvictionCandidate *cb = (const ZBlobEvictionCandidate *) b;
+
+  if (ca->score > cb->score)
+    return -1;
+  else if (ca->score < cb->score)
+    return 1;
+  return 0;
+}
+
+/**
+ * Evict the coldest blobs from memory to make room for an allocation.
+ *
+ * @param[in] self this
+ * @param[in] requester the blob requesting the allocation
+ * @param[in] req number of bytes requested in memory
+ *
+ * The blobs colder than the requester according to the eviction policy are
+ * selected, coldest first, until the memory usage including the request
+ * would drop to lowat. Nothing is evicted if that cannot make room for the
+ * request. Blobs locked by others are skipped.
+ *
+ * The victims are selected and their disk space is reserved while holding
+ * the lock of the blob system, but they are written out only after it has
+ * been released, so that the I/O doesn't block other allocations. The
+ * victims are marked as evicting meanwhile, z_blob_unref() waits for them.
+ *
+ * @warning Caller must hold a lock on the requester, but NOT on the blob system!
+ *
+ * @returns TRUE if the request fits into memory afterwards
+ **/
+static gboolean
+z_blob_system_evict(ZBlobSystem *self, ZBlob *requester, gsize req)
+{
+  GArray                  *candidates;
+  ZBlobEvictionCandidate  candidate, *victim;
+  GList                   *cur;
+  ZBlob                   *blob;
+  time_t                  now;
+  gdouble                 requester_score;
+  gsize                   mem_used, evictable = 0, selected = 0;
+  gint                    evict_count = 0;
+  gint64                  evict_bytes = 0, disk_adjust = 0;
+  guint                   i, victims = 0;
+
+  z_enter();
+  time(&now);
+  requester_score = z_blob_system_eviction_score(self, requester, now);
+  candidates = g_array_new(FALSE, FALSE, sizeof(ZBlobEvictionCandidate));
+
+  g_mutex_lock(self->mtx_blobsys);
+  for (cur = self->blobs; cur; cur = cur->next)
+    {
+      blob = (ZBlob *) cur->data;
+      if (blob == requester || blob->evicting || !z_blob_lock(blob, 0)) /* zero timeout -> trylock */
+        continue;
+
+      if (z_blob_evictable(blob))
+        {
+          candidate.blob = blob;
+          candidate.score = z_blob_system_eviction_score(self, blob, now);
+          candidate.size = blob->alloc_size;
+          if (candidate.score > requester_score)
+            {
+              g_array_append_val(candidates, candidate);
+              evictable += candidate.size;
+            }
+        }
+      z_blob_unlock(blob);
+    }
+
+  mem_used = z_blob_system_mem_used(self);
+  if (mem_used <= self->mem_max && req <= self->mem_max - mem_used + evictable)
+    {
+      /* the victims are moved to the front of the array */
+      g_array_sort(candidates, z_blob_eviction_candidate_compare);
+      for (i = 0; i < candidates->len && mem_used + req > self->lowat + selected; i++)
+        {
+          candidate = g_array_index(candidates, ZBlobEvictionCandidate, i);
+          if (self->disk_used + candidate.size > self->disk_max)
+            continue;
+
+          candidate.blob->evicting = TRUE;
+          self->disk_used += candidate.size;
+          selected += candidate.size;
+          g_array_index(candidates, ZBlobEvictionCandidate, victims++) = candidate;
+        }
+    }
+  g_mutex_unlock(self->mtx_blobsys);
+
+  for (i = 0; i < victims; i++)
+    {
+      victim = &g_array_index(candidates, ZBlobEvictionCandidate, i);
+      blob = victim->blob;
+      /* give back the reserved disk space unless the blob gets swapped out */
+      disk_adjust -= victim->size;
+      if (!z_blob_lock(blob, 0))
+        continue;
+
+      /* the owner may have resized or locked the blob since it was selected */
+      if (z_blob_evictable(blob))
+        {
+          evict_count++;
+          evict_bytes += blob->alloc_size;
+          disk_adjust += blob->alloc_size;
+          z_blob_swap_out_data(blob);
+        }
+      z_blob_unlock(blob);
+    }
+
+  if (victims)
+    {
+      g_mutex_lock(self->mtx_blobsys);
+      self->disk_used += disk_adjust;
+      for (i = 0; i < victims; i++)
+        g_array_index(candidates, ZBlobEvictionCandidate, i).blob->evicting = FALSE;
+      g_cond_broadcast(self->cond_evicted);
+      g_mutex_unlock(self->mtx_blobsys);
+    }
+  g_array_free(candidates, TRUE);
+
+  mem_used = z_blob_system_mem_used(self);
+  if (evict_count)
+    z_log(NULL, CORE_DEBUG, 7, "Evicted cold blobs from memory; evict_count='%d', evict_bytes='%" G_GINT64_FORMAT "', mem_used='%" G_GSIZE_FORMAT "'",
+          evict_count, evict_bytes, mem_used);
+  z_return(mem_used <= self->mem_max && req <= self->mem_max - mem_used);
+}
+
 /**
  * Checks if a blob may allocate self->alloc_req additional bytes.
  *
@@ -153,7 +689,7 @@ z_blob_check_alloc(ZBlob *self)
   gsize         req_total;
   gboolean      success = FALSE, on_disk = FALSE;
 
-  mem_available = self->system->mem_max - self->system->mem_used;
+  mem_available = self->system->mem_max - z_blob_system_mem_used(self->system);
   disk_available = self->system->disk_max - self->system->disk_used;
   req_total = self->alloc_size + self->alloc_req;
 
@@ -174,23 +710,16 @@ z_blob_check_alloc(ZBlob *self)
       success = TRUE;
       on_disk = TRUE;
     }
-  else if ((self->alloc_req < 0) || ((gsize)self->alloc_req <= mem_available))
+  else if (z_blob_system_mem_reserve(self->system, self->alloc_req, TRUE))
     {
-      self->system->mem_used += self->alloc_req;
       success = TRUE;
       on_disk = FALSE;
     }
-  else if (!self->storage_locked && (req_total <= disk_available)) /* don't fit in mem but fits on disk */
+  else if (!self->storage_locked && (req_total <= self->system->disk_max - self->system->disk_used)) /* don't fit in mem but fits on disk */
     {
-      /* FIXME: !!! FOR TESTING ONLY !!!
-       * The current swapping policy is definitely quite lame, it must
-       * be replaced with some more intelligent algorithm.
-       * Now, if the blob can't be kept in memory, it goes directly to disk.
-       * Then, if any self gets freed, we try to find the most appropriate
-       * one on disk that would fit in the available ram, and fetch it in.
-       * The decision factor is the number of accesses divided by the
-       * time elapsed since the last access. Ummm, it cries for some
-       * refinement, but should work for now :)...
+      /* Evicting colder blobs (see z_blob_alloc()) couldn't make room for
+       * the request, so the blob itself goes to disk. If some memory gets freed later, the warmest blob on
+       * disk that fits in the available ram is fetched in.
        */
       z_log(NULL, CORE_DEBUG, 7, "Blob does not fit, swapping out; self_size='%" G_GINT64_FORMAT "'", self->size);
       z_blob_swap_out(self);
@@ -234,14 +763,13 @@ void
 z_blob_system_swap_in(ZBlobSystem *self)
 {
   gint64        space_available;
-  gdouble       dec_factor, dec_factor_best;
+  gdouble       score, score_best;
   GList         *cur;
   ZBlob         *blob, *best;
-  time_t        now, elapsed;
+  time_t        now;
   gint          swap_count;
   gint64        swap_bytes;
   off_t         err;
-  gssize        rd;
 
 
   /**
@@ -254,21 +782,22 @@ z_blob_system_swap_in(ZBlobSystem *self)
    *  - memory store is preferred
    *  - when the amount in RAM is less than lowat AND the amount on
    *    disk is more than hiwat, swap-in is started
-   *  - the best blob is selected and it is swapped in  
+   *  - the warmest blob according to the eviction policy is selected
+   *    and it is swapped in
    **/
 
-  if (self->mem_used >= self->lowat || self->disk_used < self->hiwat)
+  if (z_blob_system_mem_used(self) >= self->lowat || self->disk_used < self->hiwat)
     return;
 
   z_log(NULL, CORE_DEBUG, 7, "Starting blob swap-in; mem_used='%" G_GSIZE_FORMAT "', disk_used='%" G_GINT64_FORMAT "', lowat='%" G_GSIZE_FORMAT "'",
-        self->mem_used, self->disk_used, self->lowat);
+        z_blob_system_mem_used(self), self->disk_used, self->lowat);
   swap_count = 0;
   swap_bytes = 0;
   do
     {
       time(&now);
-      space_available = self->hiwat - self->mem_used;
-      dec_factor_best = -1;
+      space_available = self->hiwat - z_blob_system_mem_used(self);
+      score_best = 0;
       best = NULL;
 
       for (cur = self->blobs; cur; cur = cur->next)
@@ -279,11 +808,10 @@ z_blob_system_swap_in(ZBlobSystem *self)
             {
               if (!blob->storage_locked && blob->is_in_file && (blob->alloc_size <= space_available))
                 {
-                  elapsed = now - blob->stat.last_accessed;
-                  dec_factor = (elapsed > 0) ? (blob->stat.req_rd + blob->stat.req_wr) / elapsed : 0;
-                  if (dec_factor > dec_factor_best)
+                  score = z_blob_system_eviction_score(self, blob, now);
+                  if (!best || score < score_best)
                     {
-                      dec_factor_best = dec_factor;
+                      score_best = score;
                       best = blob;
                     }
                 }
@@ -298,44 +826,20 @@ z_blob_system_swap_in(ZBlobSystem *self)
             {
               if (!best->storage_locked && best->is_in_file && (best->alloc_size <= space_available))
                 {
-                  gssize remain;
-                  err = lseek(best->fd, 0, SEEK_SET);
-                  if (err == (off_t)-1)
-                    {
-                      z_log(NULL, CORE_ERROR, 0, "Blob error, lseek() failed; file='%s', error='%s'", best->filename, g_strerror(errno));
-                      g_assert(0);
-                    }
-                  best->data = g_new0(gchar, best->alloc_size);
-                  
-                  remain = best->size;
-                  while (remain > 0)
-                    {
-                      rd = read(best->fd, best->data, remain);
-                      if (rd < 0)
-                        {
-                          if (errno == EINTR)
-                            {
-                              continue;
-                            }
-                          else
-                            {
-                              z_log(NULL, CORE_ERROR, 0, "Blob error, read() failed; file='%s', error='%s'", best->filename, g_strerror(errno));
-                              g_assert(0);
-                            }
-                        }
-                      else if (rd == 0)
-                        break;
-                      
-                      remain -= rd;
-                    }
+                  gint64 i;
+
+                  z_blob_chunks_resize(best, 0, best->alloc_size);
+                  for (i = 0; i < Z_BLOB_CHUNKS(best->size); i++)
+                    z_blob_file_read(best, best->chunks[i], z_blob_chunk_length(best->size, i), i * Z_BLOB_CHUNK_SIZE);
 
                   best->is_in_file = 0;
+                  z_blob_file_map_resize(best, 0);
                   err = ftruncate(best->fd, 0);
                   if (err < 0)
                     z_log(NULL, CORE_DEBUG, 7, "Blob error, ftruncate() failed; file='%s', error='%s'", best->filename, g_strerror(errno));
                   best->stat.last_accessed = time(NULL);
                   best->system->disk_used -= best->alloc_size;
-                  best->system->mem_used += best->alloc_size;
+                  z_blob_system_mem_reserve(best->system, best->alloc_size, FALSE);
                   swap_count++;
                   swap_bytes += best->size;
                 }
@@ -369,7 +873,7 @@ z_blob_system_report_usage(ZBlobSystem *self)
     **/
    z_log(NULL, CORE_INFO, 4, "Blob system usage: Disk used: %" G_GINT64_FORMAT " from %" G_GINT64_FORMAT ". Mem used: %" G_GSIZE_FORMAT " from %" G_GSIZE_FORMAT ". Blobs in use: %d. Waiting queue length: (cur/max/min/avg) %d/%d/%d/%d",
                              self->disk_used, self->disk_max,
-                             self->mem_used, self->mem_max,
+                             z_blob_system_mem_used(self), self->mem_max,
                              g_list_length(self->blobs),
                              g_list_length(self->waiting_list), -1, -1, -1);
 }
@@ -524,7 +1028,8 @@ z_blob_system_new(const char *dir, gint64 dmax, gsize mmax, gsize low, gsize hiw
   self->dir = strdup(dir);
   self->disk_max = dmax;
   self->mem_max = mmax;
-  self->disk_used = self->mem_used = 0;
+  self->disk_used = 0;
+  self->mem_used.size = 0;
   if (mmax <= low)
       low = mmax - 1;
   self->lowat = low;
@@ -535,8 +1040,10 @@ z_blob_system_new(const char *dir, gint64 dmax, gsize mmax, gsize low, gsize hiw
   self->blobs = NULL;
   self->mtx_blobsys = g_mutex_new();
   self->cond_thread_started = g_cond_new();
+  self->cond_evicted = g_cond_new();
   self->req_queue = g_async_queue_new();
   self->waiting_list = NULL;
+  self->eviction_score = z_blob_eviction_score_default;
 
   g_mutex_lock(self->mtx_blobsys);
   self->thr_management = g_thread_create((GThreadFunc)z_blob_system_threadproc,
@@ -547,6 +1054,26 @@ z_blob_system_new(const char *dir, gint64 dmax, gsize mmax, gsize low, gsize hiw
   z_return(self);
 }
 
+/**
+ * Set the eviction policy of a blob system.
+ *
+ * @param[in] self the blob system object
+ * @param[in] eviction_score the new policy, NULL to restore the default one
+ *
+ * The policy decides which blobs are swapped out when memory runs short and
+ * which ones are fetched in when memory is freed up. The default policy
+ * prefers keeping small and recently used blobs in memory.
+ **/
+void
+z_blob_system_set_eviction_policy(ZBlobSystem *self, ZBlobEvictionFunc eviction_score)
+{
+  z_enter();
+  g_mutex_lock(self->mtx_blobsys);
+  self->eviction_score = eviction_score ? eviction_score : z_blob_eviction_score_default;
+  g_mutex_unlock(self->mtx_blobsys);
+  z_return();
+}
+
 /**
  * Increase reference count of a blob system.
  *
@@ -622,6 +1149,7 @@ z_blob_system_unref(ZBlobSystem *self)
           /* Some blob operations are in progress: z_blob_new, _unref, _alloc, _get_file */
         }
       g_cond_free(self->cond_thread_started);
+      g_cond_free(self->cond_evicted);
       g_async_queue_unref(self->req_queue);
       g_list_free(self->waiting_list);
       g_free(self);
@@ -692,23 +1220,34 @@ z_blob_new(ZBlobSystem *sys, gsize initial_size)
   z_refcount_set(&self->ref_cnt, 1);
   self->size = 0;
   self->alloc_size = 0;
-  self->data = NULL;
+  self->chunks = NULL;
   self->is_in_file = FALSE;
   self->mtx_reply = g_mutex_new();
   self->cond_reply = g_cond_new();
   self->mapped_ptr = NULL;
   self->mapped_length = 0;
+  self->file_map = NULL;
+  self->file_map_length = 0;
+  self->file_map_next = 0;
+  self->file_map_advice = MADV_NORMAL;
+  self->evicting = FALSE;
   self->storage_locked = FALSE;
 
   z_blob_statistic_init(&self->stat);
-  self->mtx_lock = g_mutex_new();
+  self->mtx_stat = g_mutex_new();
+  g_static_rw_lock_init(&self->lock);
 
   g_mutex_lock(self->system->mtx_blobsys);
   self->system->blobs = g_list_append(self->system->blobs, self);
   g_mutex_unlock(self->system->mtx_blobsys);
 
+  /* the blob is already visible to the blob system, which may swap it */
   if (initial_size > 0)
-    z_blob_alloc(self, initial_size);
+    {
+      z_blob_lock(self, -1);
+      z_blob_alloc(self, initial_size);
+      z_blob_unlock(self);
+    }
   z_return(self);
 }
 
@@ -739,14 +1278,18 @@ z_blob_unref(ZBlob *self)
   if (self && z_refcount_dec(&self->ref_cnt))
     {
       g_mutex_lock(self->system->mtx_blobsys);
+      /* an eviction in progress still uses the blob */
+      while (self->evicting)
+        g_cond_wait(self->system->cond_evicted, self->system->mtx_blobsys);
       self->alloc_req = -self->alloc_size;
       self->system->blobs = g_list_remove(self->system->blobs, self);
       z_blob_check_alloc(self);
       g_mutex_unlock(self->system->mtx_blobsys);
 
-      if (self->data)
-        g_free(self->data);
+      if (self->chunks)
+        z_blob_chunks_resize(self, self->alloc_size, 0);
 
+      z_blob_file_map_resize(self, 0);
       if (self->fd >= 0)
         close(self->fd);
 
@@ -760,10 +1303,11 @@ z_blob_unref(ZBlob *self)
 
       g_mutex_free(self->mtx_reply);
       g_cond_free(self->cond_reply);
-      if (g_mutex_trylock(self->mtx_lock))
+      g_mutex_free(self->mtx_stat);
+      if (g_static_rw_lock_writer_trylock(&self->lock))
         {
-          g_mutex_unlock(self->mtx_lock);
-          g_mutex_free(self->mtx_lock);
+          g_static_rw_lock_writer_unlock(&self->lock);
+          g_static_rw_lock_free(&self->lock);
         }
       else
         {
@@ -776,15 +1320,37 @@ z_blob_unref(ZBlob *self)
 }
 
 /**
- * Lock a blob.
+ * Try to lock a blob without blocking.
+ *
+ * @param[in] self this
+ * @param[in] exclusive TRUE to lock for writing, FALSE to share the lock with other readers
+ *
+ * @returns TRUE if successfully locked.
+ **/
+static inline gboolean
+z_blob_trylock(ZBlob *self, gboolean exclusive)
+{
+  if (exclusive)
+    return g_static_rw_lock_writer_trylock(&self->lock);
+  else
+    return g_static_rw_lock_reader_trylock(&self->lock);
+}
+
+/**
+ * Lock a blob either exclusively or shared with other readers.
  *
  * @param[in] self this
  * @param[in] timeout Timeout for locking. A negative value means infinite and thus blocking mode. Zero means nonblocking mode.
+ * @param[in] exclusive TRUE to lock for writing, FALSE to share the lock with other readers
+ *
+ * Reading the contents of the blob needs only a shared lock, anything
+ * changing the contents, the size or the storage of the blob needs an
+ * exclusive one.
  *
  * @returns TRUE if successfully locked.
  **/
-gboolean
-z_blob_lock(ZBlob *self, gint timeout)
+static gboolean
+z_blob_lock_full(ZBlob *self, gint timeout, gboolean exclusive)
 {
   gboolean        res;
   struct timeval  tvnow, tvfinish;
@@ -794,12 +1360,15 @@ z_blob_lock(ZBlob *self, gint timeout)
 
   if (timeout < 0)        /* infinite timeout -> blocking mode */
     {
-      g_mutex_lock(self->mtx_lock);
+      if (exclusive)
+        g_static_rw_lock_writer_lock(&self->lock);
+      else
+        g_static_rw_lock_reader_lock(&self->lock);
       res = TRUE;
     }
   else if (timeout == 0)  /* zero timeout -> nonblocking mode */
     {
-      res = g_mutex_trylock(self->mtx_lock);
+      res = z_blob_trylock(self, exclusive);
     }
   else                    /* positive timeout */
     {
@@ -812,7 +1381,7 @@ z_blob_lock(ZBlob *self, gint timeout)
       do
         {
           res = FALSE;
-          if (g_mutex_trylock(self->mtx_lock))
+          if (z_blob_trylock(self, exclusive))
             {
               res = TRUE;
               break;
@@ -826,6 +1395,35 @@ z_blob_lock(ZBlob *self, gint timeout)
   z_return(res);
 }
 
+/**
+ * Unlock a blob locked by z_blob_lock_full().
+ *
+ * @param[in] self this
+ * @param[in] exclusive the value passed to z_blob_lock_full()
+ **/
+static void
+z_blob_unlock_full(ZBlob *self, gboolean exclusive)
+{
+  if (exclusive)
+    g_static_rw_lock_writer_unlock(&self->lock);
+  else
+    g_static_rw_lock_reader_unlock(&self->lock);
+}
+
+/**
+ * Lock a blob for exclusive access.
+ *
+ * @param[in] self this
+ * @param[in] timeout Timeout for locking. A negative value means infinite and thus blocking mode. Zero means nonblocking mode.
+ *
+ * @returns TRUE if successfully locked.
+ **/
+gboolean
+z_blob_lock(ZBlob *self, gint timeout)
+{
+  return z_blob_lock_full(self, timeout, TRUE);
+}
+
 /**
  * Unlock a blob.
  *
@@ -836,10 +1434,29 @@ z_blob_unlock(ZBlob *self)
 {
   z_enter();
   g_assert(self);
-  g_mutex_unlock(self->mtx_lock);
+  z_blob_unlock_full(self, TRUE);
   z_return();
 }
 
+/**
+ * Update the read statistics of a blob.
+ *
+ * @param[in] self this
+ * @param[in] length number of bytes read
+ *
+ * Readers only hold a shared lock on the blob, so the statistics are
+ * protected by a separate mutex.
+ **/
+static void
+z_blob_statistic_read(ZBlob *self, gsize length)
+{
+  g_mutex_lock(self->mtx_stat);
+  self->stat.req_rd++;
+  self->stat.total_rd += length;
+  self->stat.last_accessed = time(NULL);
+  g_mutex_unlock(self->mtx_stat);
+}
+
 /**
  * Allocate space for the blob (not necessarily in memory!)
  *
@@ -851,7 +1468,6 @@ z_blob_unlock(ZBlob *self)
 static void
 z_blob_alloc(ZBlob *self, gint64 req_size)
 {
-  gchar         *newdata;
   gint          err;
   gint64        req_alloc_size, alloc_req;
   gboolean      alloc_granted;
@@ -881,15 +1497,35 @@ z_blob_alloc(ZBlob *self, gint64 req_size)
         }
     }
 
+  /* beyond the first chunk the blob grows by whole chunks */
+  if (!self->is_in_file && req_alloc_size > Z_BLOB_CHUNK_SIZE)
+    req_alloc_size = Z_BLOB_CHUNKS(req_size) * Z_BLOB_CHUNK_SIZE;
+
   /* just return if the allocation needn't change */
   if (req_alloc_size == self->alloc_size)
     z_return();
 
   alloc_req = req_alloc_size - self->alloc_size;
-  g_mutex_lock(self->system->mtx_blobsys);
-  self->alloc_req = alloc_req;
-  alloc_granted = z_blob_check_alloc(self);
-  g_mutex_unlock(self->system->mtx_blobsys);
+
+  /* fast path: a blob in memory that still fits, maybe after evicting colder
+   * blobs, needs no approval from the blob system */
+  if (!self->is_in_file &&
+      (z_blob_system_mem_reserve(self->system, alloc_req, TRUE) ||
+       (alloc_req > 0 && z_blob_system_evict(self->system, self, alloc_req) &&
+        z_blob_system_mem_reserve(self->system, alloc_req, TRUE))))
+    {
+      alloc_granted = TRUE;
+      if (alloc_req < 0)
+        g_async_queue_push(self->system->req_queue, Z_BLOB_MEM_FREED);
+    }
+  else
+    {
+      g_mutex_lock(self->system->mtx_blobsys);
+      self->alloc_req = alloc_req;
+      alloc_granted = z_blob_check_alloc(self);
+      g_mutex_unlock(self->system->mtx_blobsys);
+    }
+
   if (!alloc_granted)
     {
       self->approved = FALSE;
@@ -909,13 +1545,12 @@ z_blob_alloc(ZBlob *self, gint64 req_size)
       err = ftruncate(self->fd, req_alloc_size);
       if (err < 0)
         z_log(NULL, CORE_ERROR, 3, "Error truncating blob file, ftruncate() failed; file='%s', error='%s'", self->filename, g_strerror(errno));
+      else
+        z_blob_file_map_resize(self, req_alloc_size);
     }
   else
     {
-      newdata = g_renew(gchar, self->data, req_alloc_size);
-      if (self->alloc_size < req_alloc_size && newdata)
-        memset(newdata + self->alloc_size, 0, req_alloc_size - self->alloc_size);
-      self->data = newdata;
+      z_blob_chunks_resize(self, self->alloc_size, req_alloc_size);
     }
 
   self->alloc_size = req_alloc_size;
@@ -970,7 +1605,6 @@ z_blob_truncate(ZBlob *self, gint64 pos, gint timeout)
 gsize
 z_blob_add_copy(ZBlob *self, gint64 pos, const gchar* data, gsize req_datalen, gint timeout)
 {
-  off_t         err;
   gssize        written = 0;
 
   z_enter();
@@ -984,36 +1618,12 @@ z_blob_add_copy(ZBlob *self, gint64 pos, const gchar* data, gsize req_datalen, g
 
       if (self->is_in_file)
         {
-          gssize remain;
-          err = lseek(self->fd, pos, SEEK_SET);
-          
-          if (err < 0)
-            {
-              z_log(NULL, CORE_ERROR, 0, "Blob error, lseek() failed; file='%s', error='%s'", self->filename, g_strerror(errno));
-              g_assert(0);
-            }
-          remain = req_datalen;
-          while (remain > 0)
-            {
-              written = write(self->fd, data, remain);
-              if (written < 0)
-                {
-                  if (errno == EINTR)
-                    {
-                      continue;
-                    }
-                  else
-                    {
-                      z_log(NULL, CORE_ERROR, 0, "Blob error, write() failed; file='%s', error='%s'", self->filename, g_strerror(errno));
-                      g_assert(0);
-                    }
-                }
-              remain -= written;
-            }
+          z_blob_file_write(self, data, req_datalen, pos);
+          written = req_datalen;
         }
       else
         {
-          memmove(self->data + pos, data, req_datalen);
+          z_blob_mem_write(self, data, req_datalen, pos);
           written = req_datalen;
         }
       if (self->size < (pos + written))
@@ -1035,62 +1645,38 @@ z_blob_add_copy(ZBlob *self, gint64 pos, const gchar* data, gsize req_datalen, g
  * @param[in] req_datalen bytes to read
  * @param[in] timeout timeout
  *
+ * The blob is only locked for reading, so concurrent readers of the same
+ * blob do not wait for each other.
+ *
  * @returns The amount of data actually read.
  **/
 gsize
 z_blob_get_copy(ZBlob *self, gint64 pos, gchar* data, gsize req_datalen, gint timeout)
 {
-  off_t         err;
-  gssize        rd = 0;
+  gsize         rd = 0;
 
   z_enter();
   g_assert(self);
   g_assert(data);
   g_assert(pos >= 0);
-  if (pos < self->size)
+  if (z_blob_lock_full(self, timeout, FALSE))
     {
-      if (req_datalen > (guint64) (self->size - pos))
-        req_datalen = self->size - pos;
-      if (z_blob_lock(self, timeout))
+      if (pos < self->size)
         {
+          if (req_datalen > (guint64) (self->size - pos))
+            req_datalen = self->size - pos;
           if (self->is_in_file)
             {
-              gssize remain;
-              err = lseek(self->fd, pos, SEEK_SET);
-              if (err < 0)
-                {
-                  z_log(NULL, CORE_ERROR, 0, "Blob error, lseek() failed; file='%s', error='%s'", self->filename, g_strerror(errno));
-                  g_assert(0);
-                }
-              remain = req_datalen;
-              while (remain > 0)
-                {
-                  rd = read(self->fd, data, remain);
-                  if (rd < 0)
-                    {
-                      if (errno == EINTR)
-                        {
-                          continue;
-                        }
-                      else
-                        {
-                          z_log(NULL, CORE_ERROR, 0, "Blob error, read() failed; file='%s', error='%s'", self->filename, g_strerror(errno));
-                          g_assert(0);
-                        }
-                    }
-                  remain -= rd;
-                }
+              rd = z_blob_file_read(self, data, req_datalen, pos);
             }
           else
             {
-              memmove(data, self->data + pos, req_datalen);
+              z_blob_mem_read(self, data, req_datalen, pos);
               rd = req_datalen;
             }
-          self->stat.req_rd++;
-          self->stat.total_rd += rd;
-          self->stat.last_accessed = time(NULL);
-          z_blob_unlock(self);
+          z_blob_statistic_read(self, rd);
         }
+      z_blob_unlock_full(self, FALSE);
     }
   z_return(rd);          
 }
@@ -1178,7 +1764,11 @@ z_blob_release_file(ZBlob *self)
   z_enter();
   g_assert(self);
   if (!fstat(self->fd, &st))
-    self->size = self->alloc_size = st.st_size;
+    {
+      self->size = self->alloc_size = st.st_size;
+      if (self->is_in_file)
+        z_blob_file_map_resize(self, st.st_size);
+    }
   else
     z_log(NULL, CORE_ERROR, 3, "Cannot stat file on release, blob size may be incorrect from now;");
   z_blob_unlock(self);
@@ -1195,6 +1785,8 @@ z_blob_release_file(ZBlob *self)
  * @param[in]      timeout timeout
  *
  * This function obtains a pointer to a specified subrange of the blob.
+ * While the blob is in memory, the range is cut at the end of the chunk
+ * containing pos, so the returned length may be less than requested.
  * Until the pointer is freed by 'z_blob_free_ptr()', the blob will be locked for
  * reading, that means read operations are still possible, but writes and
  * swapping is disabled and will block!
@@ -1218,7 +1810,12 @@ z_blob_get_ptr(ZBlob *self, gint64 pos, gsize *req_datalen, gint timeout)
       if (self->size < (pos + (gssize) *req_datalen))
         *req_datalen = self->size - pos;
 
-      if (self->is_in_file)
+      if (self->is_in_file && self->file_map && (guint64) pos + *req_datalen <= self->file_map_length)
+        {
+          z_blob_file_map_advise(self, pos, *req_datalen);
+          data = self->file_map + pos;
+        }
+      else if (self->is_in_file)
         {
           offset_in_page = pos % getpagesize();
           data = (gchar*)mmap(NULL, *req_datalen + offset_in_page, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, pos - offset_in_page);
@@ -1229,7 +1826,7 @@ z_blob_get_ptr(ZBlob *self, gint64 pos, gsize *req_datalen, gint timeout)
         }
       else
         {
-          data = self->data + pos;
+          data = z_blob_chunk_ptr(self, pos, req_datalen);
         }
 
       self->mapped_ptr = data;
@@ -1257,7 +1854,9 @@ z_blob_free_ptr(ZBlob *self, gchar *data)
   g_assert(self->mapped_ptr);
   g_assert(self->mapped_ptr == data);
   g_assert(self->mapped_length > 0);
-  if (self->is_in_file)
+  /* ranges of the swap file mapping are not mapped separately */
+  if (self->is_in_file &&
+      !(self->file_map && data >= self->file_map && data < self->file_map + self->file_map_length))
     {
       offset_in_page = GPOINTER_TO_UINT(data) % getpagesize();
       munmap(data - offset_in_page, self->mapped_length + offset_in_page);
@@ -1288,9 +1887,8 @@ z_blob_free_ptr(ZBlob *self, gchar *data)
 GIOStatus
 z_blob_read_from_stream(ZBlob *self, gint64 pos, ZStream *stream, gint64 count, gint timeout, GError **error)
 {
-  off_t err;
   GIOStatus res = G_IO_STATUS_NORMAL;
-  guchar *copybuf;
+  gchar *copybuf = NULL;
   GError *local_error = NULL;
   gsize left;
 
@@ -1301,85 +1899,43 @@ z_blob_read_from_stream(ZBlob *self, gint64 pos, ZStream *stream, gint64 count,
 
   if (z_blob_lock(self, timeout))
     {
-      if (self->is_in_file)
+      left = count;
+      while (left != 0)
         {
-          if (self->size < pos)
-            z_blob_alloc(self, pos);
+          gsize br;
+          gsize bytes;
+          gchar *d;
 
-          err = lseek(self->fd, pos, SEEK_SET);
-          if (err < 0)
-            {
-              z_log(NULL, CORE_ERROR, 0, "Blob error, lseek() failed; file='%s', error='%s'", self->filename, g_strerror(errno));
-              g_assert(0);
-            }
+          bytes = MIN(left, Z_BLOB_COPY_BUFSIZE);
+          if (self->alloc_size < (pos + (gssize) bytes))
+            z_blob_alloc(self, pos + left);
 
-          copybuf = g_new(guchar, Z_BLOB_COPY_BUFSIZE);
-          left = count;
-          while (left != 0)
+          /* the allocation may have swapped the blob out, so check it on every pass */
+          if (self->is_in_file)
             {
-              gsize br;
-              gssize bw;
-              gsize bytes;
-              gssize remain;
-
-              bytes = MIN(left, Z_BLOB_COPY_BUFSIZE);
-
-              if (self->alloc_size < (pos + (gssize) bytes))
-                z_blob_alloc(self, pos + bytes);
-
-              res = z_stream_read(stream, copybuf, bytes, &br, &local_error);
-              if (res != G_IO_STATUS_NORMAL)
-                goto exit_stats;
-
-              left -= br;
-              pos += br;
-              if (self->size < pos)
-                self->size = pos;
-
-              remain = br;
-              while (remain > 0)
-                {
-                  bw = write(self->fd, copybuf, remain);
-                  if (bw < 0)
-                    {
-                      if (errno == EINTR)
-                        {
-                          continue;
-                        }
-                      else
-                        {
-                          z_log(NULL, CORE_ERROR, 0, "Blob error, write() failed; file='%s', error='%s'", self->filename, g_strerror(errno));
-                          g_assert(0);
-                        }
-                    }
-                  remain -= bw;
-                }
+              if (!copybuf)
+                copybuf = g_new(gchar, Z_BLOB_COPY_BUFSIZE);
+              d = copybuf;
             }
-          g_free(copybuf);
-        }
-      else
-        {
-          left = count;
-          while (left != 0)
+          else
             {
-              gsize br;
-              gsize bytes;
-              
-              bytes = MIN(left, Z_BLOB_COPY_BUFSIZE);
-              if (self->alloc_size < (pos + (gssize) bytes))
-                z_blob_alloc(self, pos + count);
-              
-              res = z_stream_read(stream, self->data + pos, bytes, &br, &local_error);
-              if (res != G_IO_STATUS_NORMAL)
-                goto exit_stats;
-              left -= br;
-              pos += br;
-              if (self->size < pos)
-                self->size = pos;
+              d = z_blob_chunk_ptr(self, pos, &bytes);
             }
+
+          res = z_stream_read(stream, d, bytes, &br, &local_error);
+          if (res != G_IO_STATUS_NORMAL)
+            goto exit_stats;
+
+          if (self->is_in_file)
+            z_blob_file_write(self, copybuf, br, pos);
+          left -= br;
+          pos += br;
+          if (self->size < pos)
+            self->size = pos;
         }
         
     exit_stats:
+      g_free(copybuf);
     
       self->stat.req_wr++;
       self->stat.total_wr += count;
@@ -1413,6 +1969,11 @@ z_blob_read_from_stream(ZBlob *self, gint64 pos, ZStream *stream, gint64 count,
  * chunks. It also ensures that the complete requested chunk is written
  * unless an error occurs, thus there is no bytes_written argument.
  *
+ * The blob is only locked for reading while a chunk is copied, so several
+ * consumers can write the same blob to their streams in parallel. Swapped
+ * out blobs are written from the mapping of the swap file, releasing the
+ * consumed pages, or copied through a buffer if the file is not mapped.
+ *
  * @returns GLib I/O status
  **/
 GIOStatus
@@ -1420,6 +1981,7 @@ z_blob_write_to_stream(ZBlob *self, gint64 pos, ZStream *stream, gint64 count, g
 {
   gint64 end_pos = pos + count;
   GIOStatus res = G_IO_STATUS_NORMAL;
+  gchar *copybuf = NULL;
 
   g_assert(self);
   g_assert(pos >= 0);
@@ -1427,27 +1989,58 @@ z_blob_write_to_stream(ZBlob *self, gint64 pos, ZStream *stream, gint64 count, g
   
   while (pos < end_pos)
     {
-      gsize mapped_length, mapped_pos, bw;
+      gsize length, bw;
       gchar *d;
 
-      mapped_length = MIN(Z_BLOB_COPY_BUFSIZE, end_pos - pos);
-      mapped_pos = 0;
-      d = z_blob_get_ptr(self, pos, &mapped_length, timeout);
-      if (!d)
+      if (!z_blob_lock_full(self, timeout, FALSE))
+        {
+          res = G_IO_STATUS_ERROR;
+          break;
+        }
+      if (pos >= self->size)
         {
+          z_blob_unlock_full(self, FALSE);
           res = G_IO_STATUS_ERROR;
           break;
         }
-      if (z_stream_write_chunk(stream, d + mapped_pos, mapped_length, &bw, NULL) != G_IO_STATUS_NORMAL)
+
+      length = MIN(end_pos, self->size) - pos;
+      if (!self->is_in_file)
+        {
+          d = z_blob_chunk_ptr(self, pos, &length);
+          res = z_stream_write_chunk(stream, d, length, &bw, NULL);
+          z_blob_unlock_full(self, FALSE);
+        }
+      else if (self->file_map && (guint64) pos + MIN(length, Z_BLOB_CHUNK_SIZE) <= self->file_map_length)
+        {
+          length = MIN(length, Z_BLOB_CHUNK_SIZE);
+          z_blob_file_map_advise(self, pos, length);
+          res = z_stream_write_chunk(stream, self->file_map + pos, length, &bw, NULL);
+          z_blob_unlock_full(self, FALSE);
+        }
+      else
+        {
+          if (!copybuf)
+            copybuf = g_new(gchar, Z_BLOB_COPY_BUFSIZE);
+          length = z_blob_file_read(self, copybuf, MIN(length, Z_BLOB_COPY_BUFSIZE), pos);
+          z_blob_unlock_full(self, FALSE);
+          if (length == 0)
+            {
+              res = G_IO_STATUS_ERROR;
+              break;
+            }
+          res = z_stream_write_chunk(stream, copybuf, length, &bw, NULL);
+        }
+      z_blob_statistic_read(self, length);
+
+      if (res != G_IO_STATUS_NORMAL)
         {
           res = G_IO_STATUS_ERROR;
-          z_blob_free_ptr(self, d);
-          goto exit;
+          break;
         }
-      z_blob_free_ptr(self, d);
-      pos += mapped_length;
+      pos += length;
     }
- exit:
+  g_free(copybuf);
   return res;
 }
 
@@ -1521,4 +2114,8 @@ z_blob_storage_lock(ZBlob *self, gboolean st)
  * Because this optimisation affects only allocations comparable to the size of
  * the address space (>= 4 GB), currently I use simple doubling, but this must
  * be fixed some time.
+ *
+ * Blobs in memory are stored in chunks of Z_BLOB_CHUNK_SIZE bytes, the
+ * doubling is only used while the blob fits into the first chunk, beyond
+ * that the blob grows by appending whole chunks.
  **/
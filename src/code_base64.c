@@ -3,6 +3,13 @@
 
 #include <zorp/code_base64.h>
 
+#include <string.h>
+
+#if defined(__SSSE3__) && defined(__GNUC__)
+#  include <tmmintrin.h>
+#  define Z_CODE_BASE64_SSSE3 1
+#endif
+
 /**
  * ZCode-derived class to encode binary data to base64.
  **/
@@ -62,6 +69,197 @@ typedef struct ZCodeBase64Decode
  * may be treated as error or ignored as well.
  **/
 
+static const char z_code_base64_encode_xlat[64] = 
+  {
+    'A', 'B', 'C', 'D',  'E', 'F', 'G', 'H',  'I', 'J', 'K', 'L',  'M', 'N', 'O', 'P',
+    'Q', 'R', 'S', 'T',  'U' ,'V', 'W', 'X',  'Y', 'Z', 'a', 'b',  'c', 'd', 'e', 'f',
+    'g', 'h', 'i', 'j',  'k', 'l', 'm', 'n',  'o', 'p', 'q', 'r',  's', 't', 'u', 'v',
+    'w', 'x', 'y', 'z',  '0', '1', '2', '3',  '4', '5', '6', '7',  '8', '9', '+', '/'
+  };
+
+static const int z_code_base64_decode_xlat[256] =  /* -3=error, -2=end of stream, -1=ignore, other=value */
+  {   -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -1,   -1,   -3,    -3,   -1,   -3,   -3, /* 0x00 - 0x0f */
+      -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0x10 - 0x1f */
+      -1,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3, 0x3e,    -3,   -3,   -3, 0x3f, /* 0x20 - 0x2f */
+    0x34, 0x35, 0x36, 0x37,  0x38, 0x39, 0x3a, 0x3b,  0x3c, 0x3d,   -3,   -3,    -3,   -2,   -3,   -3, /* 0x30 - 0x3f */
+      -3, 0x00, 0x01, 0x02,  0x03, 0x04, 0x05, 0x06,  0x07, 0x08, 0x09, 0x0a,  0x0b, 0x0c, 0x0d, 0x0e, /* 0x40 - 0x4f */
+    0x0f, 0x10, 0x11, 0x12,  0x13, 0x14, 0x15, 0x16,  0x17, 0x18, 0x19,   -3,    -3,   -3,   -3,   -3, /* 0x50 - 0x5f */
+      -3, 0x1a, 0x1b, 0x1c,  0x1d, 0x1e, 0x1f, 0x20,  0x21, 0x22, 0x23, 0x24,  0x25, 0x26, 0x27, 0x28, /* 0x60 - 0x6f */
+    0x29, 0x2a, 0x2b, 0x2c,  0x2d, 0x2e, 0x2f, 0x30,  0x31, 0x32, 0x33,   -3,    -3,   -3,   -3,   -3, /* 0x70 - 0x7f */
+      -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0x80 - 0x8f */
+      -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0x90 - 0x9f */
+      -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0xa0 - 0xaf */
+      -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0xb0 - 0xbf */
+      -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0xc0 - 0xcf */
+      -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0xd0 - 0xdf */
+      -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0xe0 - 0xef */
+      -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3  /* 0xf0 - 0xff */
+  };
+
+/* bulk conversion
+ *
+ * Whole groups (3 binary bytes <-> 4 base64 characters) are converted
+ * without going through the per-character state machines whenever the
+ * state machine is at a group boundary: the encoder stops before the group
+ * that would need a line break, the decoder stops at the first group
+ * containing anything else than base64 characters (whitespace, padding or
+ * invalid characters), which are then handled by the state machine.
+ * With SSSE3 available, 12 bytes <-> 16 characters are converted at once.
+ */
+
+#ifdef Z_CODE_BASE64_SSSE3
+
+/**
+ * Encode 12 bytes to 16 base64 characters.
+ *
+ * @param[in]  from source, 16 bytes must be readable
+ * @param[out] to destination
+ **/
+static inline void
+z_code_base64_encode_block_ssse3(const guchar *from, guchar *to)
+{
+  __m128i in, t0, t1, t2, t3, indices, result, less;
+
+  in = _mm_loadu_si128((const __m128i *) from);
+  /* bytes (a, b, c) to 16 bit words (b, a), (c, b) */
+  in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  /* move the 6-bit fields to the lower bits of the 4 output bytes */
+  t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  indices = _mm_or_si128(t1, t3);
+
+  /* map the 6-bit values to ascii by adding an offset depending on their range */
+  result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+  result = _mm_shuffle_epi8(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                          '/' - 63, 'A', 0, 0),
+                            result);
+  result = _mm_add_epi8(result, indices);
+  _mm_storeu_si128((__m128i *) to, result);
+}
+
+/**
+ * Decode 16 base64 characters to 12 bytes.
+ *
+ * @param[in]  from source
+ * @param[out] to destination, 16 bytes must be writable
+ *
+ * @returns FALSE if the source contains anything else than base64 characters
+ **/
+static inline gboolean
+z_code_base64_decode_block_ssse3(const guchar *from, guchar *to)
+{
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  __m128i in, hi_nibbles, lo_nibbles, lo, hi, roll, merged, out;
+
+  in = _mm_loadu_si128((const __m128i *) from);
+  hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+  lo_nibbles = _mm_and_si128(in, mask_2f);
+
+  /* validate: every character class is a bit, a character is valid if its
+   * high and low nibble has no class in common */
+  lo = _mm_shuffle_epi8(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                      0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a),
+                        lo_nibbles);
+  hi = _mm_shuffle_epi8(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10),
+                        hi_nibbles);
+  if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0)
+    return FALSE;
+
+  /* translate to 6-bit values, '/' shares its high nibble with '+' */
+  roll = _mm_shuffle_epi8(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0),
+                          _mm_add_epi8(_mm_cmpeq_epi8(in, mask_2f), hi_nibbles));
+  in = _mm_add_epi8(in, roll);
+
+  /* pack 4 x 6 bits to 3 bytes */
+  merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+  out = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+  out = _mm_shuffle_epi8(out, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  _mm_storeu_si128((__m128i *) to, out);
+  return TRUE;
+}
+
+#endif
+
+/**
+ * Encode whole groups of 3 bytes to base64.
+ *
+ * @param[in]  from source
+ * @param[in]  groups number of groups to encode
+ * @param[in]  avail number of readable bytes at from
+ * @param[out] to destination, 4 * groups characters are written
+ **/
+static void
+z_code_base64_encode_bulk(const guchar *from, gsize groups, gsize avail, guchar *to)
+{
+#ifdef Z_CODE_BASE64_SSSE3
+  for (; groups >= 4 && avail >= 16; groups -= 4, avail -= 12)
+    {
+      z_code_base64_encode_block_ssse3(from, to);
+      from += 12;
+      to += 16;
+    }
+#else
+  (void) avail;
+#endif
+  for (; groups > 0; groups--)
+    {
+      to[0] = z_code_base64_encode_xlat[from[0] >> 2];
+      to[1] = z_code_base64_encode_xlat[((from[0] & 0x03) << 4) | (from[1] >> 4)];
+      to[2] = z_code_base64_encode_xlat[((from[1] & 0x0f) << 2) | (from[2] >> 6)];
+      to[3] = z_code_base64_encode_xlat[from[2] & 0x3f];
+      from += 3;
+      to += 4;
+    }
+}
+
+/**
+ * Decode whole groups of 4 base64 characters.
+ *
+ * @param[in]  from source
+ * @param[in]  fromlen source length
+ * @param[out] to destination, 3 bytes are written for each group decoded, but with SSSE3 up to 4 bytes more may be overwritten
+ *
+ * Stops at the first group which contains anything else than base64
+ * characters.
+ *
+ * @returns the number of characters decoded, a multiple of 4
+ **/
+static gsize
+z_code_base64_decode_bulk(const guchar *from, gsize fromlen, guchar *to)
+{
+  gsize pos = 0;
+  gint a, b, c, d;
+
+#ifdef Z_CODE_BASE64_SSSE3
+  for (; pos + 16 <= fromlen; pos += 16)
+    {
+      if (!z_code_base64_decode_block_ssse3(from + pos, to))
+        break;
+      to += 12;
+    }
+#endif
+  for (; pos + 4 <= fromlen; pos += 4)
+    {
+      a = z_code_base64_decode_xlat[from[pos]];
+      b = z_code_base64_decode_xlat[from[pos + 1]];
+      c = z_code_base64_decode_xlat[from[pos + 2]];
+      d = z_code_base64_decode_xlat[from[pos + 3]];
+      if ((a | b | c | d) < 0)
+        break;
+      to[0] = (a << 2) | (b >> 4);
+      to[1] = (b << 4) | (c >> 2);
+      to[2] = (c << 6) | d;
+      to += 3;
+    }
+  return pos;
+}
+
 /**
  * Used internally by z_code_base64_encode_finish() to encode the remaining bits
  * and add padding.
@@ -78,15 +276,7 @@ typedef struct ZCodeBase64Decode
 static void
 z_code_base64_encode_fix(ZCodeBase64Encode *self, gboolean closure)
 {
-  static const char xlat[64] = 
-    {
-      'A', 'B', 'C', 'D',  'E', 'F', 'G', 'H',  'I', 'J', 'K', 'L',  'M', 'N', 'O', 'P',
-      'Q', 'R', 'S', 'T',  'U' ,'V', 'W', 'X',  'Y', 'Z', 'a', 'b',  'c', 'd', 'e', 'f',
-      'g', 'h', 'i', 'j',  'k', 'l', 'm', 'n',  'o', 'p', 'q', 'r',  's', 't', 'u', 'v',
-      'w', 'x', 'y', 'z',  '0', '1', '2', '3',  '4', '5', '6', '7',  '8', '9', '+', '/'
-    };
-
-  self->super.buf[self->super.buf_used] = closure ? '=' : xlat[self->super.buf[self->super.buf_used] & 0x3f]; 
+  self->super.buf[self->super.buf_used] = closure ? '=' : z_code_base64_encode_xlat[self->super.buf[self->super.buf_used] & 0x3f]; 
   self->super.buf_used++;
   if (self->linelen)
     {
@@ -155,6 +345,25 @@ z_code_base64_encode_transform(ZCode *s, const void *from_, gsize fromlen)
 
   for (pos = 0; pos < fromlen; pos++)
     {
+      if (self->phase == 0 && fromlen - pos >= 3)
+        {
+          gsize groups = (fromlen - pos) / 3;
+
+          /* stop before the group needing a line break */
+          if (self->linelen)
+            groups = MIN(groups, (gsize) MAX(self->linelen - self->linepos, 0) / 4);
+          if (groups)
+            {
+              z_code_base64_encode_bulk(from + pos, groups, fromlen - pos, self->super.buf + self->super.buf_used);
+              self->super.buf_used += groups * 4;
+              if (self->linelen)
+                self->linepos += groups * 4;
+              pos += groups * 3;
+              if (pos >= fromlen)
+                break;
+            }
+        }
+
       switch (self->phase)
         {
         case 0: /* no previous partial content, (00.. ...., 00.. ....) -> (00xx xxxx, 00xx ....) */
@@ -285,25 +494,6 @@ static gboolean
 z_code_base64_decode_transform(ZCode *s, const void *from_, gsize fromlen)
 {
   ZCodeBase64Decode *self = (ZCodeBase64Decode *) s;
-  static const int  xlat[256] =  /* -3=error, -2=end of stream, -1=ignore, other=value */
-    {   -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -1,   -1,   -3,    -3,   -1,   -3,   -3, /* 0x00 - 0x0f */
-        -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0x10 - 0x1f */
-        -1,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3, 0x3e,    -3,   -3,   -3, 0x3f, /* 0x20 - 0x2f */
-      0x34, 0x35, 0x36, 0x37,  0x38, 0x39, 0x3a, 0x3b,  0x3c, 0x3d,   -3,   -3,    -3,   -2,   -3,   -3, /* 0x30 - 0x3f */
-        -3, 0x00, 0x01, 0x02,  0x03, 0x04, 0x05, 0x06,  0x07, 0x08, 0x09, 0x0a,  0x0b, 0x0c, 0x0d, 0x0e, /* 0x40 - 0x4f */
-      0x0f, 0x10, 0x11, 0x12,  0x13, 0x14, 0x15, 0x16,  0x17, 0x18, 0x19,   -3,    -3,   -3,   -3,   -3, /* 0x50 - 0x5f */
-        -3, 0x1a, 0x1b, 0x1c,  0x1d, 0x1e, 0x1f, 0x20,  0x21, 0x22, 0x23, 0x24,  0x25, 0x26, 0x27, 0x28, /* 0x60 - 0x6f */
-      0x29, 0x2a, 0x2b, 0x2c,  0x2d, 0x2e, 0x2f, 0x30,  0x31, 0x32, 0x33,   -3,    -3,   -3,   -3,   -3, /* 0x70 - 0x7f */
-        -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0x80 - 0x8f */
-        -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0x90 - 0x9f */
-        -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0xa0 - 0xaf */
-        -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0xb0 - 0xbf */
-        -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0xc0 - 0xcf */
-        -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0xd0 - 0xdf */
-        -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3, /* 0xe0 - 0xef */
-        -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3,    -3,   -3,   -3,   -3  /* 0xf0 - 0xff */
-    };
-  
   gsize pos, buf_used_orig;
   gint value;
   const guchar *from = from_;
@@ -325,7 +515,17 @@ z_code_base64_decode_transform(ZCode *s, const void *from_, gsize fromlen)
   value = -1;
   for (pos = 0; pos < fromlen; pos++)
     {
-      value = xlat[(guchar)from[pos]];
+      if (self->phase == 0 && fromlen - pos >= 4)
+        {
+          gsize done = z_code_base64_decode_bulk(from + pos, fromlen - pos, self->super.buf + self->super.buf_used);
+
+          self->super.buf_used += done / 4 * 3;
+          pos += done;
+          if (pos >= fromlen)
+            break;
+        }
+
+      value = z_code_base64_decode_xlat[(guchar)from[pos]];
       if (value == -1)        /* ignore */
         continue;
       else if (value == -2)   /* end of stream */
@@ -37,6 +37,103 @@
 
 #define MAX_ACCEPTS_AT_A_TIME 50
 
+/**
+ * Number of connections accepted before they are passed to the callbacks
+ * in batch mode.
+ **/
+#define Z_LISTENER_ACCEPT_BATCH 16
+
+/**
+ * Pass a batch of accepted connections to the user callbacks.
+ *
+ * @param[in] self ZListener instance
+ * @param[in] streams accepted streams
+ * @param[in] clients client addresses
+ * @param[in] dests destination addresses
+ * @param[in] count number of connections in the batch
+ *
+ * Uses the batch callback if one was set, the per-connection callback
+ * otherwise. If the listener is cancelled by a callback, the rest of the
+ * batch is closed.
+ *
+ * @returns the return value of the callbacks
+ **/
+static gboolean
+z_listener_deliver_batch(ZListener *self, ZStream **streams, ZSockAddr **clients, ZSockAddr **dests, gint count)
+{
+  gboolean rc = TRUE;
+  gint i = 0;
+
+  if (count == 0)
+    return TRUE;
+
+  if (self->batch_callback)
+    return self->batch_callback(streams, clients, dests, count, self->user_data);
+
+  for (i = 0; i < count && rc && self->watch; i++)
+    rc = self->callback(streams[i], clients[i], dests[i], self->user_data);
+
+  for (; i < count; i++)
+    {
+      z_stream_close(streams[i], NULL);
+      z_stream_unref(streams[i]);
+      z_sockaddr_unref(clients[i]);
+      z_sockaddr_unref(dests[i]);
+    }
+  return rc;
+}
+
+/**
+ * Accept connections in batch mode.
+ *
+ * @param[in]  self ZListener instance
+ * @param[out] accepts number of connections accepted
+ *
+ * Accepts connections until the queue is drained or self->accept_budget
+ * connections were accepted, collecting them into batches of
+ * Z_LISTENER_ACCEPT_BATCH connections before calling the user. Contrary to
+ * the default mode, there is no wall-clock based cutoff.
+ *
+ * @returns whether further callbacks should be delivered
+ **/
+static gboolean
+z_listener_accept_batch(ZListener *self, gint *accepts)
+{
+  ZStream *streams[Z_LISTENER_ACCEPT_BATCH];
+  ZSockAddr *clients[Z_LISTENER_ACCEPT_BATCH], *dests[Z_LISTENER_ACCEPT_BATCH];
+  gint budget = (self->sock_flags & ZSF_ACCEPT_ONE) ? 1 : self->accept_budget;
+  gboolean rc = TRUE, drained = FALSE;
+  GIOStatus res = G_IO_STATUS_NORMAL;
+  gint count;
+
+  while (!drained && rc && *accepts < budget && !z_socket_source_is_suspended(self->watch))
+    {
+      for (count = 0; count < Z_LISTENER_ACCEPT_BATCH && *accepts + count < budget; count++)
+        {
+          res = Z_FUNCS(self, ZListener)->accept_connection(self, &streams[count], &clients[count], &dests[count]);
+          if (res != G_IO_STATUS_NORMAL)
+            break;
+          if (!(self->sock_flags & ZSF_ACCEPT_NONBLOCK))
+            z_stream_set_nonblock(streams[count], 0);
+        }
+      *accepts += count;
+      drained = res != G_IO_STATUS_NORMAL;
+
+      rc = z_listener_deliver_batch(self, streams, clients, dests, count);
+      if (rc && res == G_IO_STATUS_ERROR && self->watch)
+        {
+          /* report the error the same way as the default mode does */
+          rc = self->callback(NULL, NULL, NULL, self->user_data);
+          (*accepts)++;
+        }
+      if (self->sock_flags & ZSF_ACCEPT_ONE)
+        rc = FALSE;
+      if (!self->watch)
+        break;
+    }
+  return rc;
+}
+
 
 /**
  * Private callback used as the callback of #ZSocketSource which
@@ -75,6 +172,11 @@ z_listener_accept(gboolean timed_out G_GNUC_UNUSED, gpointer data)
     }
     
   z_listener_ref((ZListener *) self);
+  if (self->accept_budget > 0)
+    {
+      rc = z_listener_accept_batch(self, &accepts);
+      goto exit;
+    }
   start=time(NULL);
   while (!z_socket_source_is_suspended(self->watch) && rc && accepts < MAX_ACCEPTS_AT_A_TIME && start == time(NULL))
     {  
@@ -85,7 +187,8 @@ z_listener_accept(gboolean timed_out G_GNUC_UNUSED, gpointer data)
 //FIXMEEEEEEEEEEEE
 //          WSAEventSelect(newfd, 0, 0);
 #endif
-          z_stream_set_nonblock(newstream, 0);
+          if (!(self->sock_flags & ZSF_ACCEPT_NONBLOCK))
+            z_stream_set_nonblock(newstream, 0);
         }
       else if (res == G_IO_STATUS_AGAIN)
         {
@@ -104,6 +207,7 @@ z_listener_accept(gboolean timed_out G_GNUC_UNUSED, gpointer data)
       if (!self->watch)
         break;
     }
+ exit:
   z_listener_unref((ZListener *) self);
   g_static_rec_mutex_unlock(&self->lock);
   
@@ -243,6 +347,32 @@ z_listener_resume(ZListener *self)
   z_return();
 }
 
+/**
+ * Switch the listener to batch mode.
+ *
+ * @param[in] self ZListener instance
+ * @param[in] budget maximum number of connections accepted in a single wakeup, 0 to return to the default mode
+ * @param[in] batch_callback function to call with a batch of accepted connections, NULL to call the per-connection callback for each
+ *
+ * In batch mode connections are accepted until the accept queue is empty
+ * or budget connections were accepted in the current wakeup, and they are
+ * passed to the user in batches. The default mode accepts at most
+ * MAX_ACCEPTS_AT_A_TIME connections within a single second per wakeup. The
+ * batch callback gets the references of the streams and addresses, just
+ * like the per-connection callback. Combine with ZSF_ACCEPT_NONBLOCK to
+ * avoid the extra fcntl() calls on each accepted socket.
+ **/
+void
+z_listener_set_accept_batch(ZListener *self, gint budget, ZAcceptBatchFunc batch_callback)
+{
+  z_enter();
+  g_static_rec_mutex_lock(&self->lock);
+  self->accept_budget = MAX(budget, 0);
+  self->batch_callback = batch_callback;
+  g_static_rec_mutex_unlock(&self->lock);
+  z_return();
+}
+
 /**
  * Cancel listening.
  *
@@ -426,6 +556,15 @@ z_stream_listener_accept_connection(ZListener *self, ZStream **fdstream, ZSockAd
     {
       return res;
     }
+#if !HAVE_ACCEPT4
+  if (self->sock_flags & ZSF_ACCEPT_NONBLOCK)
+    {
+      z_fd_set_nonblock(newfd, TRUE);
+#ifndef G_OS_WIN32
+      fcntl(newfd, F_SETFD, FD_CLOEXEC);
+#endif
+    }
+#endif
   *fdstream = z_stream_fd_new(newfd, "");
   *dest = NULL;
   z_getdestname(newfd, dest, self->sock_flags);
@@ -450,6 +589,124 @@ z_stream_listener_new(const gchar *session_id,
   return &self->super;
 }
 
+/**
+ * Create a group of stream listeners sharing the same address.
+ *
+ * @param[in] session_id session id
+ * @param[in] local address to bind to
+ * @param[in] sock_flags a combination of socket flags (ZSF_*), ZSF_REUSEPORT is added
+ * @param[in] backlog listen backlog of each socket
+ * @param[in] callback function to call when an incoming connection is accepted
+ * @param[in] user_data opaque pointer passed to callback
+ * @param[in] num number of listening sockets
+ *
+ * The kernel distributes incoming connections among the sockets of the
+ * group, each of which is polled in the GMainContext given to
+ * z_listener_group_start(). The callback is therefore called from several
+ * threads concurrently. Only IPv4 and IPv6 addresses can be shared, for
+ * other address families a single listener is created.
+ *
+ * @returns the new ZListenerGroup instance
+ **/
+ZListenerGroup *
+z_stream_listener_group_new(const gchar *session_id,
+                            ZSockAddr *local,
+                            guint32 sock_flags,
+                            gint backlog,
+                            ZAcceptFunc callback,
+                            gpointer user_data,
+                            gint num)
+{
+  ZListenerGroup *self;
+  gint i;
+
+  z_enter();
+  if (local->sa.sa_family != AF_INET && local->sa.sa_family != AF_INET6)
+    num = 1;
+  self = g_new0(ZListenerGroup, 1);
+  self->num = MAX(num, 1);
+  self->listeners = g_new0(ZListener *, self->num);
+  for (i = 0; i < self->num; i++)
+    self->listeners[i] = z_stream_listener_new(session_id, local, sock_flags | ZSF_REUSEPORT, backlog, callback, user_data);
+  z_return(self);
+}
+
+/**
+ * Open the sockets of a listener group and start polling them.
+ *
+ * @param[in] self ZListenerGroup instance
+ * @param[in] contexts array of self->num GMainContexts, one for each listener
+ *
+ * The first socket is opened on the requested address, the others are
+ * bound to the address it actually got, so that a group listening on a
+ * kernel chosen port shares a single port.
+ *
+ * @returns TRUE on success, FALSE if any of the listeners failed to start (those already started are cancelled)
+ **/
+gboolean
+z_listener_group_start(ZListenerGroup *self, GMainContext **contexts)
+{
+  gint i;
+
+  z_enter();
+  if (!z_listener_open(self->listeners[0]))
+    z_return(FALSE);
+
+  for (i = 1; i < self->num; i++)
+    {
+      ZListener *l = self->listeners[i];
+
+      z_sockaddr_unref(l->bind_addr);
+      l->bind_addr = z_sockaddr_ref(self->listeners[0]->local);
+    }
+
+  for (i = 0; i < self->num; i++)
+    {
+      if (!z_listener_start_in_context(self->listeners[i], contexts[i]))
+        {
+          z_listener_group_cancel(self);
+          z_return(FALSE);
+        }
+    }
+  z_return(TRUE);
+}
+
+/**
+ * Cancel all listeners of the group.
+ *
+ * @param[in] self ZListenerGroup instance
+ *
+ * @see z_listener_cancel()
+ **/
+void
+z_listener_group_cancel(ZListenerGroup *self)
+{
+  gint i;
+
+  z_enter();
+  for (i = 0; i < self->num; i++)
+    z_listener_cancel(self->listeners[i]);
+  z_return();
+}
+
+/**
+ * Free a listener group, dropping the references to its listeners.
+ *
+ * @param[in] self ZListenerGroup instance
+ **/
+void
+z_listener_group_free(ZListenerGroup *self)
+{
+  gint i;
+
+  z_enter();
+  for (i = 0; i < self->num; i++)
+    z_listener_unref(self->listeners[i]);
+  g_free(self->listeners);
+  g_free(self);
+  z_return();
+}
+
 /**
  * ZListener virtual methods.
  **/
@@ -42,6 +42,7 @@
 #  include <signal.h>
 #  include <sys/socket.h>
 #  include <sys/un.h>
+#  include <sys/uio.h>
 #endif
 
 #ifdef G_OS_WIN32  
@@ -65,14 +66,82 @@ z_unhandled_exception_filter_function *z_setup_unhandled_exception_filter = &z_u
 #define Z_EXTREMAL_BOOLEAN ((gboolean)(7*(int)TRUE + 1))
 
 /**
- * Per-thread GHashTable based logtag cache.
+ * Number of slots in the global logtag cache, must be a power of 2.
  **/
-typedef struct _ZLogTagCache
+#define Z_LOG_TAG_CACHE_SIZE 2048
+
+/**
+ * Maximum number of slots probed when looking up a tag in the logtag cache.
+ **/
+#define Z_LOG_TAG_CACHE_PROBES 32
+
+/**
+ * Slot of the global logtag cache. Tags are identified by their address,
+ * so they must be string literals. name is a private copy of the tag
+ * confirming a hit, in case the address is reused for a different tag
+ * anyway. value holds the logspec epoch it was evaluated in (upper bits)
+ * and the verbosity level + 1 (lower 8 bits, 0 means not yet evaluated),
+ * so that both can be read with a single load. limit holds the epoch and
+ * the index of the rate limit applying to the tag + 1 (0 means no limit)
+ * the same way.
+ **/
+typedef struct _ZLogTagCacheEntry
+{
+  gpointer tag;
+  gpointer name;
+  gint value;
+  gint limit;
+} ZLogTagCacheEntry;
+
+/**
+ * Maximum number of rate limited patterns in a logspec.
+ **/
+#define Z_LOG_LIMITS_MAX 254
+
+/**
+ * Interval of reporting messages suppressed by rate limits, in seconds.
+ **/
+#define Z_LOG_LIMIT_REPORT_INTERVAL 10
+
+/**
+ * Number of records the asynchronous log queue can hold, must be a power of 2.
+ **/
+#define Z_LOG_ASYNC_QUEUE_SIZE 4096
+
+/**
+ * Maximum number of records sent to syslog at once by the log writer thread.
+ **/
+#define Z_LOG_ASYNC_BATCH 64
+
+/**
+ * Initial position of the asynchronous log queue. Positions wrap around
+ * after 2^32 records, starting right below that makes every process run
+ * into the wraparound early instead of after weeks of logging.
+ **/
+#define Z_LOG_ASYNC_INITIAL_POS ((guint) -Z_LOG_ASYNC_QUEUE_SIZE)
+
+/**
+ * Header of a deferred log message, followed by the message tag, the format
+ * string and the captured argument values, see z_log_args_new().
+ **/
+typedef struct _ZLogArgs
+{
+  gint level;
+  gpointer thread;
+  gsize tag_len;
+  gsize format_len;
+} ZLogArgs;
+
+/**
+ * Slot of the asynchronous log queue.
+ **/
+typedef struct _ZLogRecord
 {
-  gboolean empty_hash;
-  gboolean used;
-  GHashTable *tag_hash;
-} ZLogTagCache;
+  guint seq;            /**< position the slot is ready for, see z_log_async_push() */
+  gint pri;
+  gchar *msg;
+  ZLogArgs *args;       /**< deferred message to be formatted by the writer thread instead of msg */
+} ZLogRecord;
 
 /**
  * Parsed item of a ZLogSpec, pattern and verbosity_level.
@@ -81,6 +150,10 @@ typedef struct _ZLogSpecItem
 {
   gchar *pattern;
   gint verbose_level;
+  gint limit;           /**< index of the rate limit of the pattern, -1 if it has none */
+  gint rate;            /**< messages per second, 0 if not rate limited */
+  gint burst;           /**< token bucket size */
+  gint sample;          /**< only every sample-th message is logged, 0 if not sampled */
 } ZLogSpecItem;
 
 /**
@@ -90,8 +163,44 @@ typedef struct _ZLogSpec
 {
   GSList *items;
   gint verbose_level;
+  gint limits_count;
 } ZLogSpec;
 
+/**
+ * Per-thread state of a rate limited logspec pattern.
+ **/
+typedef struct _ZLogLimitState
+{
+  gchar *pattern;
+  gint rate;
+  gint burst;
+  gint sample;
+  gint64 tokens;        /**< available messages * 1000 */
+  gint64 last;          /**< time of the last refill in milliseconds */
+  guint seen;
+  gint suppressed;      /**< taken atomically by z_log_limits_flush() */
+} ZLogLimitState;
+
+/**
+ * Number of messages suppressed by a rate limit, to be logged.
+ **/
+typedef struct _ZLogLimitReport
+{
+  gchar *pattern;
+  guint suppressed;
+} ZLogLimitReport;
+
+/**
+ * Rate limit buckets of a thread, reinitialized when the logspec changes.
+ **/
+typedef struct _ZLogLimits
+{
+  gint epoch;
+  gint count;
+  ZLogLimitState *states;
+  gboolean exited;      /**< the thread has exited, freed by z_log_limits_flush() */
+} ZLogLimits;
+
 /**
  * Logging options.
  **/
@@ -107,10 +216,9 @@ ZLogOpts log_opts = {0, FALSE, FALSE, NULL};
 
 ZLogOpts log_opts_cmdline = {-1, Z_EXTREMAL_BOOLEAN, Z_EXTREMAL_BOOLEAN, NULL};
 
-/** Protects logtag_caches array when grabbing and releasing a thread specific log cache */
-static GStaticMutex logtag_cache_lock = G_STATIC_MUTEX_INIT;
-static GStaticPrivate current_logtag_cache = G_STATIC_PRIVATE_INIT;
-static GPtrArray *logtag_caches;
+/** Lock-free logtag cache shared by all threads, invalidated by incrementing logtag_cache_epoch */
+static ZLogTagCacheEntry logtag_cache[Z_LOG_TAG_CACHE_SIZE];
+static gint logtag_cache_epoch;
 
 /** Protects log_spec/log_spec_str */
 static GStaticMutex log_spec_lock = G_STATIC_MUTEX_INIT;
@@ -118,6 +226,11 @@ static ZLogSpec log_spec;
 static gchar *log_spec_str;
 static gboolean log_escape_nonprintable_chars = FALSE;
 
+/** Protects log_limits_threads and the states of its items, see z_log_limits_flush() */
+static GStaticMutex log_limits_lock = G_STATIC_MUTEX_INIT;
+static GSList *log_limits_threads;
+static gint log_limits_report_due;
+
 static ZLogMapTagFunc log_map_tag;
 static gint log_mapped_tags_count;
 static guchar *log_mapped_tags_verb;
@@ -129,6 +242,24 @@ gchar fake_session_id[256] = "nosession";
 
 static GMainContext *log_context = NULL;
 
+/* asynchronous syslog writer state, see z_log_enable_async() */
+static ZLogRecord *log_async_queue;
+static guint log_async_head;
+static guint log_async_tail;
+static gint log_async_dropped;
+static gint log_async_sleeping;
+static gint log_async_blocked;
+static gint log_async_pushing;
+static gboolean log_async_block;
+static gint log_async_quit;
+static GMutex *log_async_lock;
+static GCond *log_async_wakeup;
+static GCond *log_async_space;
+static GThread *log_async_thread;
+static gint log_deferred_level = G_MAXINT;
+static gboolean log_syslog_active;
+static gchar *syslog_socket;
+
 #ifndef G_OS_WIN32
 /*
  * This is a private reimplementation of syslog() as that one had a
@@ -141,6 +272,23 @@ static GMainContext *log_context = NULL;
 
 const gchar *syslog_tag = NULL;
 int syslog_fd = -1;
+static gboolean syslog_stream = FALSE;
+static gchar *syslog_batch_buf;
+
+/*
+ * NOTE: We limit the log message size to 8192 now. Hope it will be enough.
+ * IIRC syslog-ng can only handle 8k long messages.
+ */
+#define Z_SYSLOG_MAX_RECORD 8192
+
+/**
+ * Cached syslog timestamp, it is only formatted once a second.
+ **/
+typedef struct _ZSyslogTimestamp
+{
+  time_t stamp;
+  gchar buf[32];
+} ZSyslogTimestamp;
 
 
 /**
@@ -164,10 +312,12 @@ z_open_syslog(const gchar *tag)
     }
   
   s_un.sun_family = AF_UNIX;
-  g_strlcpy(s_un.sun_path, SYSLOG_SOCKET, sizeof(s_un.sun_path));
+  g_strlcpy(s_un.sun_path, syslog_socket ? syslog_socket : SYSLOG_SOCKET, sizeof(s_un.sun_path));
+  syslog_stream = TRUE;
   if (connect(syslog_fd, (struct sockaddr *) &s_un, sizeof(s_un)) == -1)
     {
       close(syslog_fd);
+      syslog_stream = FALSE;
       syslog_fd = socket(PF_UNIX, SOCK_DGRAM, 0);
       if (connect(syslog_fd, (struct sockaddr *) &s_un, sizeof(s_un)) == -1)
         {
@@ -212,38 +362,60 @@ z_close_syslog(void)
 }
 
 /**
- * Send the specified message to syslog.
+ * Return the current time formatted for syslog.
  *
- * @param[in] pri syslog priority 
- * @param[in] msg syslog message
+ * The formatted value is cached per thread and only regenerated when the
+ * second changes, as localtime_r() and strftime() are expensive compared
+ * to the rest of the syslog path.
+ *
+ * @returns pointer to a per-thread buffer holding the timestamp
  **/
-gboolean
-z_send_syslog(gint pri, const gchar *msg)
+static const gchar *
+z_syslog_timestamp(void)
 {
-  /*
-   * NOTE: We limit the log message size to 8192 now. Hope it will be enough.
-   * IIRC syslog-ng can only handle 8k long messages.
-   */
-  gchar buf[8192];
-  const guchar *p;
-  gchar timestamp[32];
+  static GStaticPrivate timestamp_key = G_STATIC_PRIVATE_INIT;
+  ZSyslogTimestamp *ts = g_static_private_get(&timestamp_key);
   time_t now;
   struct tm t;
-  guint len, attempt = 0;
-  gint rc = 0;
-  int sfd = syslog_fd;
-  static GStaticMutex lock = G_STATIC_MUTEX_INIT;
-  
+
+  if (!ts)
+    {
+      ts = g_new0(ZSyslogTimestamp, 1);
+      ts->stamp = (time_t) -1;
+      g_static_private_set(&timestamp_key, ts, g_free);
+    }
   now = time(NULL);
-  localtime_r(&now, &t);
-  
-  strftime(timestamp, sizeof(timestamp), "%h %e %H:%M:%S", &t);
-  
-  g_snprintf(buf, sizeof(buf), "<%d>%s %s[%d]: ", pri, timestamp, syslog_tag, (int) getpid());
+  if (now != ts->stamp)
+    {
+      localtime_r(&now, &t);
+      strftime(ts->buf, sizeof(ts->buf), "%h %e %H:%M:%S", &t);
+      ts->stamp = now;
+    }
+  return ts->buf;
+}
+
+/**
+ * Format a syslog record including the priority, timestamp and program
+ * name header.
+ *
+ * @param[in] buf buffer to format the record into
+ * @param[in] size size of buf
+ * @param[in] pri syslog priority
+ * @param[in] msg syslog message
+ *
+ * @returns the length of the record
+ **/
+static guint
+z_syslog_format(gchar *buf, gsize size, gint pri, const gchar *msg)
+{
+  const guchar *p;
+  guint len;
+
+  g_snprintf(buf, size, "<%d>%s %s[%d]: ", pri, z_syslog_timestamp(), syslog_tag, (int) getpid());
   if (log_escape_nonprintable_chars)
     {
       len = strlen(buf);
-      for (p = (guchar *) msg; *p && len < sizeof(buf) - 5; p++)
+      for (p = (guchar *) msg; *p && len < size - 5; p++)
         {
           if (*p >= 0x20 && *p <= 0x7F)
             {
@@ -258,31 +430,142 @@ z_send_syslog(gint pri, const gchar *msg)
     }
   else
     {
-      g_strlcat(buf, msg, sizeof(buf) - 1);
+      g_strlcat(buf, msg, size - 1);
       len = strlen(buf);
     }
   buf[len++] = '\n';
   buf[len] = 0;
+  return len;
+}
+
+/**
+ * Reopen the syslog connection after an error.
+ *
+ * @param[in] sfd the connection that failed
+ *
+ * The connection is only reopened if no other thread did it already.
+ *
+ * @returns the new syslog connection
+ **/
+static int
+z_syslog_reopen(int sfd)
+{
+  static GStaticMutex lock = G_STATIC_MUTEX_INIT;
+
+  g_static_mutex_lock(&lock);
+  if (sfd == syslog_fd)
+    {
+      z_open_syslog(syslog_tag);
+      z_close_syslog_internal(sfd);
+    }
+  sfd = syslog_fd;
+  g_static_mutex_unlock(&lock);
+  return sfd;
+}
+
+/**
+ * Send the specified message to syslog.
+ *
+ * @param[in] pri syslog priority 
+ * @param[in] msg syslog message
+ **/
+gboolean
+z_send_syslog(gint pri, const gchar *msg)
+{
+  gchar buf[Z_SYSLOG_MAX_RECORD];
+  guint len, attempt = 0;
+  gint rc = 0;
+  int sfd = syslog_fd;
+  
+  len = z_syslog_format(buf, sizeof(buf), pri, msg);
   do
     {
       attempt++;
       if (sfd != -1)
         rc = write(sfd, buf, len);
       if (sfd == -1 || (rc == -1 && errno != EINTR && errno != EAGAIN))
+        sfd = z_syslog_reopen(sfd);
+    }    
+  while (rc == -1 && attempt <= 1);
+  return TRUE;
+}
+
+/**
+ * Send a batch of records to syslog.
+ *
+ * @param[in] pris priorities of the records
+ * @param[in] msgs the records
+ * @param[in] count number of records (at most Z_LOG_ASYNC_BATCH)
+ *
+ * Stream connections get all records with a single writev(), datagram
+ * connections with a single sendmmsg() where available. The connection
+ * is reopened once on error, after that the rest of the batch is dropped.
+ *
+ * @note only called from the log writer thread
+ **/
+static void
+z_send_syslog_batch(gint *pris, gchar **msgs, gint count)
+{
+  struct iovec vec[Z_LOG_ASYNC_BATCH];
+  int sfd = syslog_fd;
+  gint i, rc, failures = 0;
+  gsize written;
+#if HAVE_SENDMMSG
+  struct mmsghdr hdrs[Z_LOG_ASYNC_BATCH];
+  gint j;
+#endif
+
+  if (!syslog_batch_buf)
+    syslog_batch_buf = g_malloc(Z_LOG_ASYNC_BATCH * Z_SYSLOG_MAX_RECORD);
+  for (i = 0; i < count; i++)
+    {
+      vec[i].iov_base = syslog_batch_buf + i * Z_SYSLOG_MAX_RECORD;
+      vec[i].iov_len = z_syslog_format(vec[i].iov_base, Z_SYSLOG_MAX_RECORD, pris[i], msgs[i]);
+    }
+
+  i = 0;
+  while (i < count && failures <= 1)
+    {
+      rc = -1;
+      if (sfd != -1 && syslog_stream)
         {
-          g_static_mutex_lock(&lock);
-          if (sfd == syslog_fd)
+          rc = writev(sfd, &vec[i], count - i);
+          if (rc > 0)
             {
-              z_open_syslog(syslog_tag);
-              z_close_syslog_internal(sfd);
+              written = rc;
+              while (i < count && written >= vec[i].iov_len)
+                written -= vec[i++].iov_len;
+              if (written)
+                {
+                  vec[i].iov_base = (gchar *) vec[i].iov_base + written;
+                  vec[i].iov_len -= written;
+                }
             }
-            
-          sfd = syslog_fd;
-          g_static_mutex_unlock(&lock);
         }
-    }    
-  while (rc == -1 && attempt <= 1);
-  return TRUE;
+      else if (sfd != -1)
+        {
+#if HAVE_SENDMMSG
+          memset(hdrs, 0, sizeof(hdrs));
+          for (j = 0; j < count - i; j++)
+            {
+              hdrs[j].msg_hdr.msg_iov = &vec[i + j];
+              hdrs[j].msg_hdr.msg_iovlen = 1;
+            }
+          rc = sendmmsg(sfd, hdrs, count - i, 0);
+          if (rc > 0)
+            i += rc;
+#else
+          rc = write(sfd, vec[i].iov_base, vec[i].iov_len);
+          if (rc >= 0)
+            i++;
+#endif
+        }
+      if (sfd == -1 || (rc == -1 && errno != EINTR))
+        {
+          failures++;
+          sfd = z_syslog_reopen(sfd);
+        }
+    }
 }
 
 #else
@@ -313,73 +596,859 @@ z_open_syslog(const gchar *tag)
 gboolean
 z_close_syslog(void)
 {
-  closelog();
-  return TRUE;
+  closelog();
+  return TRUE;
+}
+
+/**
+ * Send a message to syslogd. It uses the syslog() function in libc.
+ *
+ * @param[in] pri priority of the message 
+ * @param[in] msg message itself
+ *
+ * @returns always TRUE.
+ **/
+gboolean
+z_send_syslog(gint pri, const gchar *msg)
+{
+  syslog(pri, "%s", msg);
+  return TRUE;
+}
+
+/**
+ * Send a batch of records to syslog, libc version.
+ *
+ * @param[in] pris priorities of the records
+ * @param[in] msgs the records
+ * @param[in] count number of records
+ **/
+static void
+z_send_syslog_batch(gint *pris, gchar **msgs, gint count)
+{
+  gint i;
+
+  for (i = 0; i < count; i++)
+    syslog(pris[i], "%s", msgs[i]);
+}
+
+#endif
+
+#else
+
+int syslog_fd = -1;
+
+/**
+ * Analogous to openlog(), open the syslog() connection to local syslogd. 
+ *
+ * @param[in] tag program name used in log messages
+ *
+ * Windows implementation.
+ *
+ * @returns TRUE when the operation succeeds
+ **/
+gboolean
+z_open_syslog(const gchar *tag)
+{  
+  char fn[256];
+
+  g_strlcpy(fn, getenv("windir"), sizeof(fn));
+  g_strlcat(fn, "\\debug\\", sizeof(fn));
+  g_strlcat(fn, tag, sizeof(fn)); 
+
+  if((syslog_fd = open(fn, _O_APPEND | _O_RDWR | _O_CREAT, _S_IREAD | _S_IWRITE  )) == -1)
+    {
+      close(syslog_fd);
+      syslog_fd = -1;
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/**
+ * Close the connection to the local syslog process. 
+ **/
+gboolean
+z_close_syslog(void)
+{
+  if (syslog_fd != -1)
+    {
+      close(syslog_fd);
+      return TRUE;
+    }
+  return FALSE;
+}
+
+#endif
+
+/**
+ * Set the socket used to connect to the local syslogd instead of /dev/log.
+ *
+ * @param[in] path path of the unix domain socket, NULL restores the default
+ *
+ * It takes effect when the syslog connection is (re)opened and only with
+ * the private syslog implementation, libc syslog() always uses its own.
+ **/
+void
+z_log_set_syslog_socket(const gchar *path)
+{
+  g_free(syslog_socket);
+  syslog_socket = g_strdup(path);
+}
+
+#ifndef G_OS_WIN32
+
+/* deferred message formatting
+ *
+ * Instead of formatting the message in the logging thread, z_logv() can
+ * copy the format string and the raw argument values to a binary record,
+ * which is formatted by the log writer thread. The record is built in a
+ * per-thread buffer: a ZLogArgs header followed by the tag, the format
+ * string and the values in the order they are consumed by the format
+ * string. Strings are copied, everything else is stored by value.
+ */
+
+/**
+ * Type of the value consumed by a printf conversion.
+ **/
+typedef enum
+{
+  Z_LOG_ARG_NONE,
+  Z_LOG_ARG_INT,
+  Z_LOG_ARG_LONG,
+  Z_LOG_ARG_INT64,
+  Z_LOG_ARG_SIZE,
+  Z_LOG_ARG_DOUBLE,
+  Z_LOG_ARG_LDOUBLE,
+  Z_LOG_ARG_STRING,
+  Z_LOG_ARG_POINTER,
+  Z_LOG_ARG_UNSUPPORTED
+} ZLogArgType;
+
+/**
+ * Parsed printf conversion specification.
+ **/
+typedef struct _ZLogConversion
+{
+  gsize length;                 /**< length of the specification including the '%' */
+  gboolean star_width;
+  gboolean star_precision;
+  gint precision;               /**< literal precision, -1 if not present */
+  ZLogArgType type;
+} ZLogConversion;
+
+/** Longest conversion specification handled by deferred formatting */
+#define Z_LOG_CONVERSION_MAX 32
+
+/**
+ * Parse a printf conversion specification.
+ *
+ * @param[in]  spec the specification, points to the '%' character
+ * @param[out] conv the parsed specification
+ *
+ * Positional arguments, %n, %m and wide characters are reported as
+ * Z_LOG_ARG_UNSUPPORTED, messages using them are formatted immediately.
+ *
+ * @returns the position after the specification
+ **/
+static const gchar *
+z_log_conversion_parse(const gchar *spec, ZLogConversion *conv)
+{
+  const gchar *p = spec + 1;
+  gchar size = 0;
+
+  conv->star_width = conv->star_precision = FALSE;
+  conv->precision = -1;
+  conv->type = Z_LOG_ARG_UNSUPPORTED;
+
+  if (*p == '%')
+    {
+      conv->type = Z_LOG_ARG_NONE;
+      conv->length = 2;
+      return p + 1;
+    }
+
+  while (*p && strchr("-+ #0'I", *p))
+    p++;
+  if (*p == '*')
+    {
+      conv->star_width = TRUE;
+      p++;
+    }
+  while (g_ascii_isdigit(*p))
+    p++;
+  if (*p == '$' || (conv->star_width && g_ascii_isdigit(*(p - 1))))
+    goto exit;
+
+  if (*p == '.')
+    {
+      p++;
+      if (*p == '*')
+        {
+          conv->star_precision = TRUE;
+          p++;
+        }
+      else
+        {
+          conv->precision = 0;
+          for (; g_ascii_isdigit(*p); p++)
+            conv->precision = MIN(conv->precision * 10 + (*p - '0'), G_MAXINT / 10);
+        }
+    }
+
+  switch (*p)
+    {
+    case 'h':
+      p += (*(p + 1) == 'h') ? 2 : 1;
+      break;
+    case 'l':
+      if (*(p + 1) == 'l')
+        {
+          size = 'q';
+          p += 2;
+        }
+      else
+        {
+          size = 'l';
+          p++;
+        }
+      break;
+    case 'q':
+    case 'L':
+    case 'j':
+    case 't':
+      size = *p++;
+      break;
+    case 'z':
+    case 'Z':
+      size = 'z';
+      p++;
+      break;
+    }
+
+  switch (*p)
+    {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+      switch (size)
+        {
+        case 'l':
+          conv->type = Z_LOG_ARG_LONG;
+          break;
+        case 'q':
+        case 'L':
+        case 'j':
+          conv->type = Z_LOG_ARG_INT64;
+          break;
+        case 'z':
+        case 't':
+          conv->type = Z_LOG_ARG_SIZE;
+          break;
+        default:
+          conv->type = Z_LOG_ARG_INT;
+          break;
+        }
+      break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      conv->type = size == 'L' ? Z_LOG_ARG_LDOUBLE : Z_LOG_ARG_DOUBLE;
+      break;
+    case 'c':
+      if (size == 0)
+        conv->type = Z_LOG_ARG_INT;
+      break;
+    case 's':
+      if (size == 0)
+        conv->type = Z_LOG_ARG_STRING;
+      break;
+    case 'p':
+      conv->type = Z_LOG_ARG_POINTER;
+      break;
+    }
+  if (*p)
+    p++;
+
+ exit:
+  conv->length = p - spec;
+  if (conv->length >= Z_LOG_CONVERSION_MAX)
+    conv->type = Z_LOG_ARG_UNSUPPORTED;
+  return p;
+}
+
+#define Z_LOG_ARGS_CAPTURE(buf, type, ap) \
+  do \
+    { \
+      type __v = va_arg(ap, type); \
+      g_byte_array_append(buf, (guint8 *) &__v, sizeof(__v)); \
+    } \
+  while (0)
+
+/**
+ * Copy the arguments consumed by a format string to a buffer.
+ *
+ * @param[in] buf buffer to append the values to
+ * @param[in] format printf format string
+ * @param[in] ap arguments
+ *
+ * @returns FALSE if the format string cannot be formatted later
+ **/
+static gboolean
+z_log_args_capture(GByteArray *buf, const gchar *format, va_list ap)
+{
+  ZLogConversion conv;
+  const gchar *p = format;
+  const gchar *str;
+  gint star;
+  gsize len;
+
+  while ((p = strchr(p, '%')) != NULL)
+    {
+      p = z_log_conversion_parse(p, &conv);
+      if (conv.star_width)
+        Z_LOG_ARGS_CAPTURE(buf, gint, ap);
+      if (conv.star_precision)
+        {
+          star = va_arg(ap, gint);
+          g_byte_array_append(buf, (guint8 *) &star, sizeof(star));
+          conv.precision = star >= 0 ? star : -1;
+        }
+
+      switch (conv.type)
+        {
+        case Z_LOG_ARG_NONE:
+          break;
+        case Z_LOG_ARG_INT:
+          Z_LOG_ARGS_CAPTURE(buf, gint, ap);
+          break;
+        case Z_LOG_ARG_LONG:
+          Z_LOG_ARGS_CAPTURE(buf, glong, ap);
+          break;
+        case Z_LOG_ARG_INT64:
+          Z_LOG_ARGS_CAPTURE(buf, gint64, ap);
+          break;
+        case Z_LOG_ARG_SIZE:
+          Z_LOG_ARGS_CAPTURE(buf, gsize, ap);
+          break;
+        case Z_LOG_ARG_DOUBLE:
+          Z_LOG_ARGS_CAPTURE(buf, gdouble, ap);
+          break;
+        case Z_LOG_ARG_LDOUBLE:
+          Z_LOG_ARGS_CAPTURE(buf, long double, ap);
+          break;
+        case Z_LOG_ARG_POINTER:
+          Z_LOG_ARGS_CAPTURE(buf, gpointer, ap);
+          break;
+        case Z_LOG_ARG_STRING:
+          str = va_arg(ap, const gchar *);
+          if (!str)
+            str = "(null)";
+          /* the string does not need to be NUL terminated if a precision was given */
+          len = conv.precision >= 0 ? strnlen(str, conv.precision) : strlen(str);
+          g_byte_array_append(buf, (const guint8 *) str, len);
+          g_byte_array_append(buf, (const guint8 *) "", 1);
+          break;
+        case Z_LOG_ARG_UNSUPPORTED:
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
+/**
+ * Free the per-thread buffer of z_log_args_new().
+ *
+ * @param[in] buf the buffer
+ **/
+static void
+z_log_args_buffer_free(gpointer buf)
+{
+  g_byte_array_free((GByteArray *) buf, TRUE);
+}
+
+/**
+ * Capture a log message to be formatted later by z_log_args_format().
+ *
+ * @param[in] tag message tag
+ * @param[in] level message verbosity level
+ * @param[in] format printf format string
+ * @param[in] ap arguments
+ *
+ * @returns the new record or NULL if the message must be formatted immediately
+ **/
+static ZLogArgs *
+z_log_args_new(const gchar *tag, gint level, const gchar *format, va_list ap)
+{
+  static GStaticPrivate buffer_key = G_STATIC_PRIVATE_INIT;
+  GByteArray *buf = g_static_private_get(&buffer_key);
+  ZLogArgs header;
+
+  if (!buf)
+    {
+      buf = g_byte_array_sized_new(256);
+      g_static_private_set(&buffer_key, buf, z_log_args_buffer_free);
+    }
+
+  header.level = level;
+  header.thread = g_thread_self();
+  header.tag_len = strlen(tag);
+  header.format_len = strlen(format);
+
+  g_byte_array_set_size(buf, 0);
+  g_byte_array_append(buf, (guint8 *) &header, sizeof(header));
+  g_byte_array_append(buf, (const guint8 *) tag, header.tag_len + 1);
+  g_byte_array_append(buf, (const guint8 *) format, header.format_len + 1);
+  if (!z_log_args_capture(buf, format, ap))
+    return NULL;
+  return g_memdup(buf->data, buf->len);
+}
+
+#define Z_LOG_ARGS_FORMAT(msg, spec, stars, star, type, value) \
+  do \
+    { \
+      type __v; \
+      memcpy(&__v, value, sizeof(__v)); \
+      value += sizeof(__v); \
+      if (stars == 0) \
+        g_string_append_printf(msg, spec, __v); \
+      else if (stars == 1) \
+        g_string_append_printf(msg, spec, star[0], __v); \
+      else \
+        g_string_append_printf(msg, spec, star[0], star[1], __v); \
+    } \
+  while (0)
+
+/**
+ * Format a log message captured by z_log_args_new().
+ *
+ * @param[in] args the captured message
+ *
+ * @returns the formatted message, to be freed by the caller
+ **/
+static gchar *
+z_log_args_format(ZLogArgs *args)
+{
+  const gchar *tag = (const gchar *) (args + 1);
+  const gchar *format = tag + args->tag_len + 1;
+  const guchar *value = (const guchar *) format + args->format_len + 1;
+  GString *msg = g_string_sized_new(args->format_len + 64);
+  gchar spec[Z_LOG_CONVERSION_MAX];
+  ZLogConversion conv;
+  const gchar *p = format, *next;
+  const gchar *str;
+  gint star[2], stars;
+
+  if (log_tags)
+    {
+#if ZORPLIB_ENABLE_TRACE
+      g_string_append_printf(msg, "%p -> %s(%d): ", args->thread, tag, args->level);
+#else
+      g_string_append_printf(msg, "%s(%d): ", tag, args->level);
+#endif
+    }
+
+  while ((next = strchr(p, '%')) != NULL)
+    {
+      g_string_append_len(msg, p, next - p);
+      p = z_log_conversion_parse(next, &conv);
+      if (conv.type == Z_LOG_ARG_NONE)
+        {
+          g_string_append_c(msg, '%');
+          continue;
+        }
+      memcpy(spec, next, conv.length);
+      spec[conv.length] = 0;
+
+      stars = 0;
+      if (conv.star_width)
+        {
+          memcpy(&star[stars++], value, sizeof(gint));
+          value += sizeof(gint);
+        }
+      if (conv.star_precision)
+        {
+          memcpy(&star[stars++], value, sizeof(gint));
+          value += sizeof(gint);
+        }
+
+      switch (conv.type)
+        {
+        case Z_LOG_ARG_INT:
+          Z_LOG_ARGS_FORMAT(msg, spec, stars, star, gint, value);
+          break;
+        case Z_LOG_ARG_LONG:
+          Z_LOG_ARGS_FORMAT(msg, spec, stars, star, glong, value);
+          break;
+        case Z_LOG_ARG_INT64:
+          Z_LOG_ARGS_FORMAT(msg, spec, stars, star, gint64, value);
+          break;
+        case Z_LOG_ARG_SIZE:
+          Z_LOG_ARGS_FORMAT(msg, spec, stars, star, gsize, value);
+          break;
+        case Z_LOG_ARG_DOUBLE:
+          Z_LOG_ARGS_FORMAT(msg, spec, stars, star, gdouble, value);
+          break;
+        case Z_LOG_ARG_LDOUBLE:
+          Z_LOG_ARGS_FORMAT(msg, spec, stars, star, long double, value);
+          break;
+        case Z_LOG_ARG_POINTER:
+          Z_LOG_ARGS_FORMAT(msg, spec, stars, star, gpointer, value);
+          break;
+        case Z_LOG_ARG_STRING:
+          str = (const gchar *) value;
+          value += strlen(str) + 1;
+          if (stars == 0)
+            g_string_append_printf(msg, spec, str);
+          else if (stars == 1)
+            g_string_append_printf(msg, spec, star[0], str);
+          else
+            g_string_append_printf(msg, spec, star[0], star[1], str);
+          break;
+        default:
+          g_assert_not_reached();
+          break;
+        }
+    }
+  g_string_append(msg, p);
+  return g_string_free(msg, FALSE);
+}
+
+/* asynchronous syslog writer
+ *
+ * In asynchronous mode the syslog log handler only copies the message to a
+ * bounded multi-producer, single-consumer queue and a dedicated thread
+ * sends the messages to syslog in batches, so logging threads are not
+ * blocked by syslog backpressure. Each slot of the queue has a sequence
+ * number: it is free for the producer at position seq, and it holds a
+ * record for the consumer at position seq - 1. Positions are unsigned and
+ * compared by their difference, so they wrap around safely.
+ */
+
+/* GLib has atomic operations on gint only */
+static inline guint
+z_log_async_pos_get(guint *pos)
+{
+  return (guint) g_atomic_int_get((gint *) pos);
+}
+
+static inline void
+z_log_async_pos_set(guint *pos, guint value)
+{
+  g_atomic_int_set((gint *) pos, (gint) value);
+}
+
+static inline gboolean
+z_log_async_pos_cas(guint *pos, guint old_value, guint new_value)
+{
+  return g_atomic_int_compare_and_exchange((gint *) pos, (gint) old_value, (gint) new_value);
+}
+
+/**
+ * Check whether the asynchronous log queue has a record to consume.
+ **/
+static inline gboolean
+z_log_async_pending(void)
+{
+  ZLogRecord *slot = &log_async_queue[log_async_tail & (Z_LOG_ASYNC_QUEUE_SIZE - 1)];
+
+  return z_log_async_pos_get(&slot->seq) == log_async_tail + 1;
+}
+
+/**
+ * Put a message to the asynchronous log queue.
+ *
+ * @param[in] pri syslog priority
+ * @param[in] msg message (copied)
+ * @param[in] args deferred message to be used instead of msg (consumed on success)
+ *
+ * If the queue is full, the message is dropped and counted, or the caller
+ * waits for free space if blocking overflow policy was requested. Once
+ * z_log_async_stop() was called nothing is queued any more; pushes already
+ * in progress are waited for and drained by z_log_async_stop().
+ *
+ * @returns FALSE if the log writer is stopped and the message has to be
+ * sent synchronously
+ **/
+static gboolean
+z_log_async_push(gint pri, const gchar *msg, ZLogArgs *args)
+{
+  ZLogRecord *slot;
+  GTimeVal deadline;
+  guint pos, seq;
+
+  g_atomic_int_inc(&log_async_pushing);
+  while (1)
+    {
+      if (g_atomic_int_get(&log_async_quit))
+        {
+          g_atomic_int_add(&log_async_pushing, -1);
+          return FALSE;
+        }
+      pos = z_log_async_pos_get(&log_async_head);
+      slot = &log_async_queue[pos & (Z_LOG_ASYNC_QUEUE_SIZE - 1)];
+      seq = z_log_async_pos_get(&slot->seq);
+      if (seq == pos)
+        {
+          if (z_log_async_pos_cas(&log_async_head, pos, pos + 1))
+            break;
+        }
+      else if ((gint) (seq - pos) < 0)
+        {
+          /* the queue is full */
+          if (!log_async_block)
+            {
+              g_atomic_int_inc(&log_async_dropped);
+              g_atomic_int_add(&log_async_pushing, -1);
+              g_free(args);
+              return TRUE;
+            }
+          g_mutex_lock(log_async_lock);
+          g_atomic_int_inc(&log_async_blocked);
+          g_get_current_time(&deadline);
+          g_time_val_add(&deadline, 10000);
+          g_cond_timed_wait(log_async_space, log_async_lock, &deadline);
+          g_atomic_int_add(&log_async_blocked, -1);
+          g_mutex_unlock(log_async_lock);
+        }
+    }
+  slot->pri = pri;
+  slot->msg = args ? NULL : g_strdup(msg);
+  slot->args = args;
+  z_log_async_pos_set(&slot->seq, pos + 1);
+  g_atomic_int_add(&log_async_pushing, -1);
+
+  if (g_atomic_int_get(&log_async_sleeping))
+    {
+      g_mutex_lock(log_async_lock);
+      g_cond_signal(log_async_wakeup);
+      g_mutex_unlock(log_async_lock);
+    }
+  return TRUE;
+}
+
+/**
+ * Take records from the asynchronous log queue.
+ *
+ * @param[out] pris priorities of the records
+ * @param[out] msgs the records, to be freed by the caller
+ * @param[in]  max maximum number of records to take
+ *
+ * @returns the number of records taken
+ **/
+static gint
+z_log_async_pop(gint *pris, gchar **msgs, gint max)
+{
+  ZLogRecord *slot;
+  ZLogArgs *args;
+  gint n = 0;
+
+  while (n < max && z_log_async_pending())
+    {
+      slot = &log_async_queue[log_async_tail & (Z_LOG_ASYNC_QUEUE_SIZE - 1)];
+      pris[n] = slot->pri;
+      msgs[n] = slot->msg;
+      args = slot->args;
+      slot->msg = NULL;
+      slot->args = NULL;
+      z_log_async_pos_set(&slot->seq, log_async_tail + Z_LOG_ASYNC_QUEUE_SIZE);
+      log_async_tail++;
+
+      /* format deferred messages after the slot has been released */
+      if (args)
+        {
+          msgs[n] = z_log_args_format(args);
+          g_free(args);
+        }
+      n++;
+    }
+  return n;
+}
+
+/**
+ * Send all queued records to syslog and report the number of messages
+ * dropped since the last report.
+ *
+ * @returns the number of records sent
+ **/
+static gint
+z_log_async_flush(void)
+{
+  gint pris[Z_LOG_ASYNC_BATCH];
+  gchar *msgs[Z_LOG_ASYNC_BATCH];
+  gint n, i, dropped, total = 0;
+
+  while ((n = z_log_async_pop(pris, msgs, Z_LOG_ASYNC_BATCH)) > 0)
+    {
+      z_send_syslog_batch(pris, msgs, n);
+      for (i = 0; i < n; i++)
+        g_free(msgs[i]);
+      total += n;
+
+      if (g_atomic_int_get(&log_async_blocked))
+        {
+          g_mutex_lock(log_async_lock);
+          g_cond_broadcast(log_async_space);
+          g_mutex_unlock(log_async_lock);
+        }
+    }
+
+  dropped = g_atomic_int_get(&log_async_dropped);
+  if (dropped)
+    {
+      g_atomic_int_add(&log_async_dropped, -dropped);
+      pris[0] = LOG_WARNING | ZORP_SYSLOG_FACILITY;
+      msgs[0] = g_strdup_printf("Log queue overflow, messages dropped; count='%d'", dropped);
+      z_send_syslog_batch(pris, msgs, 1);
+      g_free(msgs[0]);
+    }
+  return total;
+}
+
+/**
+ * The log writer thread.
+ *
+ * @param user_data not used
+ *
+ * @returns always NULL
+ **/
+static gpointer
+z_log_async_run(gpointer user_data G_GNUC_UNUSED)
+{
+  GTimeVal deadline;
+
+  while (1)
+    {
+      if (z_log_async_flush())
+        continue;
+
+      g_mutex_lock(log_async_lock);
+      if (g_atomic_int_get(&log_async_quit))
+        {
+          g_mutex_unlock(log_async_lock);
+          break;
+        }
+      g_atomic_int_set(&log_async_sleeping, 1);
+      if (!z_log_async_pending())
+        {
+          g_get_current_time(&deadline);
+          g_time_val_add(&deadline, G_USEC_PER_SEC);
+          g_cond_timed_wait(log_async_wakeup, log_async_lock, &deadline);
+        }
+      g_atomic_int_set(&log_async_sleeping, 0);
+      g_mutex_unlock(log_async_lock);
+    }
+  return NULL;
 }
 
 /**
- * Send a message to syslogd. It uses the syslog() function in libc.
+ * Stop the log writer thread and send the remaining records.
  *
- * @param[in] pri priority of the message 
- * @param[in] msg message itself
- *
- * @returns always TRUE.
+ * Messages logged after this point are sent synchronously, the ones being
+ * queued concurrently are waited for and sent here.
  **/
-gboolean
-z_send_syslog(gint pri, const gchar *msg)
+static void
+z_log_async_stop(void)
 {
-  syslog(pri, "%s", msg);
-  return TRUE;
+  if (!log_async_queue || g_atomic_int_get(&log_async_quit))
+    return;
+
+  g_mutex_lock(log_async_lock);
+  g_atomic_int_set(&log_async_quit, TRUE);
+  g_cond_signal(log_async_wakeup);
+  g_mutex_unlock(log_async_lock);
+  if (log_async_thread)
+    g_thread_join(log_async_thread);
+  log_async_thread = NULL;
+
+  while (g_atomic_int_get(&log_async_pushing))
+    g_thread_yield();
+  z_log_async_flush();
 }
 
 #endif
 
-#else
-
-int syslog_fd = -1;
-
 /**
- * Analogous to openlog(), open the syslog() connection to local syslogd. 
+ * This function can be called after z_log_enable_syslog() to send syslog
+ * messages from a dedicated writer thread instead of the logging thread.
  *
- * @param[in] tag program name used in log messages
- *
- * Windows implementation.
+ * @param[in] block overflow policy: whether to wait for free space when the queue is full instead of dropping the message
  *
- * @returns TRUE when the operation succeeds
+ * Messages are queued in a bounded queue of Z_LOG_ASYNC_QUEUE_SIZE
+ * records and sent to syslog in batches. Dropped messages are counted and
+ * reported to syslog after the queue drains. The queue is flushed by
+ * z_log_destroy(). The GLib thread system must be initialized.
  **/
-gboolean
-z_open_syslog(const gchar *tag)
-{  
-  char fn[256];
+void
+z_log_enable_async(gboolean block)
+{
+#ifndef G_OS_WIN32
+  GError *error = NULL;
+  gint i;
 
-  g_strlcpy(fn, getenv("windir"), sizeof(fn));
-  g_strlcat(fn, "\\debug\\", sizeof(fn));
-  g_strlcat(fn, tag, sizeof(fn)); 
+  if (log_async_queue)
+    return;
 
-  if((syslog_fd = open(fn, _O_APPEND | _O_RDWR | _O_CREAT, _S_IREAD | _S_IWRITE  )) == -1)
+  log_async_lock = g_mutex_new();
+  log_async_wakeup = g_cond_new();
+  log_async_space = g_cond_new();
+  log_async_block = block;
+  log_async_queue = g_new0(ZLogRecord, Z_LOG_ASYNC_QUEUE_SIZE);
+  log_async_head = log_async_tail = Z_LOG_ASYNC_INITIAL_POS;
+  for (i = 0; i < Z_LOG_ASYNC_QUEUE_SIZE; i++)
+    log_async_queue[i].seq = Z_LOG_ASYNC_INITIAL_POS + i;
+
+  log_async_thread = g_thread_create(z_log_async_run, NULL, TRUE, &error);
+  if (!log_async_thread)
     {
-      close(syslog_fd);
-      syslog_fd = -1;
-      return FALSE;
+      /* fall back to synchronous logging */
+      g_atomic_int_set(&log_async_quit, TRUE);
+      z_log_async_flush();
+      /*LOG
+        This message indicates that the log writer thread could not be
+        started, messages are sent to syslog directly.
+       */
+      z_log(NULL, CORE_ERROR, 2, "Error starting log writer thread; error='%s'", error ? error->message : "unknown");
+      g_clear_error(&error);
     }
-  return TRUE;
+#else
+  (void) block;
+#endif
 }
 
 /**
- * Close the connection to the local syslog process. 
+ * This function can be called after z_log_enable_async() to format
+ * messages of the given verbosity level and above in the log writer thread.
+ *
+ * @param[in] min_level lowest verbosity level of deferred messages, G_MAXINT disables deferred formatting
+ *
+ * Deferred messages are not formatted by the logging thread, only the
+ * format string and the argument values are copied, making debug messages
+ * logged at high verbosity levels considerably cheaper. Messages using
+ * conversions which cannot be formatted later (positional arguments, %n,
+ * %m or wide characters) are still formatted immediately.
+ *
+ * Deferred messages are queued for syslog directly, so they are only
+ * deferred while the syslog handler of z_log_enable_syslog() is in use;
+ * a GLib log handler installed by the application afterwards does not
+ * see them.
  **/
-gboolean
-z_close_syslog(void)
+void
+z_log_enable_deferred(gint min_level)
 {
-  if (syslog_fd != -1)
-    {
-      close(syslog_fd);
-      return TRUE;
-    }
-  return FALSE;
-}
-
+#ifndef G_OS_WIN32
+  log_deferred_level = min_level;
+#else
+  (void) min_level;
 #endif
+}
 
 /* logspec parsing and evaluation handling */
 
@@ -434,13 +1503,14 @@ z_log_spec_glob_match(const gchar *glob, const gchar *tag)
  * Evaluate the currently parsed logspec in self and return the verbosity level
  * associated with tag.
  *
- * @param[in] self ZLogSpec structure
- * @param[in] tag message to return verbosity for
+ * @param[in]  self ZLogSpec structure
+ * @param[in]  tag message to return verbosity for
+ * @param[out] limit if not NULL, the index of the rate limit applying to tag (-1 if none) is returned here
  *
  * @returns the verbosity level associated with tag
  **/
 static gint
-z_log_spec_eval(ZLogSpec *self, const gchar *tag)
+z_log_spec_eval(ZLogSpec *self, const gchar *tag, gint *limit)
 {
   GSList *l;
   ZLogSpecItem *lsi;
@@ -451,10 +1521,14 @@ z_log_spec_eval(ZLogSpec *self, const gchar *tag)
       lsi = (ZLogSpecItem *) l->data;
       if (z_log_spec_glob_match(lsi->pattern, tag))
         {
+          if (limit)
+            *limit = lsi->limit;
           return lsi->verbose_level;
         }
       l = g_slist_next(l);
     }
+  if (limit)
+    *limit = -1;
   return self->verbose_level;
 }
 
@@ -492,7 +1566,14 @@ z_log_spec_destroy(ZLogSpec *self)
  * @param[in] logspec_str logspec specification
  * @param[in] default_verbosity global verbosity level
  *
- * @returns sdf
+ * The logspec is a comma separated list of pattern:level items. The level
+ * can be followed by rate limiting options: "@rate[/burst]" allows at most
+ * rate messages per second (with bursts of at most burst messages), "%n"
+ * logs only every n-th message of the matching tags, e.g.
+ * "core.accounting:5@100/200,core.dump:9%10". Limits are applied to each
+ * thread separately.
+ *
+ * @returns TRUE if the logspec was valid
  **/
 static gboolean
 z_log_spec_init(ZLogSpec *self, const gchar *logspec_str, gint default_verbosity)
@@ -504,6 +1585,7 @@ z_log_spec_init(ZLogSpec *self, const gchar *logspec_str, gint default_verbosity
   src = tmp;
   self->items = NULL;
   self->verbose_level = default_verbosity;
+  self->limits_count = 0;
   
   while (*src)
     {
@@ -528,12 +1610,44 @@ z_log_spec_init(ZLogSpec *self, const gchar *logspec_str, gint default_verbosity
 
       new_level = strtoul(num, &end, 10);
       
-      item = g_new(ZLogSpecItem, 1);
+      item = g_new0(ZLogSpecItem, 1);
       item->pattern = g_strdup(glob);
       item->verbose_level = new_level;
+      item->limit = -1;
       self->items = g_slist_prepend(self->items, item);
       
       src = end;
+      while (*src == '@' || *src == '%')
+        {
+          gint value = strtol(src + 1, &end, 10);
+
+          if (end == src + 1 || value <= 0)
+            goto invalid_logspec;
+
+          if (*src == '@')
+            {
+              item->rate = item->burst = value;
+              if (*end == '/')
+                {
+                  src = end;
+                  item->burst = strtol(src + 1, &end, 10);
+                  if (end == src + 1 || item->burst <= 0)
+                    goto invalid_logspec;
+                }
+            }
+          else
+            {
+              item->sample = value;
+            }
+          src = end;
+        }
+      if (item->rate || item->sample > 1)
+        {
+          if (self->limits_count == Z_LOG_LIMITS_MAX)
+            goto invalid_logspec;
+          item->limit = self->limits_count++;
+        }
+
       while (*src && *src != ',')
         src++;
     }
@@ -550,28 +1664,22 @@ z_log_spec_init(ZLogSpec *self, const gchar *logspec_str, gint default_verbosity
 
 /* log tag cache 
  *
- * Each thread has its own dedicated logtag cache to avoid locking. Caches are shared
- * which means that once a thread terminates it releases its cache which can be reused
- * by an independent thread.
+ * Verbosity levels of tags are cached in a global open addressing hash
+ * table keyed by the address of the tag. Entries are never removed, they
+ * are invalidated by bumping the epoch whenever the logspec or the
+ * verbosity level changes, so lookups need no locking at all. As slots
+ * are never reclaimed, tags must be string literals: a tag whose address
+ * has been cached for a different string is evaluated without caching.
  * */
 
 /**
- * Clear all thread specific caches. It is called after changing the
+ * Clear all cached verbosity levels. It is called after changing the
  * verbosity level or the logspec.
  **/
 void
 z_log_clear_caches(void)
 {
-  guint i;
-  
-  g_static_mutex_lock(&logtag_cache_lock);
-  for (i = 0; i < logtag_caches->len; i++)
-    {
-      ZLogTagCache *lc = g_ptr_array_index(logtag_caches, i);
-      
-      lc->empty_hash = TRUE;
-    }
-  g_static_mutex_unlock(&logtag_cache_lock);
+  g_atomic_int_inc(&logtag_cache_epoch);
   if (log_mapped_tags_verb)
     {
       memset(log_mapped_tags_verb, 0, log_mapped_tags_count * sizeof(log_mapped_tags_verb[0]));
@@ -579,77 +1687,362 @@ z_log_clear_caches(void)
 }
 
 /**
- * Grab a thread specific log-tag cache.
+ * Look up the verbosity level of a tag in the global logtag cache,
+ * evaluating the logspec on a miss.
+ *
+ * @param[in]  tag log message tag, a string literal (its address identifies it)
+ * @param[out] limit if not NULL, the index of the rate limit applying to tag (-1 if none) is returned here
+ *
+ * @returns the verbosity level associated with tag
  **/
-void
-z_log_grab_cache(void)
+static gint
+z_log_tag_cache_lookup(const gchar *tag, gint *limit)
 {
-  guint i;
-  ZLogTagCache *lc = NULL;
-  
-  g_static_mutex_lock(&logtag_cache_lock);
-  
-  for (i = 0; i < logtag_caches->len; i++)
+  ZLogTagCacheEntry *entry;
+  gpointer key;
+  gchar *name;
+  guint hash, i;
+  gint epoch, value, limit_value, verbose, limit_ndx;
+
+  epoch = g_atomic_int_get(&logtag_cache_epoch) & 0x7FFFFF;
+  hash = (guint) ((GPOINTER_TO_SIZE(tag) >> 2) * 2654435761U);
+  for (i = 0; i < Z_LOG_TAG_CACHE_PROBES; i++)
     {
-      lc = g_ptr_array_index(logtag_caches, i);
-      
-      if (!lc->used)
+      entry = &logtag_cache[(hash + i) & (Z_LOG_TAG_CACHE_SIZE - 1)];
+      key = g_atomic_pointer_get(&entry->tag);
+      if (key == NULL &&
+          !g_atomic_pointer_compare_and_exchange(&entry->tag, NULL, (gpointer) tag))
+        {
+          key = g_atomic_pointer_get(&entry->tag);
+        }
+      else if (key == NULL)
+        {
+          /* the slot is ours, the copy is never freed as the slot is never reclaimed */
+          key = (gpointer) tag;
+          g_atomic_pointer_set(&entry->name, g_strdup(tag));
+        }
+
+      if (key != (gpointer) tag)
+        continue;
+
+      /* the name is not set yet by the thread claiming the slot, or the
+       * address has been reused for another tag */
+      name = (gchar *) g_atomic_pointer_get(&entry->name);
+      if (G_UNLIKELY(!name || strcmp(name, tag) != 0))
         break;
-      else
-        lc = NULL;
+
+      value = g_atomic_int_get(&entry->value);
+      if (G_LIKELY((value >> 8) == epoch && (value & 0xFF) != 0))
+        {
+          if (!limit)
+            return (value & 0xFF) - 1;
+
+          limit_value = g_atomic_int_get(&entry->limit);
+          if (G_LIKELY((limit_value >> 8) == epoch))
+            {
+              *limit = (limit_value & 0xFF) - 1;
+              return (value & 0xFF) - 1;
+            }
+        }
+
+      g_static_mutex_lock(&log_spec_lock);
+      verbose = z_log_spec_eval(&log_spec, tag, &limit_ndx);
+      g_static_mutex_unlock(&log_spec_lock);
+      g_atomic_int_set(&entry->limit, (epoch << 8) | ((limit_ndx + 1) & 0xFF));
+      g_atomic_int_set(&entry->value, (epoch << 8) | ((verbose + 1) & 0xFF));
+      if (limit)
+        *limit = limit_ndx;
+      return verbose;
     }
-  
-  if (!lc)
+
+  /* the neighbourhood of the tag is full or its slot is unusable, don't cache it */
+  g_static_mutex_lock(&log_spec_lock);
+  verbose = z_log_spec_eval(&log_spec, tag, limit);
+  g_static_mutex_unlock(&log_spec_lock);
+  return verbose;
+}
+
+/* rate limiting
+ *
+ * Tags matching a logspec pattern with rate limiting options are limited
+ * with token buckets and sampling counters private to the logging thread,
+ * so checking them needs no locking. The index of the limit applying to a
+ * tag is stored in the logtag cache, the per-thread buckets are
+ * reinitialized from the logspec whenever the cache epoch changes.
+ *
+ * The buckets of all threads are registered in log_limits_threads, so that
+ * the suppressed counters can be reported periodically, when the logspec
+ * changes and at shutdown, regardless of whether the thread logs again.
+ * */
+
+/**
+ * Return the current time in milliseconds.
+ *
+ * A coarse monotonic clock is used if available, as it is read for every
+ * rate limited message.
+ **/
+static inline gint64
+z_log_limit_now(void)
+{
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC_COARSE)
+  struct timespec now;
+
+  if (clock_gettime(CLOCK_MONOTONIC_COARSE, &now) == 0)
+    return (gint64) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+  {
+    GTimeVal tv;
+
+    g_get_current_time(&tv);
+    return (gint64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  }
+}
+
+/**
+ * Free rate limit buckets.
+ *
+ * @param[in] states the buckets
+ * @param[in] count number of buckets
+ **/
+static void
+z_log_limit_states_free(ZLogLimitState *states, gint count)
+{
+  gint i;
+
+  for (i = 0; i < count; i++)
+    g_free(states[i].pattern);
+  g_free(states);
+}
+
+/**
+ * Take the suppressed counters of rate limit buckets to be reported.
+ *
+ * @param[in] reports list of ZLogLimitReport to prepend the reports to
+ * @param[in] states the buckets
+ * @param[in] count number of buckets
+ *
+ * The counters are reset.
+ *
+ * @returns the new list head
+ **/
+static GSList *
+z_log_limit_states_take(GSList *reports, ZLogLimitState *states, gint count)
+{
+  ZLogLimitReport *report;
+  gint i, suppressed;
+
+  for (i = 0; i < count; i++)
     {
-      lc = g_new0(ZLogTagCache, 1);
-      lc->tag_hash = g_hash_table_new(g_str_hash, g_str_equal);
-      g_ptr_array_add(logtag_caches, lc);
+      do
+        suppressed = g_atomic_int_get(&states[i].suppressed);
+      while (suppressed && !g_atomic_int_compare_and_exchange(&states[i].suppressed, suppressed, 0));
+      if (suppressed)
+        {
+          report = g_new(ZLogLimitReport, 1);
+          report->pattern = g_strdup(states[i].pattern);
+          report->suppressed = suppressed;
+          reports = g_slist_prepend(reports, report);
+        }
     }
-  lc->used = 1;
-  g_static_private_set(&current_logtag_cache, lc, NULL);
-  
-  g_static_mutex_unlock(&logtag_cache_lock);
+  return reports;
 }
 
 /**
- * Release a thread specific log-tag cache to make it usable by other threads.
+ * Log and free reports of messages suppressed by rate limits.
+ *
+ * @param[in] reports list of reports created by z_log_limit_states_take()
+ *
+ * The caller must not hold log_limits_lock as the reports are logged
+ * using the rate limits of the calling thread.
  **/
-void
-z_log_release_cache(void)
+static void
+z_log_limit_report(GSList *reports)
 {
-  ZLogTagCache *lc;
-  
-  g_static_mutex_lock(&logtag_cache_lock);
-  
-  lc = g_static_private_get(&current_logtag_cache);
-  if (lc)
-    lc->used = 0;
-  
-  g_static_mutex_unlock(&logtag_cache_lock);
+  GSList *l;
+  ZLogLimitReport *report;
+
+  reports = g_slist_reverse(reports);
+  for (l = reports; l; l = g_slist_next(l))
+    {
+      report = (ZLogLimitReport *) l->data;
+      /*LOG
+        This message reports the number of log messages suppressed by the
+        rate limiting or sampling options of the logspec since the last report.
+       */
+      z_log(NULL, CORE_INFO, 3, "Log messages suppressed by rate limit; pattern='%s', count='%u'", report->pattern, report->suppressed);
+      g_free(report->pattern);
+      g_free(report);
+    }
+  g_slist_free(reports);
 }
 
 /**
- * Thread startup function called at thread startup time to allocate a logtag cache.
+ * Report the messages suppressed by rate limits in all threads.
  *
- * @param thread (unused)
- * @param user_data (unused)
+ * The buckets of exited threads are freed here, after their last report.
  **/
 static void
-z_log_thread_started(ZThread *thread G_GNUC_UNUSED, gpointer user_data G_GNUC_UNUSED)
+z_log_limits_flush(void)
 {
-  z_log_grab_cache();
+  GSList *reports = NULL, *l, *next;
+  ZLogLimits *limits;
+
+  g_static_mutex_lock(&log_limits_lock);
+  for (l = log_limits_threads; l; l = next)
+    {
+      next = g_slist_next(l);
+      limits = (ZLogLimits *) l->data;
+      reports = z_log_limit_states_take(reports, limits->states, limits->count);
+      if (limits->exited)
+        {
+          log_limits_threads = g_slist_delete_link(log_limits_threads, l);
+          z_log_limit_states_free(limits->states, limits->count);
+          g_free(limits);
+        }
+    }
+  g_static_mutex_unlock(&log_limits_lock);
+  z_log_limit_report(reports);
 }
 
 /**
- * Thread startup function called at thread shutdown time to release the logtag cache.
+ * Destroy notify of the per-thread rate limit buckets.
  *
- * @param thread (unused)
- * @param user_data (unused)
+ * @param[in] user_data ZLogLimits instance
+ *
+ * The buckets may have unreported counters, so they are only marked to be
+ * freed by the next z_log_limits_flush().
  **/
 static void
-z_log_thread_stopped(ZThread *thread G_GNUC_UNUSED, gpointer user_data G_GNUC_UNUSED)
+z_log_limits_destroy(gpointer user_data)
+{
+  ZLogLimits *self = (ZLogLimits *) user_data;
+
+  g_static_mutex_lock(&log_limits_lock);
+  self->exited = TRUE;
+  g_static_mutex_unlock(&log_limits_lock);
+}
+
+/**
+ * Get the rate limit buckets of the current thread, reinitializing them if
+ * the logspec has changed.
+ *
+ * @param[in] epoch current logtag cache epoch
+ *
+ * @returns the buckets of the current thread
+ **/
+static ZLogLimits *
+z_log_limits_get(gint epoch)
+{
+  static GStaticPrivate limits_key = G_STATIC_PRIVATE_INIT;
+  ZLogLimits *self = g_static_private_get(&limits_key);
+  ZLogLimitState *states, *old_states;
+  ZLogSpecItem *item;
+  GSList *l;
+  gint64 now;
+  gint count, old_count;
+
+  if (G_LIKELY(self && self->epoch == epoch))
+    return self;
+
+  now = z_log_limit_now();
+  g_static_mutex_lock(&log_spec_lock);
+  count = log_spec.limits_count;
+  states = g_new0(ZLogLimitState, count);
+  for (l = log_spec.items; l; l = g_slist_next(l))
+    {
+      item = (ZLogSpecItem *) l->data;
+      if (item->limit >= 0)
+        {
+          ZLogLimitState *state = &states[item->limit];
+
+          state->pattern = g_strdup(item->pattern);
+          state->rate = item->rate;
+          state->burst = item->burst;
+          state->sample = item->sample;
+          state->tokens = (gint64) item->burst * 1000;
+          state->last = now;
+        }
+    }
+  g_static_mutex_unlock(&log_spec_lock);
+
+  if (!self)
+    {
+      self = g_new0(ZLogLimits, 1);
+      g_static_private_set(&limits_key, self, z_log_limits_destroy);
+      g_static_mutex_lock(&log_limits_lock);
+      log_limits_threads = g_slist_prepend(log_limits_threads, self);
+      g_static_mutex_unlock(&log_limits_lock);
+    }
+
+  g_static_mutex_lock(&log_limits_lock);
+  old_states = self->states;
+  old_count = self->count;
+  self->epoch = epoch;
+  self->count = count;
+  self->states = states;
+  g_static_mutex_unlock(&log_limits_lock);
+
+  /* the old buckets are not visible to z_log_limits_flush() any more,
+   * the reports are logged using the new ones */
+  z_log_limit_report(z_log_limit_states_take(NULL, old_states, old_count));
+  z_log_limit_states_free(old_states, old_count);
+  return self;
+}
+
+/**
+ * Check whether a message with the given tag passes the rate limits of the
+ * logspec.
+ *
+ * @param[in] tag log message tag
+ *
+ * @returns FALSE if the message is to be suppressed
+ **/
+static gboolean
+z_log_limit_check(const gchar *tag)
 {
-  z_log_release_cache();
+  ZLogLimits *limits;
+  ZLogLimitState *state;
+  gint limit, epoch, due;
+  gint64 now;
+  gboolean pass = TRUE;
+
+  epoch = g_atomic_int_get(&logtag_cache_epoch);
+  z_log_tag_cache_lookup(tag, &limit);
+  if (G_LIKELY(limit < 0))
+    return TRUE;
+
+  limits = z_log_limits_get(epoch);
+  if (limit >= limits->count)
+    return TRUE;
+  state = &limits->states[limit];
+
+  if (state->sample > 1 && (state->seen++ % state->sample) != 0)
+    pass = FALSE;
+
+  now = z_log_limit_now();
+  if (pass && state->rate)
+    {
+      if (now > state->last)
+        {
+          state->tokens = MIN(state->tokens + (now - state->last) * state->rate, (gint64) state->burst * 1000);
+          state->last = now;
+        }
+      if (state->tokens >= 1000)
+        state->tokens -= 1000;
+      else
+        pass = FALSE;
+    }
+
+  if (!pass)
+    g_atomic_int_inc(&state->suppressed);
+
+  /* the first thread noticing that the report interval is over reports for all of them */
+  due = g_atomic_int_get(&log_limits_report_due);
+  if ((gint) (now / 1000) - due >= 0 &&
+      g_atomic_int_compare_and_exchange(&log_limits_report_due, due, (gint) (now / 1000) + Z_LOG_LIMIT_REPORT_INTERVAL) &&
+      due != 0)
+    z_log_limits_flush();
+  return pass;
 }
 
 /* global log state manipulation */
@@ -722,6 +2115,8 @@ z_log_change_logspec(const gchar *new_log_spec_str, const gchar **new_value)
           log_spec_str = g_strdup(new_log_spec_str);
           g_static_mutex_unlock(&log_spec_lock);
           z_log_clear_caches();
+          /* the new logspec may have no limits at all, report what the old one suppressed */
+          z_log_limits_flush();
           /*LOG
             This message reports that Zorp changed its logspec.
            */
@@ -769,7 +2164,9 @@ z_log_enable_tag_map_cache(ZLogMapTagFunc map_tags, gint max_tag)
  * It can be used prior to constructing complex log
  * messages to decide whether the messages need to be constucted at all.
  * All results are cached, thus the second invocation will not parse the 
- * log specifications again.
+ * log specifications again. The cache is keyed by the address of tag, so
+ * tag must be a string literal. A different tag reusing a cached address
+ * is still evaluated correctly, but without caching.
  *
  * @returns TRUE if the log would be written, FALSE otherwise
  **/
@@ -777,8 +2174,6 @@ gboolean
 z_log_enabled_len(const gchar *tag, gsize tag_len, gint level)
 {
   gint verbose;
-  ZLogTagCache *lc;
-  GHashTable *tag_hash;
   
   if (G_LIKELY(!log_spec.items))
     {
@@ -798,38 +2193,14 @@ z_log_enabled_len(const gchar *tag, gsize tag_len, gint level)
           else
             {
               g_static_mutex_lock(&log_spec_lock);
-              verbose = z_log_spec_eval(&log_spec, tag);
+              verbose = z_log_spec_eval(&log_spec, tag, NULL);
               log_mapped_tags_verb[tag_ndx] = (guchar) (verbose & 0xFF) + 1;
               g_static_mutex_unlock(&log_spec_lock);
             }
           return level <= verbose;
         }
     }
-  /* check slow ghashtable based cache */
-  lc = ((ZLogTagCache *) g_static_private_get(&current_logtag_cache));
-  if (!lc)
-    {
-      return level <= log_spec.verbose_level;
-    }
-  if (lc->empty_hash)
-    {
-      g_hash_table_destroy(lc->tag_hash);
-      lc->tag_hash = g_hash_table_new(g_str_hash, g_str_equal);
-      lc->empty_hash = FALSE;
-    }
-  tag_hash = lc->tag_hash;
-  verbose = GPOINTER_TO_INT(g_hash_table_lookup(tag_hash, (gconstpointer) tag));
-  if (!verbose)
-    {
-      /* slooooww path, evaluate logspec */
-      g_static_mutex_lock(&log_spec_lock);
-      verbose = z_log_spec_eval(&log_spec, tag);
-      g_static_mutex_unlock(&log_spec_lock);
-      g_hash_table_insert(tag_hash, (gchar *) tag, GUINT_TO_POINTER(verbose + 1));
-    }
-  else
-    verbose--;
-  
+  verbose = z_log_tag_cache_lookup(tag, NULL);
   return (level <= verbose);
 }
 
@@ -861,6 +2232,25 @@ z_log_session_id(const gchar *session_id)
 }
 
 
+#ifndef G_OS_WIN32
+/**
+ * Map GLib log level flags to syslog priority.
+ *
+ * @param[in] log_flags GLIB log flags
+ **/
+static inline int
+z_log_syslog_priority(GLogLevelFlags log_flags)
+{
+  if (log_flags & G_LOG_LEVEL_DEBUG)
+    return LOG_DEBUG;
+  else if (log_flags & G_LOG_LEVEL_WARNING)
+    return LOG_WARNING;
+  else if (log_flags & G_LOG_LEVEL_ERROR)
+    return LOG_ERR;
+  return LOG_INFO;
+}
+#endif
+
 /**
  * This function sends a message formatted as printf format string and
  * arguments to the syslog.
@@ -876,23 +2266,53 @@ z_log_session_id(const gchar *session_id)
 void
 z_logv(const gchar *class, int level, gchar *format, va_list ap)
 {
+  const GLogLevelFlags log_flags = G_LOG_LEVEL_INFO;
   int saved_errno = errno;
-  
+
+  if (G_UNLIKELY(log_spec.limits_count) && !z_log_limit_check(class))
+    {
+      errno = saved_errno;
+      return;
+    }
+
+#ifndef G_OS_WIN32
+  if (level >= log_deferred_level && log_syslog_active && log_async_queue && !g_atomic_int_get(&log_async_quit))
+    {
+      ZLogArgs *args;
+      va_list aq;
+
+      va_copy(aq, ap);
+      args = z_log_args_new(class, level, format, aq);
+      va_end(aq);
+      if (args)
+        {
+          if (z_log_async_push(z_log_syslog_priority(log_flags) | ZORP_SYSLOG_FACILITY, NULL, args))
+            {
+              errno = saved_errno;
+              return;
+            }
+          g_free(args);
+        }
+      /* %m of the immediately formatted message needs the original errno */
+      errno = saved_errno;
+    }
+#endif
+
   if (log_tags)
     {
       gchar *msgbuf;
       msgbuf = g_strdup_vprintf(format, ap);
 
 #if ZORPLIB_ENABLE_TRACE
-      g_log(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, "%p -> %s(%d): %s", g_thread_self(), class, level, msgbuf);
+      g_log(G_LOG_DOMAIN, log_flags, "%p -> %s(%d): %s", g_thread_self(), class, level, msgbuf);
 #else
-      g_log(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, "%s(%d): %s", class, level, msgbuf);
+      g_log(G_LOG_DOMAIN, log_flags, "%s(%d): %s", class, level, msgbuf);
 #endif
       g_free(msgbuf);
     }
   else
     {
-      g_logv(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, format, ap);
+      g_logv(G_LOG_DOMAIN, log_flags, format, ap);
     }
   errno = saved_errno;
 }
@@ -942,6 +2362,9 @@ z_log(const gchar *session_id, const gchar *class, int level, gchar *format, ...
   if (!z_log_enabled(class, level))
     return;
 
+  if (G_UNLIKELY(log_spec.limits_count) && !z_log_limit_check(class))
+    return;
+
   va_start(l, format);
 
   g_vsnprintf(msgbuf, sizeof(msgbuf), format, l);
@@ -997,15 +2420,10 @@ z_log_func(const gchar *log_domain G_GNUC_UNUSED,
 	   const gchar *message,
 	   gpointer user_data G_GNUC_UNUSED)
 {
-  int pri = LOG_INFO;
-  if (log_flags & G_LOG_LEVEL_DEBUG)
-    pri = LOG_DEBUG;
-  else if (log_flags & G_LOG_LEVEL_WARNING)
-    pri = LOG_WARNING;
-  else if (log_flags & G_LOG_LEVEL_ERROR)
-    pri = LOG_ERR;
+  int pri = z_log_syslog_priority(log_flags);
 
-  z_send_syslog(pri | ZORP_SYSLOG_FACILITY, message);
+  if (!log_async_queue || !z_log_async_push(pri | ZORP_SYSLOG_FACILITY, message, NULL))
+    z_send_syslog(pri | ZORP_SYSLOG_FACILITY, message);
 }
 
 #else
@@ -1192,6 +2610,7 @@ z_log_enable_syslog(const gchar *syslog_name)
   z_open_syslog(syslog_name);
 #ifndef G_OS_WIN32
   g_log_set_handler(G_LOG_DOMAIN, 0xff, z_log_func, NULL);
+  log_syslog_active = TRUE;
 #else
   g_log_set_handler(G_LOG_DOMAIN, 0xff, z_log_win32_syslogmsg, NULL);
 #endif
@@ -1281,16 +2700,13 @@ z_log_init(const gchar *syslog_name, guint flags)
     }
   log_spec_str = z_log_get_log_spec() ? g_strdup(z_log_get_log_spec()) : NULL;
   log_tags = z_log_get_log_tags();
-    
-  logtag_caches = g_ptr_array_new();
-  
-  z_log_grab_cache();
-  z_thread_register_start_callback((GFunc) z_log_thread_started, NULL);
-  z_thread_register_stop_callback((GFunc) z_log_thread_stopped, NULL);
+
 
   if (z_log_get_use_syslog())
     {
       z_log_enable_syslog(syslog_name);
+      if (flags & ZLF_ASYNC)
+        z_log_enable_async(!!(flags & ZLF_ASYNC_BLOCK));
 
 #ifndef G_OS_WIN32
       if (flags & ZLF_STDERR)
@@ -1308,6 +2724,7 @@ z_log_init(const gchar *syslog_name, guint flags)
 #endif  
         {
           g_log_set_handler(G_LOG_DOMAIN, 0xff, z_log_func_nosyslog, NULL);
+          log_syslog_active = FALSE;
         }
     }
 
@@ -1329,6 +2746,10 @@ z_log_destroy(void)
       close(1);
       close(2);
     }
+#endif
+  z_log_limits_flush();
+#ifndef G_OS_WIN32
+  z_log_async_stop();
 #endif
   z_close_syslog();
   
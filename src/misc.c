@@ -259,6 +259,18 @@ g_time_val_subtract(GTimeVal *result, const GTimeVal *x, const GTimeVal *y)
   result->tv_sec -= y->tv_sec;
 }
 
+/**
+ * Number of bytes dumped on a line by z_hexdump().
+ **/
+#define Z_HEXDUMP_ROW 16
+
+/**
+ * Length of a full line produced by z_hexdump() including the trailing NUL.
+ **/
+#define Z_HEXDUMP_LINE_LEN (Z_HEXDUMP_ROW * 3 + 1 + Z_HEXDUMP_ROW + 1)
+
+static const gchar z_hexdump_digits[] = "0123456789ABCDEF";
+
 /**
  * Produces one line of hex dump of the specified part buf in line.
  *
@@ -272,34 +284,37 @@ g_time_val_subtract(GTimeVal *result, const GTimeVal *x, const GTimeVal *y)
  * This will be followed with a dump of the characters where
  * unprintable characters will be replaced with '.'
  *
+ * The hex and the character columns are at fixed positions, so every byte
+ * is converted with table lookups and stored without any formatting calls.
+ *
  * @returns The number of characters that were actually dumped on this line
  **/
 static guint
 z_hexdump(gchar *line, guint linelen, guint i, const char *buf, guint len)
 {
-  guint j;
-  char *end = line;
+  const guchar *src = (const guchar *) buf + i;
+  gchar *hex = line;
+  gchar *text = line + Z_HEXDUMP_ROW * 3 + 1;
+  guint count, j;
 
-  for (j = 0; j < 16 && (i + j < len); j++)
-    {
-      g_snprintf(end, linelen - (end - line), "%02X ", (unsigned char) buf[i+j]);
-      end += 3;
-    }
-  for (; j < 16; j++)
-    {
-      g_snprintf(end, linelen - (end - line), "   ");
-      end += 3;
-    }
-  g_snprintf(end, linelen - (end - line), " ");
-  end++;
-  for (j = 0; j < 16 && (i + j < len) && linelen > (guint)(end - line); j++)
+  g_assert(linelen >= Z_HEXDUMP_LINE_LEN);
+
+  count = MIN(len - i, Z_HEXDUMP_ROW);
+  for (j = 0; j < count; j++)
     {
-      *end = isprint(buf[i + j]) ? buf[i + j] : '.';
-      end++;
+      guchar c = src[j];
+
+      hex[j * 3] = z_hexdump_digits[c >> 4];
+      hex[j * 3 + 1] = z_hexdump_digits[c & 0x0F];
+      hex[j * 3 + 2] = ' ';
+      text[j] = (c >= 0x20 && c < 0x7F) ? (gchar) c : '.';
     }
-  *end='\0';
+  if (count < Z_HEXDUMP_ROW)
+    memset(hex + count * 3, ' ', (Z_HEXDUMP_ROW - count) * 3);
+  line[Z_HEXDUMP_ROW * 3] = ' ';
+  text[count] = '\0';
 
-  return j;
+  return count;
 }
 
 
@@ -319,8 +334,10 @@ void
 z_format_data_dump(const gchar *session_id, const char *class, gint level, const void *buf, guint len)
 {
   guint i, offs;
-  gchar line[1024];
+  gchar line[Z_HEXDUMP_LINE_LEN];
   
+  /* resolve the session id of the thread only once for all lines */
+  session_id = z_log_session_id(session_id);
   i = 0;
   while (i < len)
     {
@@ -350,6 +367,7 @@ z_format_text_dump(const gchar *session_id, const char *class, gint level, const
   gchar line[1024];
   const gchar *bufc = buf;
  
+  session_id = z_log_session_id(session_id);
   while (len > 0)
     {
       for (nl = 0; (nl < len) && bufc[nl] && (bufc[nl] != '\r') && (bufc[nl] != '\n'); nl++)
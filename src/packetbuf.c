@@ -1,6 +1,216 @@
 #include <zorp/packetbuf.h>
+#include <zorp/stream.h>
 #include <zorp/log.h>
 
+/**
+ * Maximum number of buffers kept per size class in a thread's pool.
+ **/
+#define Z_PKTBUF_POOL_DEPTH 64
+
+/**
+ * Maximum payload bytes kept per size class in a thread's pool, limits the
+ * depth of the larger classes.
+ **/
+#define Z_PKTBUF_POOL_BYTES (256 * 1024)
+
+/**
+ * Number of payload size classes.
+ **/
+#define Z_PKTBUF_POOL_CLASSES 3
+
+/**
+ * Payload sizes of the pool classes.
+ **/
+static const gsize z_pktbuf_pool_sizes[Z_PKTBUF_POOL_CLASSES] = { 2048, 16384, 65536 };
+
+/**
+ * Per-thread cache of freed pooled buffers, both the header and the
+ * payload is kept. It is freed by z_pktbuf_pool_free() when the thread
+ * exits.
+ **/
+typedef struct _ZPktBufPool
+{
+  ZPktBuf *bufs[Z_PKTBUF_POOL_CLASSES][Z_PKTBUF_POOL_DEPTH];
+  guint count[Z_PKTBUF_POOL_CLASSES];
+} ZPktBufPool;
+
+static GStaticPrivate current_pktbuf_pool = G_STATIC_PRIVATE_INIT;
+
+/**
+ * Reference counted storage shared by a buffer and its slices created by
+ * z_pktbuf_part().
+ **/
+struct _ZPktBufStore
+{
+  ZRefCount ref_cnt;
+  guchar *data;
+  gboolean borrowed;    /**< data is not owned by the store */
+};
+
+static void
+z_pktbuf_store_unref(ZPktBufStore *store)
+{
+  if (z_refcount_dec(&store->ref_cnt))
+    {
+      if (!store->borrowed)
+        g_free(store->data);
+      g_free(store);
+    }
+}
+
+/**
+ * Stop sharing the storage of self with other buffers.
+ *
+ * @param[in] self this
+ * @param[in] copy whether the contents of the buffer are to be preserved
+ *
+ * If self is the last user of the storage and it starts at the beginning
+ * of it, the storage is taken over without copying. Otherwise the data is
+ * copied to a private buffer if copy is TRUE, or the buffer is emptied if
+ * it is FALSE (the caller replaces the contents anyway).
+ **/
+static void
+z_pktbuf_unshare(ZPktBuf *self, gboolean copy)
+{
+  ZPktBufStore *store = self->store;
+
+  if (!(self->flags & Z_PB_SHARED))
+    return;
+
+  self->store = NULL;
+  self->flags &= ~Z_PB_SHARED;
+  if (g_atomic_int_get(&store->ref_cnt.counter) == 1 && self->data == store->data)
+    {
+      if (store->borrowed)
+        self->flags |= Z_PB_BORROWED;
+      g_free(store);
+      return;
+    }
+
+  if (copy)
+    {
+      guchar *data = g_malloc(MAX(self->allocated, 1));
+
+      memcpy(data, self->data, self->length);
+      self->data = data;
+    }
+  else
+    {
+      self->data = NULL;
+      self->allocated = self->length = self->pos = 0;
+    }
+  self->flags &= ~Z_PB_BORROWED;
+  z_pktbuf_store_unref(store);
+}
+
+/**
+ * Return the pool class a payload of the given size fits in.
+ *
+ * @param[in] size payload size
+ *
+ * @returns the index of the class, -1 if size is larger than any class
+ **/
+static inline gint
+z_pktbuf_pool_class(gsize size)
+{
+  gint i;
+
+  for (i = 0; i < Z_PKTBUF_POOL_CLASSES; i++)
+    if (size <= z_pktbuf_pool_sizes[i])
+      return i;
+  return -1;
+}
+
+/**
+ * Return the pool class to be used for a payload of the given size.
+ *
+ * @param[in] size payload size
+ *
+ * Pooled buffers are only used if the payload fills at least 3/4 of the
+ * class size, so that the memory allocated for a buffer stays close to the
+ * payload length, which is what buffer thresholds (ZStreamBuf) account.
+ *
+ * @returns the index of the class, -1 if the payload is not to be pooled
+ **/
+static inline gint
+z_pktbuf_pool_class_fit(gsize size)
+{
+  gint cls = z_pktbuf_pool_class(size);
+
+  if (cls >= 0 && size < z_pktbuf_pool_sizes[cls] - z_pktbuf_pool_sizes[cls] / 4)
+    return -1;
+  return cls;
+}
+
+/**
+ * Free the pool of an exiting thread.
+ *
+ * @param[in] p ZPktBufPool instance
+ **/
+static void
+z_pktbuf_pool_free(gpointer p)
+{
+  ZPktBufPool *pool = (ZPktBufPool *) p;
+  gint i;
+  guint j;
+
+  for (i = 0; i < Z_PKTBUF_POOL_CLASSES; i++)
+    {
+      for (j = 0; j < pool->count[i]; j++)
+        {
+          g_free(pool->bufs[i][j]->data);
+          g_free(pool->bufs[i][j]);
+        }
+    }
+  g_free(pool);
+}
+
+static inline ZPktBufPool *
+z_pktbuf_pool_get(void)
+{
+  ZPktBufPool *pool;
+
+  pool = (ZPktBufPool *) g_static_private_get(&current_pktbuf_pool);
+  if (!pool)
+    {
+      pool = g_new0(ZPktBufPool, 1);
+      g_static_private_set(&current_pktbuf_pool, pool, z_pktbuf_pool_free);
+    }
+  return pool;
+}
+
+/**
+ * Put a pooled buffer back to the pool of the current thread.
+ *
+ * @param[in] self ZPktBuf instance whose reference count dropped to zero
+ *
+ * Buffers whose payload does not have a class size anymore (it was
+ * relocated for example) and buffers exceeding the capacity of the pool
+ * are not recycled.
+ *
+ * @returns TRUE if the buffer was recycled
+ **/
+static gboolean
+z_pktbuf_pool_put(ZPktBuf *self)
+{
+  ZPktBufPool *pool;
+  gint cls;
+
+  if (!self->data || (self->flags & (Z_PB_BORROWED | Z_PB_SHARED)))
+    return FALSE;
+
+  cls = z_pktbuf_pool_class(self->allocated);
+  if (cls < 0 || z_pktbuf_pool_sizes[cls] != self->allocated)
+    return FALSE;
+
+  pool = z_pktbuf_pool_get();
+  if (pool->count[cls] >= MIN(Z_PKTBUF_POOL_DEPTH, Z_PKTBUF_POOL_BYTES / z_pktbuf_pool_sizes[cls]))
+    return FALSE;
+
+  pool->bufs[cls][pool->count[cls]++] = self;
+  return TRUE;
+}
+
 /**
  * Logs the contents of a buffer, prepended with a header if title is not NULL.
  *
@@ -38,6 +248,7 @@ z_pktbuf_dump(const gchar *session_id, const gchar *class, int level, ZPktBuf *s
 gboolean
 z_pktbuf_copy(ZPktBuf *self, const void *data, gsize length)
 {
+  z_pktbuf_unshare(self, FALSE);
   z_pktbuf_resize(self, length);
   if (self->pos > length)
     self->pos = length;
@@ -61,6 +272,7 @@ z_pktbuf_copy(ZPktBuf *self, const void *data, gsize length)
 void
 z_pktbuf_relocate(ZPktBuf *self, void *data, gsize length, gboolean is_borrowed)
 {
+  z_pktbuf_unshare(self, FALSE);
   if (self->data && !(self->flags & Z_PB_BORROWED))
     g_free(self->data);
   if (self->pos > length)
@@ -85,13 +297,24 @@ z_pktbuf_relocate(ZPktBuf *self, void *data, gsize length, gboolean is_borrowed)
 void
 z_pktbuf_resize(ZPktBuf *self, gsize size)
 {
+  z_pktbuf_unshare(self, TRUE);
   if (size > self->allocated)
     {
+      gsize alloc_size = size;
+
       /* We don't have to realloc borrowed memory pointer. */
       g_assert(!(self->flags & Z_PB_BORROWED));
 
-      self->data = g_realloc(self->data, size);
-      self->allocated = size;
+      if (self->flags & Z_PB_POOLED)
+        {
+          gint cls = z_pktbuf_pool_class_fit(size);
+
+          /* keep the buffer recyclable by growing to the next class size if it is close */
+          if (cls >= 0)
+            alloc_size = z_pktbuf_pool_sizes[cls];
+        }
+      self->data = g_realloc(self->data, alloc_size);
+      self->allocated = alloc_size;
     }
   if (self->length > size)
     self->length = size;
@@ -113,6 +336,7 @@ z_pktbuf_resize(ZPktBuf *self, gsize size)
 gboolean
 z_pktbuf_set_available(ZPktBuf *self, gsize size)
 {
+  z_pktbuf_unshare(self, TRUE);
   if (self->length >= self->pos + size)
     return TRUE;
   self->length = self->pos + size;
@@ -159,6 +383,22 @@ z_pktbuf_insert(ZPktBuf *self, gsize pos, const void *data, gsize length)
   return TRUE;
 }
 
+/**
+ * Make sure that the data of self is not shared with other buffers, so
+ * that it can be modified through the pointers returned by
+ * z_pktbuf_data() and z_pktbuf_current().
+ *
+ * @param[in] self this
+ *
+ * The z_pktbuf_put_*() functions and the others modifying the buffer do
+ * this automatically.
+ **/
+void
+z_pktbuf_make_writable(ZPktBuf *self)
+{
+  z_pktbuf_unshare(self, TRUE);
+}
+
 gboolean
 z_pktbuf_data_equal(ZPktBuf *lhs, ZPktBuf *rhs)
 {
@@ -182,19 +422,70 @@ z_pktbuf_new(void)
   z_return(self);
 }
 
+/**
+ * Create a new ZPktBuf instance with room for at least size bytes, using
+ * the per-thread buffer pool.
+ *
+ * @param[in] size number of bytes to preallocate
+ *
+ * Sizes close to one of the pool classes (2k, 16k and 64k) are rounded up
+ * to the class size, and both the ZPktBuf structure and its payload are
+ * taken from and returned to a pool private to the calling thread,
+ * avoiding malloc contention between threads. The buffer can be used like
+ * any other ZPktBuf. Other sizes are allocated as usual, without rounding
+ * up, see z_pktbuf_pool_class_fit().
+ *
+ * @returns ZPktBuf* pointer to the new instance
+ **/
+ZPktBuf *
+z_pktbuf_new_sized(gsize size)
+{
+  ZPktBufPool *pool;
+  ZPktBuf *self;
+  gint cls;
+
+  z_enter();
+  cls = z_pktbuf_pool_class_fit(size);
+  if (cls < 0)
+    {
+      self = z_pktbuf_new();
+      z_pktbuf_resize(self, size);
+      z_return(self);
+    }
+
+  pool = z_pktbuf_pool_get();
+  if (pool->count[cls] > 0)
+    {
+      self = pool->bufs[cls][--pool->count[cls]];
+      self->length = self->pos = 0;
+    }
+  else
+    {
+      self = g_new0(ZPktBuf, 1);
+      self->data = g_malloc(z_pktbuf_pool_sizes[cls]);
+      self->allocated = z_pktbuf_pool_sizes[cls];
+    }
+  self->flags = Z_PB_POOLED;
+  z_refcount_set(&self->ref_cnt, 1);
+  z_return(self);
+}
+
 /**
  * Create a new ZPktBuf instance pointing to a slice of another instance.
  *
  * @param[in] parent ZPktBuf instance to point to
  * @param[in] pos beginning of slice (offset from the beginning of parent->data)
  * @param[in] len length of slice
- * 
- * @note The parent instance must hold a non-relocatable buffer, otherwise
- * it couldn't be guaranteed that a) the original instance won't get relocated
- * b) both ZPktBuf instances manipulate the same data.
  *
- * @note It turned out so that we must permit this - no way to
- * do it without hacking.
+ * The slice shares the storage of parent without copying: the storage is
+ * moved to a reference counted ZPktBufStore on the first call, and it is
+ * kept alive until the parent and all slices are freed. Both the parent
+ * and the slices are marked Z_PB_SHARED and get a private copy of their
+ * data when they are modified (copy-on-write), so slices of slices can be
+ * created freely by protocol parsers.
+ *
+ * @note Writing through the pointer returned by z_pktbuf_data() bypasses
+ * copy-on-write, call z_pktbuf_make_writable() first.
  *
  * @returns ZPktBuf* pointer to the new instance
  **/
@@ -204,14 +495,145 @@ z_pktbuf_part(ZPktBuf *parent, gsize pos, gsize len)
   ZPktBuf *self = NULL;
 
   z_enter();
+  if (!(parent->flags & Z_PB_SHARED))
+    {
+      ZPktBufStore *store = g_new0(ZPktBufStore, 1);
+
+      z_refcount_set(&store->ref_cnt, 1);
+      store->data = parent->data;
+      store->borrowed = !!(parent->flags & Z_PB_BORROWED);
+      parent->store = store;
+      parent->flags = (parent->flags & ~Z_PB_BORROWED) | Z_PB_SHARED;
+    }
+
   self = g_new0(ZPktBuf, 1);
   z_refcount_set(&self->ref_cnt, 1);
   self->data = parent->data + pos;
   self->allocated = self->length = MIN(len, parent->length - pos);
-  self->flags = Z_PB_BORROWED;
+  self->flags = Z_PB_SHARED;
+  self->store = parent->store;
+  z_refcount_inc(&self->store->ref_cnt);
   z_return(self);
 }
 
+/**
+ * Create a new, empty buffer chain.
+ *
+ * @returns the new ZPktBufChain instance
+ **/
+ZPktBufChain *
+z_pktbuf_chain_new(void)
+{
+  return g_new0(ZPktBufChain, 1);
+}
+
+/**
+ * Free a buffer chain, dropping the references to its segments.
+ *
+ * @param[in] self this
+ **/
+void
+z_pktbuf_chain_free(ZPktBufChain *self)
+{
+  ZPktBuf *segment;
+
+  while ((segment = (ZPktBuf *) g_queue_pop_head(&self->segments)) != NULL)
+    z_pktbuf_unref(segment);
+  g_free(self);
+}
+
+/**
+ * Add a segment to the end of a buffer chain.
+ *
+ * @param[in] self this
+ * @param[in] segment buffer to append (a new reference is taken)
+ *
+ * The segment is not copied, so it must not be modified while it is part
+ * of the chain. Empty segments are ignored.
+ **/
+void
+z_pktbuf_chain_append(ZPktBufChain *self, ZPktBuf *segment)
+{
+  if (segment->length == 0)
+    return;
+
+  g_queue_push_tail(&self->segments, z_pktbuf_ref(segment));
+  self->length += segment->length;
+}
+
+/**
+ * Add a segment to the beginning of a buffer chain, e.g. to put a header
+ * in front of an already assembled payload.
+ *
+ * @param[in] self this
+ * @param[in] segment buffer to prepend (a new reference is taken)
+ *
+ * @see z_pktbuf_chain_append()
+ **/
+void
+z_pktbuf_chain_prepend(ZPktBufChain *self, ZPktBuf *segment)
+{
+  if (segment->length == 0)
+    return;
+
+  g_queue_push_head(&self->segments, z_pktbuf_ref(segment));
+  self->length += segment->length;
+}
+
+/**
+ * Remove the first segment of a buffer chain.
+ *
+ * @param[in] self this
+ *
+ * @returns the first segment (the reference of the chain is passed to the caller) or NULL if the chain is empty
+ **/
+ZPktBuf *
+z_pktbuf_chain_pop(ZPktBufChain *self)
+{
+  ZPktBuf *segment;
+
+  segment = (ZPktBuf *) g_queue_pop_head(&self->segments);
+  if (segment)
+    self->length -= segment->length;
+  return segment;
+}
+
+/**
+ * Fill an I/O vector with the contents of a buffer chain.
+ *
+ * @param[in]  self this
+ * @param[in]  offset number of bytes to skip at the beginning of the chain
+ * @param[out] vec I/O vector to fill
+ * @param[in]  vec_count number of elements in vec
+ *
+ * At most vec_count segments are returned, the rest of the chain can be
+ * retrieved by calling this function again with a larger offset.
+ *
+ * @returns the number of elements filled in vec
+ **/
+gint
+z_pktbuf_chain_iovec(ZPktBufChain *self, gsize offset, struct iovec *vec, gint vec_count)
+{
+  ZPktBuf *segment;
+  GList *p;
+  gint i = 0;
+
+  for (p = self->segments.head; p && i < vec_count; p = p->next)
+    {
+      segment = (ZPktBuf *) p->data;
+      if (offset >= segment->length)
+        {
+          offset -= segment->length;
+          continue;
+        }
+      vec[i].iov_base = segment->data + offset;
+      vec[i].iov_len = segment->length - offset;
+      offset = 0;
+      i++;
+    }
+  return i;
+}
+
 /**
  * Increment the reference counter for self.
  *
@@ -238,7 +660,12 @@ z_pktbuf_unref(ZPktBuf *self)
   z_enter();
   if (self && z_refcount_dec(&self->ref_cnt))
     {
-      if (self->data && !(self->flags & Z_PB_BORROWED))
+      if ((self->flags & Z_PB_POOLED) && z_pktbuf_pool_put(self))
+        z_return();
+
+      if (self->flags & Z_PB_SHARED)
+        z_pktbuf_store_unref(self->store);
+      else if (self->data && !(self->flags & Z_PB_BORROWED))
         g_free(self->data);
 
       g_free(self);
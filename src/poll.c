@@ -26,10 +26,16 @@
 #ifndef G_OS_WIN32
 #  include <sys/poll.h>
 #endif
+#if HAVE_EPOLL_CREATE
+#  include <sys/epoll.h>
+#  include <fcntl.h>
+#endif
 #ifdef HAVE_UNISTD_H
   #include <unistd.h>
 #endif
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
 
 /**
  * @file
@@ -55,6 +61,7 @@ typedef struct _ZRealPoll
   gboolean quit;
   GStaticMutex lock;
   GSource *wakeup;
+  GSource *epoll;   /**< ZPollEpollSource, NULL if streams are attached to context directly */
 } ZRealPoll;
 
 /**
@@ -151,6 +158,835 @@ GSourceFuncs z_poll_source_funcs =
   NULL
 };
 
+#if HAVE_EPOLL_CREATE
+
+/**
+ * Maximum number of stream layers handled in a single registered stack.
+ **/
+#define Z_POLL_EPOLL_MAX_DEPTH  16
+
+/**
+ * Number of events fetched by a single epoll_wait() call.
+ **/
+#define Z_POLL_EPOLL_EVENTS     64
+
+typedef struct _ZPollEpollSource ZPollEpollSource;
+typedef struct _ZPollEntry ZPollEntry;
+
+/**
+ * A file descriptor of a registered stream stack as seen by epoll.
+ **/
+typedef struct _ZPollFDReg
+{
+  ZPollEntry *entry;
+  GPollFD *pollfd;      /**< borrowed from the stream, only dereferenced while its source is referenced */
+  gint fd;
+  gushort want;         /**< GIOCondition requested by the stream */
+  guint32 registered;   /**< epoll events currently registered, 0 if not in the epoll set */
+  gushort revents;      /**< events reported by epoll but not yet passed to the stream */
+  gboolean no_epoll;    /**< fd cannot be polled with epoll (e.g. regular file), it is always ready */
+} ZPollFDReg;
+
+/**
+ * A stream stack registered with an epoll based ZPoll.
+ **/
+struct _ZPollEntry
+{
+  ZStream *stream;      /**< top of the stack, referenced */
+  gboolean queued;      /**< on the prepare queue, protected by ZPollEpollSource->lock */
+  gboolean ready;       /**< on the ready list */
+  gint ready_layer;     /**< stack layer whose prepare returned TRUE, -1 if none */
+  GList *regs;          /**< list of ZPollFDReg */
+  GSource *sources[Z_POLL_EPOLL_MAX_DEPTH]; /**< referenced sources of the stack layers, top first */
+  gint n_sources;       /**< number of valid items in sources */
+};
+
+/**
+ * GSource multiplexing the streams registered with an epoll based ZPoll
+ * into a single file descriptor in the GMainContext of the ZPoll.
+ *
+ * Stream sources are attached to a private GMainContext which is never
+ * iterated, their prepare, check and dispatch callbacks are called by this
+ * source instead. Only stream stacks that were added, dispatched or
+ * reported a change using z_stream_notify_change() are prepared in an
+ * iteration, the rest is waited for by the kernel, so the cost of an
+ * iteration is proportional to the number of active streams instead of
+ * the number of registered ones.
+ **/
+struct _ZPollEpollSource
+{
+  GSource super;
+  GPollFD pollfd;               /**< the epoll fd itself */
+  GMainContext *stream_context; /**< streams are attached here */
+  GStaticMutex lock;            /**< protects streams, queue and ZPollEntry->queued */
+  GHashTable *streams;          /**< ZStream -> ZPollEntry */
+  GList *queue;                 /**< entries to be prepared in the next iteration */
+  GList *ready;                 /**< entries to be dispatched */
+  GHashTable *fds;              /**< fd -> ZPollFDReg currently owning it in the epoll set */
+  ZPollEntry *processing;       /**< entry whose stream callbacks are running */
+  GThread *thread;              /**< the thread running the poll loop */
+};
+
+static inline guint32
+z_poll_epoll_events(gushort cond)
+{
+  guint32 events = 0;
+
+  if (cond & G_IO_IN)
+    events |= EPOLLIN;
+  if (cond & G_IO_OUT)
+    events |= EPOLLOUT;
+  if (cond & G_IO_PRI)
+    events |= EPOLLPRI;
+  return events;
+}
+
+static inline gushort
+z_poll_epoll_cond(guint32 events)
+{
+  gushort cond = 0;
+
+  if (events & EPOLLIN)
+    cond |= G_IO_IN;
+  if (events & EPOLLOUT)
+    cond |= G_IO_OUT;
+  if (events & EPOLLPRI)
+    cond |= G_IO_PRI;
+  if (events & EPOLLERR)
+    cond |= G_IO_ERR;
+  if (events & EPOLLHUP)
+    cond |= G_IO_HUP;
+  return cond;
+}
+
+/**
+ * Queue an entry for preparation in the next iteration.
+ *
+ * @param[in] self ZPollEpollSource instance
+ * @param[in] entry entry to queue
+ *
+ * @note must be called with self->lock held
+ **/
+static inline void
+z_poll_epoll_queue_entry(ZPollEpollSource *self, ZPollEntry *entry)
+{
+  if (!entry->queued)
+    {
+      entry->queued = TRUE;
+      self->queue = g_list_prepend(self->queue, entry);
+    }
+}
+
+/**
+ * The poll_notify callback installed on registered streams.
+ *
+ * @param[in] stream top of the stream stack
+ * @param[in] user_data ZPollEpollSource instance
+ *
+ * Changes made by the callbacks of the stream being dispatched are ignored
+ * as that stream is prepared again after the dispatch anyway.
+ *
+ * @note this can be called from a thread concurrent to the poll loop.
+ **/
+static void
+z_poll_epoll_stream_notify(ZStream *stream, gpointer user_data)
+{
+  ZPollEpollSource *self = (ZPollEpollSource *) user_data;
+  ZPollEntry *entry;
+
+  g_static_mutex_lock(&self->lock);
+  entry = (ZPollEntry *) g_hash_table_lookup(self->streams, stream);
+  if (entry && !(entry == self->processing && self->thread == g_thread_self()))
+    z_poll_epoll_queue_entry(self, entry);
+  g_static_mutex_unlock(&self->lock);
+}
+
+static void
+z_poll_epoll_release_sources(ZPollEntry *entry, gint from)
+{
+  gint i;
+
+  for (i = from; i < entry->n_sources; i++)
+    {
+      g_source_unref(entry->sources[i]);
+      entry->sources[i] = NULL;
+    }
+  if (entry->n_sources > from)
+    entry->n_sources = from;
+}
+
+/**
+ * Update the cached sources of the layers of a registered stream stack.
+ *
+ * @param[in] self ZPollEpollSource instance
+ * @param[in] entry registered stream stack
+ *
+ * The sources are looked up with z_stream_get_source() only when a layer
+ * was attached with a different source since the last call. Comparing
+ * ZStream->source without the detach lock is safe as the cached source is
+ * referenced, so its address cannot be reused by a new source. A layer is
+ * live as long as its source was not destroyed and it is attached to the
+ * context of this poll. The entry itself belongs to the source the stack
+ * top had when it was registered: once the stream is detached, possibly
+ * attached to a different ZPoll or registered again, the entry is stale.
+ *
+ * @returns the number of live layers from the top, 0 if the stack top is
+ * no longer attached to this poll
+ **/
+static gint
+z_poll_epoll_entry_sources(ZPollEpollSource *self, ZPollEntry *entry)
+{
+  ZStream *p;
+  GSource *source;
+  gint n;
+
+  for (p = entry->stream, n = 0; p && n < Z_POLL_EPOLL_MAX_DEPTH; p = p->child, n++)
+    {
+      if (n < entry->n_sources && entry->sources[n] == p->source)
+        source = entry->sources[n];
+      else if (n == 0)
+        break;
+      else
+        {
+          z_poll_epoll_release_sources(entry, n);
+          source = z_stream_get_source(p);
+          if (!source)
+            break;
+          entry->sources[n] = source;
+          entry->n_sources = n + 1;
+        }
+      if (!(source->flags & G_HOOK_FLAG_ACTIVE) || g_source_get_context(source) != self->stream_context)
+        break;
+    }
+  if (!p)
+    {
+      /* the stack became shallower */
+      z_poll_epoll_release_sources(entry, n);
+    }
+  return n;
+}
+
+/**
+ * Remove a registration from the epoll set.
+ *
+ * @param[in] self ZPollEpollSource instance
+ * @param[in] reg registration
+ *
+ * The fd is only removed if reg still owns it: a closed fd might have been
+ * reused by a different stream in the meantime.
+ **/
+static void
+z_poll_epoll_unregister(ZPollEpollSource *self, ZPollFDReg *reg)
+{
+  if (reg->registered && g_hash_table_lookup(self->fds, GINT_TO_POINTER(reg->fd)) == reg)
+    {
+      epoll_ctl(self->pollfd.fd, EPOLL_CTL_DEL, reg->fd, NULL);
+      g_hash_table_remove(self->fds, GINT_TO_POINTER(reg->fd));
+    }
+  reg->registered = 0;
+}
+
+/**
+ * Update the epoll interest of a registration to match the conditions
+ * requested by its stream.
+ *
+ * @param[in] self ZPollEpollSource instance
+ * @param[in] reg registration
+ *
+ * No system call is made if the requested conditions did not change. An
+ * fd without requested conditions is removed from the epoll set to avoid
+ * being woken up by hangup or error conditions repeatedly.
+ **/
+static void
+z_poll_epoll_register(ZPollEpollSource *self, ZPollFDReg *reg)
+{
+  struct epoll_event ev;
+  guint32 events = z_poll_epoll_events(reg->want);
+  ZPollFDReg *owner;
+  gint rc;
+
+  if (reg->no_epoll || events == reg->registered)
+    return;
+
+  if (events == 0)
+    {
+      z_poll_epoll_unregister(self, reg);
+      return;
+    }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = reg->fd;
+  owner = (ZPollFDReg *) g_hash_table_lookup(self->fds, GINT_TO_POINTER(reg->fd));
+  if (owner && owner != reg)
+    {
+      /* the fd was closed and reused, the stale registration lost it */
+      owner->registered = 0;
+    }
+
+  rc = epoll_ctl(self->pollfd.fd, owner ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, reg->fd, &ev);
+  if (rc < 0 && errno == EEXIST)
+    rc = epoll_ctl(self->pollfd.fd, EPOLL_CTL_MOD, reg->fd, &ev);
+  else if (rc < 0 && errno == ENOENT)
+    rc = epoll_ctl(self->pollfd.fd, EPOLL_CTL_ADD, reg->fd, &ev);
+
+  if (rc < 0)
+    {
+      if (errno == EPERM)
+        {
+          /* regular files and the like cannot be polled, they are always ready */
+          reg->no_epoll = TRUE;
+        }
+      else
+        {
+          /*LOG
+            This message indicates that an fd could not be added to the epoll set
+            of the poll loop, the stream will not receive I/O callbacks.
+           */
+          z_log(NULL, CORE_ERROR, 2, "Error registering fd to epoll; fd='%d', error='%s'", reg->fd, g_strerror(errno));
+        }
+      if (owner == reg)
+        g_hash_table_remove(self->fds, GINT_TO_POINTER(reg->fd));
+      reg->registered = 0;
+      return;
+    }
+  reg->registered = events;
+  g_hash_table_insert(self->fds, GINT_TO_POINTER(reg->fd), reg);
+}
+
+/**
+ * Synchronize the registrations of an entry with the GPollFDs of its
+ * stream sources.
+ *
+ * @param[in] self ZPollEpollSource instance
+ * @param[in] entry registered stream stack
+ * @param[in] sources sources of the stack layers
+ * @param[in] n number of layers
+ **/
+static void
+z_poll_epoll_update_fds(ZPollEpollSource *self, ZPollEntry *entry, GSource **sources, gint n)
+{
+  GList *regs = NULL, *l;
+  GSList *f;
+  ZPollFDReg *reg;
+  gint i;
+
+  for (i = 0; i < n; i++)
+    {
+      for (f = sources[i]->poll_fds; f; f = f->next)
+        {
+          GPollFD *pollfd = (GPollFD *) f->data;
+
+          reg = NULL;
+          for (l = entry->regs; l; l = l->next)
+            {
+              if (((ZPollFDReg *) l->data)->pollfd == pollfd)
+                {
+                  reg = (ZPollFDReg *) l->data;
+                  entry->regs = g_list_delete_link(entry->regs, l);
+                  break;
+                }
+            }
+          if (reg && reg->fd != pollfd->fd)
+            {
+              z_poll_epoll_unregister(self, reg);
+              reg->fd = pollfd->fd;
+              reg->no_epoll = FALSE;
+            }
+          if (!reg)
+            {
+              reg = g_new0(ZPollFDReg, 1);
+              reg->entry = entry;
+              reg->pollfd = pollfd;
+              reg->fd = pollfd->fd;
+            }
+          reg->want = pollfd->events;
+          z_poll_epoll_register(self, reg);
+          regs = g_list_prepend(regs, reg);
+        }
+    }
+
+  /* registrations whose GPollFD disappeared */
+  for (l = entry->regs; l; l = l->next)
+    {
+      z_poll_epoll_unregister(self, (ZPollFDReg *) l->data);
+      g_free(l->data);
+    }
+  g_list_free(entry->regs);
+  entry->regs = regs;
+}
+
+static void
+z_poll_epoll_ready_entry(ZPollEpollSource *self, ZPollEntry *entry)
+{
+  if (!entry->ready)
+    {
+      entry->ready = TRUE;
+      self->ready = g_list_prepend(self->ready, entry);
+    }
+}
+
+/**
+ * Unregister a stream stack and free the associated entry.
+ *
+ * @param[in] self ZPollEpollSource instance
+ * @param[in] entry entry to remove
+ **/
+static void
+z_poll_epoll_remove_entry(ZPollEpollSource *self, ZPollEntry *entry)
+{
+  GList *l;
+
+  for (l = entry->regs; l; l = l->next)
+    {
+      z_poll_epoll_unregister(self, (ZPollFDReg *) l->data);
+      g_free(l->data);
+    }
+  g_list_free(entry->regs);
+
+  g_static_mutex_lock(&self->lock);
+  if (g_hash_table_lookup(self->streams, entry->stream) == entry)
+    {
+      g_hash_table_remove(self->streams, entry->stream);
+      /* the stream might have been added to a different poll since */
+      if (entry->stream->poll_notify_data == self)
+        {
+          entry->stream->poll_notify = NULL;
+          entry->stream->poll_notify_data = NULL;
+        }
+    }
+  if (entry->queued)
+    self->queue = g_list_remove(self->queue, entry);
+  g_static_mutex_unlock(&self->lock);
+
+  if (entry->ready)
+    self->ready = g_list_remove(self->ready, entry);
+  z_poll_epoll_release_sources(entry, 0);
+  z_stream_unref(entry->stream);
+  g_free(entry);
+}
+
+/**
+ * Prepare the layers of a registered stream stack.
+ *
+ * @param[in]  self ZPollEpollSource instance
+ * @param[in]  entry registered stream stack
+ * @param[out] timeout timeout requested by the stream layers
+ *
+ * Layers are prepared top to bottom, and like GMainContext does with
+ * sources of lower priority, layers below the first ready one are not
+ * prepared at all.
+ *
+ * @returns FALSE if the entry was removed as its stream was detached
+ **/
+static gboolean
+z_poll_epoll_prepare_entry(ZPollEpollSource *self, ZPollEntry *entry, gint *timeout)
+{
+  GSource **sources = entry->sources;
+  GList *l;
+  gint n, i;
+
+  n = z_poll_epoll_entry_sources(self, entry);
+  if (n == 0)
+    {
+      z_poll_epoll_remove_entry(self, entry);
+      return FALSE;
+    }
+
+  self->processing = entry;
+  entry->ready_layer = -1;
+  for (i = 0; i < n; i++)
+    {
+      gint t = -1;
+
+      if (sources[i]->source_funcs->prepare(sources[i], &t))
+        {
+          entry->ready_layer = i;
+          break;
+        }
+      if (t >= 0)
+        *timeout = *timeout < 0 ? t : MIN(*timeout, t);
+    }
+  self->processing = NULL;
+
+  z_poll_epoll_update_fds(self, entry, sources, n);
+
+  if (entry->ready_layer >= 0)
+    {
+      z_poll_epoll_ready_entry(self, entry);
+    }
+  else
+    {
+      for (l = entry->regs; l; l = l->next)
+        {
+          ZPollFDReg *reg = (ZPollFDReg *) l->data;
+
+          if (reg->no_epoll && reg->want)
+            {
+              reg->revents |= reg->want;
+              z_poll_epoll_ready_entry(self, entry);
+            }
+        }
+    }
+  return TRUE;
+}
+
+/**
+ * Pass the events reported by epoll to the GPollFDs of a stream stack.
+ *
+ * @param[in] entry registered stream stack
+ * @param[in] n number of live layers
+ * @param[in] clear only clear revents
+ *
+ * Like GLib does on every poll, revents is overwritten rather than
+ * accumulated, and it is cleared once the entry has been dispatched: when
+ * an upper layer was dispatched instead of the fd layer, an event left in
+ * revents would make the fd layer ready in the next iteration although
+ * its data might have been consumed already.
+ **/
+static void
+z_poll_epoll_deliver_events(ZPollEntry *entry, gint n, gboolean clear)
+{
+  GList *l;
+  GSList *f;
+  gint i;
+
+  for (i = 0; i < n; i++)
+    {
+      for (f = entry->sources[i]->poll_fds; f; f = f->next)
+        {
+          GPollFD *pollfd = (GPollFD *) f->data;
+
+          pollfd->revents = 0;
+          if (clear)
+            continue;
+          for (l = entry->regs; l; l = l->next)
+            {
+              ZPollFDReg *reg = (ZPollFDReg *) l->data;
+
+              if (reg->pollfd == pollfd)
+                {
+                  pollfd->revents = reg->revents;
+                  break;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Check the layers of a ready stream stack and dispatch the topmost ready
+ * one.
+ *
+ * @param[in] self ZPollEpollSource instance
+ * @param[in] entry registered stream stack
+ *
+ * The events reported by epoll are passed to the GPollFDs of the stream
+ * while its sources are referenced, as the streams might have been
+ * detached (and freed) since the registration was made.
+ **/
+static void
+z_poll_epoll_dispatch_entry(ZPollEpollSource *self, ZPollEntry *entry)
+{
+  GSource **sources = entry->sources;
+  GList *l;
+  gint n, layer;
+
+  n = z_poll_epoll_entry_sources(self, entry);
+  z_poll_epoll_deliver_events(entry, n, FALSE);
+  for (l = entry->regs; l; l = l->next)
+    ((ZPollFDReg *) l->data)->revents = 0;
+
+  layer = entry->ready_layer;
+  entry->ready_layer = -1;
+
+  self->processing = entry;
+  if (layer < 0 || layer >= n)
+    {
+      for (layer = 0; layer < n; layer++)
+        {
+          if (sources[layer]->source_funcs->check(sources[layer]))
+            break;
+        }
+    }
+  if (layer < n)
+    {
+      GSource *source = sources[layer];
+
+      source->flags |= G_HOOK_FLAG_IN_CALL;
+      source->source_funcs->dispatch(source, NULL, NULL);
+      source->flags &= ~G_HOOK_FLAG_IN_CALL;
+    }
+  self->processing = NULL;
+  z_poll_epoll_deliver_events(entry, n, TRUE);
+}
+
+/**
+ * Fetch the pending events from the epoll fd and mark the corresponding
+ * entries ready.
+ *
+ * @param[in] self ZPollEpollSource instance
+ **/
+static void
+z_poll_epoll_collect_events(ZPollEpollSource *self)
+{
+  struct epoll_event events[Z_POLL_EPOLL_EVENTS];
+  gint rc, i;
+
+  do
+    {
+      rc = epoll_wait(self->pollfd.fd, events, Z_POLL_EPOLL_EVENTS, 0);
+      for (i = 0; i < rc; i++)
+        {
+          ZPollFDReg *reg;
+
+          reg = (ZPollFDReg *) g_hash_table_lookup(self->fds, GINT_TO_POINTER(events[i].data.fd));
+          if (!reg)
+            continue;
+          reg->revents |= z_poll_epoll_cond(events[i].events);
+          z_poll_epoll_ready_entry(self, reg->entry);
+        }
+    }
+  while (rc == Z_POLL_EPOLL_EVENTS || (rc < 0 && errno == EINTR));
+}
+
+/**
+ * This is the prepare function of ZPollEpollSource.
+ *
+ * @param[in]  s ZPollEpollSource instance
+ * @param[out] timeout poll timeout
+ *
+ * Prepares the stream stacks queued since the last iteration and updates
+ * their epoll registrations. Stacks requesting a timeout are queued again,
+ * the others are not prepared until epoll reports an event for them or
+ * they are changed.
+ *
+ * @see GSourceFuncs documentation.
+ *
+ * @returns TRUE if a stream is ready without polling
+ **/
+static gboolean
+z_poll_epoll_source_prepare(GSource *s, gint *timeout)
+{
+  ZPollEpollSource *self = (ZPollEpollSource *) s;
+  GList *queue, *l;
+
+  z_enter();
+  self->thread = g_thread_self();
+
+  g_static_mutex_lock(&self->lock);
+  queue = self->queue;
+  self->queue = NULL;
+  for (l = queue; l; l = l->next)
+    ((ZPollEntry *) l->data)->queued = FALSE;
+  g_static_mutex_unlock(&self->lock);
+
+  *timeout = -1;
+  for (l = queue; l; l = l->next)
+    {
+      ZPollEntry *entry = (ZPollEntry *) l->data;
+      gint t = -1;
+
+      if (entry->ready || entry->queued)
+        continue;
+      if (!z_poll_epoll_prepare_entry(self, entry, &t))
+        continue;
+      if (t >= 0 && !entry->ready)
+        {
+          *timeout = *timeout < 0 ? t : MIN(*timeout, t);
+          g_static_mutex_lock(&self->lock);
+          z_poll_epoll_queue_entry(self, entry);
+          g_static_mutex_unlock(&self->lock);
+        }
+    }
+  g_list_free(queue);
+
+  if (self->ready)
+    *timeout = 0;
+  z_return(self->ready != NULL);
+}
+
+/**
+ * This is the check function of ZPollEpollSource.
+ *
+ * @param[in] s ZPollEpollSource instance
+ *
+ * @see GSourceFuncs documentation.
+ *
+ * @returns TRUE if the epoll fd is readable or a stream is ready
+ **/
+static gboolean
+z_poll_epoll_source_check(GSource *s)
+{
+  ZPollEpollSource *self = (ZPollEpollSource *) s;
+
+  z_enter();
+  z_return(self->ready != NULL || (self->pollfd.revents & G_IO_IN));
+}
+
+/**
+ * This is the dispatch function of ZPollEpollSource.
+ *
+ * @param[in] s ZPollEpollSource instance
+ * @param     callback the callback for s (not used)
+ * @param     user_data the data to be passed to callback (not used)
+ *
+ * Dispatches the ready stream stacks and queues them to be prepared again
+ * in the next iteration.
+ *
+ * @see GSourceFuncs documentation.
+ *
+ * @returns TRUE
+ **/
+static gboolean
+z_poll_epoll_source_dispatch(GSource *s,
+                             GSourceFunc callback G_GNUC_UNUSED,
+                             gpointer user_data G_GNUC_UNUSED)
+{
+  ZPollEpollSource *self = (ZPollEpollSource *) s;
+  GList *ready, *l;
+
+  z_enter();
+  self->thread = g_thread_self();
+  if (self->pollfd.revents & G_IO_IN)
+    z_poll_epoll_collect_events(self);
+  self->pollfd.revents = 0;
+
+  ready = self->ready;
+  self->ready = NULL;
+  for (l = ready; l; l = l->next)
+    ((ZPollEntry *) l->data)->ready = FALSE;
+
+  for (l = ready; l; l = l->next)
+    {
+      ZPollEntry *entry = (ZPollEntry *) l->data;
+
+      z_poll_epoll_dispatch_entry(self, entry);
+      g_static_mutex_lock(&self->lock);
+      z_poll_epoll_queue_entry(self, entry);
+      g_static_mutex_unlock(&self->lock);
+    }
+  g_list_free(ready);
+  z_return(TRUE);
+}
+
+/**
+ * This is the finalize function of ZPollEpollSource, it detaches the
+ * streams still registered and closes the epoll fd.
+ *
+ * @param[in] s ZPollEpollSource instance
+ **/
+static gboolean
+z_poll_epoll_any_entry(gpointer key G_GNUC_UNUSED, gpointer value G_GNUC_UNUSED, gpointer user_data G_GNUC_UNUSED)
+{
+  return TRUE;
+}
+
+static void
+z_poll_epoll_source_finalize(GSource *s)
+{
+  ZPollEpollSource *self = (ZPollEpollSource *) s;
+  ZPollEntry *entry;
+
+  z_enter();
+  while ((entry = (ZPollEntry *) g_hash_table_find(self->streams, z_poll_epoll_any_entry, NULL)) != NULL)
+    {
+      ZStream *stream;
+
+      stream = z_stream_ref(entry->stream);
+      z_poll_epoll_remove_entry(self, entry);
+      z_stream_detach_source(stream);
+      z_stream_unref(stream);
+    }
+  g_hash_table_destroy(self->streams);
+  g_hash_table_destroy(self->fds);
+  g_list_free(self->ready);
+  g_main_context_unref(self->stream_context);
+  close(self->pollfd.fd);
+  g_static_mutex_free(&self->lock);
+  z_return();
+}
+
+/**
+ * ZPollEpollSource virtual methods.
+ **/
+static GSourceFuncs z_poll_epoll_source_funcs =
+{
+  z_poll_epoll_source_prepare,
+  z_poll_epoll_source_check,
+  z_poll_epoll_source_dispatch,
+  z_poll_epoll_source_finalize,
+  NULL,
+  NULL
+};
+
+/**
+ * Create a new ZPollEpollSource instance.
+ *
+ * @returns the new source or NULL if the epoll fd cannot be created
+ **/
+static GSource *
+z_poll_epoll_source_new(void)
+{
+  ZPollEpollSource *self;
+  gint fd;
+
+  z_enter();
+  fd = epoll_create(64);
+  if (fd < 0)
+    {
+      /*LOG
+        This message indicates that the epoll fd could not be created and
+        the regular poll() based loop is used instead.
+       */
+      z_log(NULL, CORE_ERROR, 3, "Error creating epoll fd, falling back to poll(); error='%s'", g_strerror(errno));
+      z_return(NULL);
+    }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  self = (ZPollEpollSource *) g_source_new(&z_poll_epoll_source_funcs, sizeof(ZPollEpollSource));
+  self->pollfd.fd = fd;
+  self->pollfd.events = G_IO_IN;
+  self->stream_context = g_main_context_new();
+  g_static_mutex_init(&self->lock);
+  self->streams = g_hash_table_new(g_direct_hash, g_direct_equal);
+  self->fds = g_hash_table_new(g_direct_hash, g_direct_equal);
+  g_source_add_poll(&self->super, &self->pollfd);
+  z_return(&self->super);
+}
+
+/**
+ * Register a stream stack with a ZPollEpollSource.
+ *
+ * @param[in] s ZPollEpollSource instance
+ * @param[in] stream top of the stream stack
+ **/
+static void
+z_poll_epoll_add_stream(GSource *s, ZStream *stream)
+{
+  ZPollEpollSource *self = (ZPollEpollSource *) s;
+  ZPollEntry *entry;
+
+  z_enter();
+  z_stream_attach_source(stream, self->stream_context);
+
+  entry = g_new0(ZPollEntry, 1);
+  entry->stream = z_stream_ref(stream);
+  entry->ready_layer = -1;
+  entry->sources[0] = z_stream_get_source(stream);
+  entry->n_sources = entry->sources[0] ? 1 : 0;
+
+  g_static_mutex_lock(&self->lock);
+  g_hash_table_insert(self->streams, stream, entry);
+  stream->poll_notify_data = self;
+  stream->poll_notify = z_poll_epoll_stream_notify;
+  z_poll_epoll_queue_entry(self, entry);
+  g_static_mutex_unlock(&self->lock);
+  z_return();
+}
+
+#endif
+
 /**
  * This function creates a new ZPoll instance.
  *
@@ -183,6 +1019,34 @@ z_poll_new(void)
   z_return((ZPoll *) self);
 }
 
+/**
+ * This function creates a new ZPoll instance using epoll to wait for
+ * stream events.
+ *
+ * Streams added with z_poll_add_stream() are registered with a single
+ * epoll fd instead of adding their fds to the GMainContext one by one, and
+ * are only prepared when they become active. Other sources attached to the
+ * context returned by z_poll_get_context() work as usual.
+ *
+ * Falls back to z_poll_new() if epoll is not available.
+ *
+ * @returns a pointer to the new instance
+ **/
+ZPoll *
+z_poll_new_epoll(void)
+{
+  ZRealPoll *self;
+
+  z_enter();
+  self = (ZRealPoll *) z_poll_new();
+#if HAVE_EPOLL_CREATE
+  self->epoll = z_poll_epoll_source_new();
+  if (self->epoll)
+    g_source_attach(self->epoll, self->context);
+#endif
+  z_return((ZPoll *) self);
+}
+
 /** 
  * Used internally to free up an instance when the reference count
  * reaches 0.
@@ -201,6 +1065,12 @@ z_poll_destroy(ZPoll *s)
       g_source_unref(self->wakeup);
       self->wakeup = NULL;
     }
+  if (self->epoll)
+    {
+      g_source_destroy(self->epoll);
+      g_source_unref(self->epoll);
+      self->epoll = NULL;
+    }
   g_main_context_release(self->context);
   g_main_context_unref(self->context);
   g_free(self->pollfd);
@@ -258,6 +1128,13 @@ z_poll_add_stream(ZPoll *s, ZStream *stream)
   ZRealPoll *self = (ZRealPoll *) s;
 
   z_enter();
+#if HAVE_EPOLL_CREATE
+  if (self->epoll)
+    {
+      z_poll_epoll_add_stream(self->epoll, stream);
+      z_return();
+    }
+#endif
   z_stream_attach_source(stream, self->context);
   z_return();
 }
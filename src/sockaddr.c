@@ -217,7 +217,8 @@ typedef struct _ZSockAddrInet
  * @param[in] sock_flags socket flags (ZSF_*)
  *
  * It currently enables SO_REUSEADDR to permit concurrent
- * access to the same socket.
+ * access to the same socket, and SO_REUSEPORT if ZSF_REUSEPORT is
+ * specified.
  *
  * @returns GIOStatus to indicate success/failure
  **/
@@ -232,6 +233,13 @@ z_sockaddr_inet_bind_prepare(int sock, ZSockAddr *addr G_GNUC_UNUSED, guint32 so
       if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *) &tmp, sizeof(tmp)) < 0)
         res = G_IO_STATUS_ERROR;
     }
+#ifdef SO_REUSEPORT
+  if (sock_flags & ZSF_REUSEPORT)
+    {
+      if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *) &tmp, sizeof(tmp)) < 0)
+        res = G_IO_STATUS_ERROR;
+    }
+#endif
   
   return res;
 }
@@ -415,8 +415,14 @@ z_do_ll_bind(int fd, struct sockaddr *sa, socklen_t salen, guint32 sock_flags)
 }
 
 gint
-z_do_ll_accept(int fd, struct sockaddr *sa, socklen_t *salen, guint32 sock_flags G_GNUC_UNUSED)
+z_do_ll_accept(int fd, struct sockaddr *sa, socklen_t *salen, guint32 sock_flags)
 {
+#if HAVE_ACCEPT4
+  if (sock_flags & ZSF_ACCEPT_NONBLOCK)
+    return accept4(fd, sa, salen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  (void) sock_flags;
+#endif
   return accept(fd, sa, salen);
 }
 
@@ -601,6 +601,7 @@ z_stream_set_cond(ZStream *s, guint type, gboolean value)
     default:
       break;
     }
+  z_stream_notify_change(s);
   return ret;
 }
 
@@ -639,6 +640,7 @@ z_stream_set_callback(ZStream *s, guint type, ZStreamCallback callback, gpointer
     default:
       break;
     }
+  z_stream_notify_change(s);
   return ret;
 }
 
@@ -751,7 +753,8 @@ z_stream_set_child_method(ZStream *self, ZStream *new_child)
       self->timeout = new_child->timeout;
       for (p = self; p && p->child; p = p->child)
         p->child->umbrella_state &= ~self->umbrella_flags;
-    }  
+    }
+  z_stream_notify_change(self);
 }
 
 /**
@@ -862,6 +865,7 @@ z_stream_restore_context(ZStream *self, ZStreamContext *context)
     }
 
   context->restored = TRUE;
+  z_stream_notify_change(self);
   z_return(TRUE);
 }
 
@@ -1020,11 +1024,36 @@ z_stream_detach_source_method(ZStream *self)
     z_stream_detach_source(self->child);
 
   if (detached)
-    z_stream_struct_unref(self);
+    {
+      z_stream_notify_change(self);
+      z_stream_struct_unref(self);
+    }
     
   z_return();
 }
 
+/**
+ * Return a new reference to the GSource of the stream.
+ *
+ * @param[in] self ZStream instance
+ *
+ * @note this can be called from a thread concurrent to
+ * z_stream_detach_source().
+ *
+ * @returns the GSource, or NULL if the stream is not attached to a poll loop
+ **/
+GSource *
+z_stream_get_source(ZStream *self)
+{
+  GSource *source = NULL;
+
+  g_static_mutex_lock(&detach_lock);
+  if (self->source)
+    source = g_source_ref(self->source);
+  g_static_mutex_unlock(&detach_lock);
+  return source;
+}
+
 /**
  * This function is called to read bytes from a stream.
  *
@@ -1035,7 +1064,8 @@ z_stream_detach_source_method(ZStream *self)
  * @param[out] err error value
  *
  * This function reads from the ZPktBuf inside the ZStream and returns
- * it in buf. (The ZPktBuf is in the GList ungot_bufs)
+ * it in buf. (The ZPktBuf is in the GList ungot_bufs, its pos member
+ * tracks how much of it has already been consumed.)
  *
  * @returns GLib I/O status
  **/
@@ -1056,11 +1086,11 @@ z_stream_read(ZStream *self, void *buf, gsize count, gsize *bytes_read, GError *
       l = self->ungot_bufs;
       pack = (ZPktBuf *) l->data;
 
-      if (count >= pack->length)
+      if (count >= z_pktbuf_available(pack))
         {
-          /* consume the whole packet */
-          memcpy(buf, pack->data, pack->length);
-          *bytes_read = pack->length;
+          /* consume the rest of the packet */
+          *bytes_read = z_pktbuf_available(pack);
+          memcpy(buf, z_pktbuf_current(pack), *bytes_read);
 
           self->ungot_bufs = g_list_remove_link(self->ungot_bufs, self->ungot_bufs);
           g_list_free_1(l);
@@ -1068,13 +1098,10 @@ z_stream_read(ZStream *self, void *buf, gsize count, gsize *bytes_read, GError *
         }
       else
         {
-          /* consume part of the packet */
-          memcpy(buf, pack->data, count);
+          /* consume part of the packet, the rest is returned by the next read */
+          memcpy(buf, z_pktbuf_current(pack), count);
           *bytes_read = count;
-
-          memmove(pack->data, pack->data + count, pack->length - count);
-          pack->data = g_realloc(pack->data, pack->length - count);
-          pack->length = pack->length - count;
+          pack->pos += count;
         }
       
       res = G_IO_STATUS_NORMAL;
@@ -1097,6 +1124,7 @@ z_stream_read(ZStream *self, void *buf, gsize count, gsize *bytes_read, GError *
       self->bytes_recvd += *bytes_read;
       z_stream_data_dump(self, G_IO_IN, buf, *bytes_read);
     }
+  z_stream_notify_change(self);
   
   if (local_error)
     g_propagate_error(err, local_error);
@@ -1140,12 +1168,204 @@ z_stream_write(ZStream *self, const void *buf, gsize count, gsize *bytes_written
       self->bytes_sent += *bytes_written;
       z_stream_data_dump(self, G_IO_OUT, buf, *bytes_written);
     }
+  z_stream_notify_change(self);
 
   if (local_error)  
     g_propagate_error(err, local_error);
   return res;
 }
 
+/**
+ * Generic read_vec method used by streams without native scatter-gather
+ * support.
+ *
+ * @param[in]  s ZStream instance
+ * @param[in]  vec I/O vector to read into
+ * @param[in]  vec_count number of elements in vec
+ * @param[out] bytes_read number of bytes read
+ * @param[out] err error value
+ *
+ * Fills the elements of vec one by one using the stream's read method,
+ * stopping at the first short read. If some data was already read when
+ * the read method returns something else than G_IO_STATUS_NORMAL, the
+ * condition is swallowed and the data read so far is returned; the next
+ * read will report it again.
+ *
+ * @returns GLib I/O status
+ **/
+GIOStatus
+z_stream_read_vec_method(ZStream *s, const struct iovec *vec, gint vec_count, gsize *bytes_read, GError **err)
+{
+  GIOStatus res = G_IO_STATUS_NORMAL;
+  gsize total = 0, len;
+  gint i;
+
+  z_enter();
+  for (i = 0; i < vec_count; i++)
+    {
+      if (vec[i].iov_len == 0)
+        continue;
+
+      res = Z_FUNCS(s, ZStream)->read(s, vec[i].iov_base, vec[i].iov_len, &len, total ? NULL : err);
+      if (res != G_IO_STATUS_NORMAL)
+        break;
+      total += len;
+      if (len < vec[i].iov_len)
+        break;
+    }
+  if (total > 0)
+    res = G_IO_STATUS_NORMAL;
+  *bytes_read = total;
+  z_return(res);
+}
+
+/**
+ * Generic write_vec method used by streams without native scatter-gather
+ * support.
+ *
+ * @param[in]  s ZStream instance
+ * @param[in]  vec I/O vector to write
+ * @param[in]  vec_count number of elements in vec
+ * @param[out] bytes_written number of bytes written
+ * @param[out] err error value
+ *
+ * Writes the elements of vec one by one using the stream's write method,
+ * stopping at the first short write. Errors after a partial write are
+ * handled the same way as in z_stream_read_vec_method().
+ *
+ * @returns GLib I/O status
+ **/
+GIOStatus
+z_stream_write_vec_method(ZStream *s, const struct iovec *vec, gint vec_count, gsize *bytes_written, GError **err)
+{
+  GIOStatus res = G_IO_STATUS_NORMAL;
+  gsize total = 0, len;
+  gint i;
+
+  z_enter();
+  for (i = 0; i < vec_count; i++)
+    {
+      if (vec[i].iov_len == 0)
+        continue;
+
+      res = Z_FUNCS(s, ZStream)->write(s, vec[i].iov_base, vec[i].iov_len, &len, total ? NULL : err);
+      if (res != G_IO_STATUS_NORMAL)
+        break;
+      total += len;
+      if (len < vec[i].iov_len)
+        break;
+    }
+  if (total > 0)
+    res = G_IO_STATUS_NORMAL;
+  *bytes_written = total;
+  z_return(res);
+}
+
+/**
+ * This function is called to read bytes from a stream into several
+ * buffers at once.
+ *
+ * @param[in]  self ZStream instance
+ * @param[in]  vec I/O vector describing the destination buffers
+ * @param[in]  vec_count number of elements in vec
+ * @param[out] bytes_read number of bytes read
+ * @param[out] err error value
+ *
+ * Ungot data is returned first, in that case only the first non-empty
+ * element of vec is filled.
+ *
+ * @returns GLib I/O status
+ **/
+GIOStatus
+z_stream_read_vec(ZStream *self, const struct iovec *vec, gint vec_count, gsize *bytes_read, GError **err)
+{
+  GIOStatus res;
+  GError *local_error = NULL;
+
+  g_return_val_if_fail((err == NULL) || (*err == NULL), G_IO_STATUS_ERROR);
+
+  if (self->ungot_bufs)
+    {
+      gint i;
+
+      for (i = 0; i < vec_count && vec[i].iov_len == 0; i++)
+        ;
+      if (i == vec_count)
+        {
+          *bytes_read = 0;
+          return G_IO_STATUS_NORMAL;
+        }
+      return z_stream_read(self, vec[i].iov_base, vec[i].iov_len, bytes_read, err);
+    }
+
+  res = Z_FUNCS(self, ZStream)->read_vec(self, vec, vec_count, bytes_read, &local_error);
+
+  if (res == G_IO_STATUS_ERROR)
+    {
+      /*LOG
+        This message indicates that reading from the given stream failed of
+        the given reason.
+       */
+      z_log(self->name, CORE_ERROR, 1, "Stream read failed; stream='%s', reason='%s'", self->super.isa->name, local_error ? local_error->message : "unknown");
+    }
+  else if (res == G_IO_STATUS_NORMAL)
+    {
+      self->bytes_recvd += *bytes_read;
+      z_stream_data_dump_vec(self, G_IO_IN, vec, vec_count, *bytes_read);
+    }
+  z_stream_notify_change(self);
+
+  if (local_error)
+    g_propagate_error(err, local_error);
+  return res;
+}
+
+/**
+ * This function is called to write the contents of several buffers to a
+ * stream at once.
+ *
+ * @param[in]  self ZStream instance
+ * @param[in]  vec I/O vector describing the source buffers
+ * @param[in]  vec_count number of elements in vec
+ * @param[out] bytes_written number of bytes written
+ * @param[out] err error value
+ *
+ * Streams implementing write_vec natively (like ZStreamFD) emit the whole
+ * vector in a single system call, others fall back to calling their write
+ * method for each element.
+ *
+ * @returns GLib I/O status
+ **/
+GIOStatus
+z_stream_write_vec(ZStream *self, const struct iovec *vec, gint vec_count, gsize *bytes_written, GError **err)
+{
+  GIOStatus res;
+  GError *local_error = NULL;
+
+  g_return_val_if_fail((err == NULL) || (*err == NULL), G_IO_STATUS_ERROR);
+
+  res = Z_FUNCS(self, ZStream)->write_vec(self, vec, vec_count, bytes_written, &local_error);
+
+  if (res == G_IO_STATUS_ERROR)
+    {
+      /*LOG
+        This message indicates that some I/O error occurred in
+        the write() system call.
+       */
+      z_log(self->name, CORE_ERROR, 1, "Stream write failed; stream='%s', reason='%s'", self->super.isa->name, local_error ? local_error->message : "unknown");
+    }
+  else if (res == G_IO_STATUS_NORMAL)
+    {
+      self->bytes_sent += *bytes_written;
+      z_stream_data_dump_vec(self, G_IO_OUT, vec, vec_count, *bytes_written);
+    }
+  z_stream_notify_change(self);
+
+  if (local_error)
+    g_propagate_error(err, local_error);
+  return res;
+}
+
 /**
  * This function is called to close the stream, it also initiates
  * destructing the stream stack structure by calling
@@ -1283,7 +1503,8 @@ z_stream_write_chunk(ZStream *self, const void *buf, gsize len, gsize *bytes_wri
  * @param[out] error error value
  *
  * This is the default unget_packet method for streams. It puts the
- * pack argument to its list of ungot packets.
+ * pack argument to its list of ungot packets. The whole contents of pack
+ * is returned by subsequent reads regardless of its current position.
  *
  * @return TRUE on success (it only fails if error is a NULL pointer or points to a NULL pointer)
  **/
@@ -1294,6 +1515,7 @@ z_stream_unget_packet_method(ZStream *self, ZPktBuf *pack, GError **error)
 
   g_return_val_if_fail((error == NULL) || (*error == NULL), FALSE);
   z_enter();
+  z_pktbuf_seek(pack, G_SEEK_SET, 0);
   for (p = self; p; p = p->child)
     {
       if ((p->umbrella_flags & G_IO_IN))
@@ -1320,7 +1542,7 @@ z_stream_unget(ZStream *self, const void *buf, gsize count, GError **error)
 
   g_return_val_if_fail((error == NULL) || (*error == NULL), FALSE);
   
-  pack = z_pktbuf_new();
+  pack = z_pktbuf_new_sized(count);
   z_pktbuf_copy(pack, buf, count);
   if (!z_stream_unget_packet(self, pack, error))
     {
@@ -1464,7 +1686,9 @@ ZStreamFuncs z_stream_funcs =
   z_stream_extra_save_method,
   z_stream_extra_restore_method,
   z_stream_set_child_method,
-  z_stream_unget_packet_method
+  z_stream_unget_packet_method,
+  z_stream_read_vec_method,
+  z_stream_write_vec_method
 };
 
 /**
@@ -327,7 +327,9 @@ z_stream_blob_funcs =
   NULL,
   NULL,
   NULL,
-  NULL
+  NULL,
+  NULL, /* read_vec */
+  NULL  /* write_vec */
 };
 
 /**
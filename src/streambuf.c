@@ -64,6 +64,7 @@
 
 
 #define MAX_BUF_LEN 262144
+#define MAX_FLUSH_IOVEC 32
 
 /**
  * Structure representing ZStreamBuf state.
@@ -77,8 +78,7 @@ typedef struct _ZStreamBuf
   
   gsize pending_pos;
   GError *flush_error;
-  gsize current_size;
-  GList *buffers;
+  ZPktBufChain *buffers;
   GStaticMutex buffer_lock;
 } ZStreamBuf;
 
@@ -94,14 +94,14 @@ static GIOStatus z_stream_write_packet_internal(ZStream *s, ZPktBuf *packet, GEr
  *
  * @returns TRUE if there's available buffer space.
  *
- * @note although current_size is protected by a lock it is not absolutely
+ * @note although the buffer chain is protected by a lock it is not absolutely
  * required to lock it, as it does not cause problems to overcommit the
  * buffer, it only increases memory usage slightly.
  **/
 static inline gboolean
 z_stream_buf_space_avail_internal(ZStreamBuf *self)
 {
-  return self->current_size < self->buf_threshold;
+  return z_pktbuf_chain_length(self->buffers) < self->buf_threshold;
 }
 
 /**
@@ -132,32 +132,42 @@ z_stream_buf_space_avail(ZStream *s)
  *
  * It is automatically invoked when the child becomes writable
  * and provided Z_SBF_IMMED_FLUSH is specified after each write() operation.
+ *
+ * Queued packets are coalesced into a single z_stream_write_vec() call
+ * (up to MAX_FLUSH_IOVEC packets at a time), which results in a single
+ * writev() if the child is a ZStreamFD.
  **/
 static void
 z_stream_buf_flush_internal(ZStreamBuf *self)
 {
+  struct iovec vec[MAX_FLUSH_IOVEC];
   ZPktBuf *packet;
   guint i = 10;
-  gsize write_len;
+  gint vec_count;
+  gsize write_len, left;
   GIOStatus res = G_IO_STATUS_NORMAL;
   GError *local_error = NULL;
 
   z_enter();
   g_static_mutex_lock(&self->buffer_lock);
-  while (self->buffers && i && res == G_IO_STATUS_NORMAL)
+  while (z_pktbuf_chain_segments(self->buffers) && i && res == G_IO_STATUS_NORMAL)
     {
-      packet = (ZPktBuf *) self->buffers->data;
-      
-      res = z_stream_write(self->super.child, packet->data + self->pending_pos, packet->length - self->pending_pos, &write_len, &local_error);
+      vec_count = z_pktbuf_chain_iovec(self->buffers, self->pending_pos, vec, MAX_FLUSH_IOVEC);
+      res = z_stream_write_vec(self->super.child, vec, vec_count, &write_len, &local_error);
       if (res == G_IO_STATUS_NORMAL)
         {
-          self->pending_pos += write_len;
-          if (self->pending_pos >= packet->length)
+          /* drop the packets that were completely written */
+          while ((packet = z_pktbuf_chain_head(self->buffers)) != NULL)
             {
-              self->current_size -= packet->length;
-              z_pktbuf_unref(packet);
+              left = packet->length - self->pending_pos;
+              if (left > write_len)
+                {
+                  self->pending_pos += write_len;
+                  break;
+                }
+              write_len -= left;
+              z_pktbuf_unref(z_pktbuf_chain_pop(self->buffers));
               self->pending_pos = 0;
-              self->buffers = g_list_delete_link(self->buffers, self->buffers);
             }
         }
       else if (res != G_IO_STATUS_AGAIN)
@@ -235,7 +245,7 @@ z_stream_buf_write_method(ZStream *s, const void *buf, gsize count, gsize *bytes
   g_return_val_if_fail ((error == NULL) || (*error == NULL), G_IO_STATUS_ERROR);
   self->super.child->timeout = self->super.timeout;
   /* NOTE: we use internal functions to avoid logging the same data twice */
-  packet = z_pktbuf_new();
+  packet = z_pktbuf_new_sized(count);
   z_pktbuf_copy(packet, buf, count);
   ret = z_stream_write_packet_internal(s, packet, &local_error);
   if (ret == G_IO_STATUS_NORMAL)
@@ -277,6 +287,46 @@ z_stream_buf_shutdown_method(ZStream *s, int i, GError **error)
   z_return(res);
 }
 
+/**
+ * Lock the buffer of self for appending data.
+ *
+ * @param[in]  self ZStreamBuf instance
+ * @param[out] error error state if FALSE is returned
+ *
+ * @returns TRUE if the buffer was locked, FALSE if a previous flush
+ * failed, in which case the buffer is not locked
+ **/
+static gboolean
+z_stream_buf_lock_for_write(ZStreamBuf *self, GError **error)
+{
+  g_static_mutex_lock(&self->buffer_lock);
+  if (z_pktbuf_chain_length(self->buffers) > MAX_BUF_LEN)
+    z_log(self->super.name, CORE_ERROR, 0, "Internal error, ZStreamBuf internal buffer became too large, continuing anyway; current_size='%zd'", z_pktbuf_chain_length(self->buffers));
+  if (self->flush_error)
+    {
+      if (error)
+        *error = g_error_copy(self->flush_error);
+      g_static_mutex_unlock(&self->buffer_lock);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/**
+ * Unlock the buffer of self after appending data and start flushing it.
+ *
+ * @param[in] self ZStreamBuf instance
+ * @param[in] s top of the stream stack
+ **/
+static void
+z_stream_buf_unlock_after_write(ZStreamBuf *self, ZStream *s)
+{
+  g_static_mutex_unlock(&self->buffer_lock);
+  if (self->flags & Z_SBF_IMMED_FLUSH)
+    z_stream_buf_flush_internal(self);
+  z_stream_notify_change(s);
+}
+
 /**
  * @param[in]  s top of the stream stack
  * @param[in]  packet packet to be written (consumed)
@@ -297,22 +347,15 @@ z_stream_write_packet_internal(ZStream *s, ZPktBuf *packet, GError **error)
   
   z_enter();
   self = Z_CAST(z_stream_search_stack(s, G_IO_OUT, Z_CLASS(ZStreamBuf)), ZStreamBuf);
-  g_static_mutex_lock(&self->buffer_lock);
-  if (self->current_size > MAX_BUF_LEN)
-    z_log(s->name, CORE_ERROR, 0, "Internal error, ZStreamBuf internal buffer became too large, continuing anyway; current_size='%zd'", self->current_size);
-  if (self->flush_error)
+  if (!z_stream_buf_lock_for_write(self, error))
     {
-      if (error)
-        *error = g_error_copy(self->flush_error);
-      g_static_mutex_unlock(&self->buffer_lock);
+      z_pktbuf_unref(packet);
       z_return(G_IO_STATUS_ERROR);
     }
-  
-  self->buffers = g_list_append(self->buffers, packet);
-  self->current_size += packet->length;
-  g_static_mutex_unlock(&self->buffer_lock);
-  if (self->flags & Z_SBF_IMMED_FLUSH)
-    z_stream_buf_flush_internal(self);
+
+  z_pktbuf_chain_append(self->buffers, packet);
+  z_pktbuf_unref(packet);
+  z_stream_buf_unlock_after_write(self, s);
   z_return(G_IO_STATUS_NORMAL);
 }
 
@@ -346,6 +389,47 @@ z_stream_write_packet(ZStream *s, ZPktBuf *packet, GError **error)
   return res;
 }
 
+/**
+ * This function appends all segments of a buffer chain to the internal
+ * buffer without copying them.
+ *
+ * @param[in]  s top of the stream stack
+ * @param[in]  chain buffer chain to be written
+ * @param[out] error error state if G_IO_STATUS_ERROR is returned
+ *
+ * The segments are referenced, so chain can be freed or reused right
+ * after this call, but the segments must not be modified until they are
+ * flushed. The segments are queued atomically with respect to other
+ * writers and are flushed using writev(), e.g. a header and a body can be
+ * sent without assembling them into a single buffer first. Error reporting
+ * is the same as in z_stream_write_packet().
+ *
+ * @returns GIOStatus instance
+ **/
+GIOStatus
+z_stream_write_packet_chain(ZStream *s, ZPktBufChain *chain, GError **error)
+{
+  ZStreamBuf *self;
+  ZPktBuf *packet;
+  GList *p;
+
+  z_enter();
+  self = Z_CAST(z_stream_search_stack(s, G_IO_OUT, Z_CLASS(ZStreamBuf)), ZStreamBuf);
+  if (!z_stream_buf_lock_for_write(self, error))
+    z_return(G_IO_STATUS_ERROR);
+
+  for (p = chain->segments.head; p; p = p->next)
+    z_pktbuf_chain_append(self->buffers, (ZPktBuf *) p->data);
+  z_stream_buf_unlock_after_write(self, s);
+
+  for (p = chain->segments.head; p; p = p->next)
+    {
+      packet = (ZPktBuf *) p->data;
+      z_stream_data_dump(&self->super, G_IO_OUT, packet->data, packet->length);
+    }
+  z_return(G_IO_STATUS_NORMAL);
+}
+
 /**
  * This function appends a block to the internal buffer, possibly copying or
  * consuming the buffer passed in buf.
@@ -371,11 +455,16 @@ z_stream_write_buf(ZStream *s, void *buf, guint buflen, gboolean copy_buf, GErro
   self = Z_CAST(z_stream_search_stack(s, G_IO_OUT, Z_CLASS(ZStreamBuf)), ZStreamBuf);
 
   /* copying is done outside the protection of the lock */
-  packet = z_pktbuf_new();
   if (copy_buf)
-    z_pktbuf_copy(packet, buf, buflen);
+    {
+      packet = z_pktbuf_new_sized(buflen);
+      z_pktbuf_copy(packet, buf, buflen);
+    }
   else
-    z_pktbuf_relocate(packet, buf, buflen, FALSE);
+    {
+      packet = z_pktbuf_new();
+      z_pktbuf_relocate(packet, buf, buflen, FALSE);
+    }
 
   z_pktbuf_ref(packet);      
   res = z_stream_write_packet_internal(s, packet, error);
@@ -512,7 +601,7 @@ z_stream_buf_watch_prepare(ZStream *s, GSource *src G_GNUC_UNUSED, gint *timeout
   *timeout = -1;
   z_stream_set_cond(s->child, G_IO_IN, s->want_read);
   z_stream_set_cond(s->child, G_IO_PRI, s->want_pri);
-  z_stream_set_cond(s->child, G_IO_OUT, !!self->current_size && self->flush_error == NULL);
+  z_stream_set_cond(s->child, G_IO_OUT, z_pktbuf_chain_segments(self->buffers) && self->flush_error == NULL);
   
   if (s->want_write && z_stream_buf_space_avail_internal(self))
     ret = TRUE;
@@ -607,6 +696,7 @@ z_stream_buf_new(ZStream *child, gsize buf_threshold, guint32 flags)
   self = Z_CAST(z_stream_new(Z_CLASS(ZStreamBuf), child ? child->name : "", G_IO_OUT), ZStreamBuf);
   self->buf_threshold = buf_threshold;
   self->flags = flags;
+  self->buffers = z_pktbuf_chain_new();
   z_stream_set_child(&self->super, child);
   z_return((ZStream *) self);
 }
@@ -622,12 +712,7 @@ z_stream_buf_free_method(ZObject *s)
   ZStreamBuf *self = Z_CAST(s, ZStreamBuf);
 
   z_enter();
-  while (self->buffers)
-    {
-      ZPktBuf *packet = (ZPktBuf *) self->buffers->data;
-      z_pktbuf_unref(packet);
-      self->buffers = g_list_delete_link(self->buffers, self->buffers);
-    }
+  z_pktbuf_chain_free(self->buffers);
   if (self->flush_error)
     g_error_free(self->flush_error);
   z_stream_free_method(s);
@@ -661,7 +746,9 @@ ZStreamFuncs z_stream_buf_funcs =
   NULL,
   NULL,
   z_stream_buf_set_child,
-  NULL
+  NULL,
+  NULL, /* read_vec */
+  NULL  /* write_vec */
 };
 
 /**
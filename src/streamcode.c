@@ -0,0 +1,525 @@
+/***************************************************************************
+ *
+ * This file is covered by a dual licence. You can choose whether you
+ * want to use it according to the terms of the GNU GPL version 2, or
+ * under the terms of Zorp Professional Firewall System EULA located
+ * on the Zorp installation CD.
+ *
+ ***************************************************************************/
+
+#include <zorp/streamcode.h>
+#include <zorp/stream.h>
+#include <zorp/log.h>
+
+#include <string.h>
+
+#ifdef G_OS_WIN32
+#  include <winsock2.h>
+#else
+#  include <sys/socket.h>
+#endif
+
+/** code stream state */
+enum
+{
+  Z_SCS_EOF_RECEIVED = 0x0001,
+  Z_SCS_READ_ERROR   = 0x0002,
+  Z_SCS_WRITE_ERROR  = 0x0004,
+};
+
+extern ZClass ZStreamCode__class;
+
+/**
+ * ZStream derived class that transforms the data written to and read from
+ * its child using ZCode instances.
+ *
+ * The transformed data is kept in the result buffer of the ZCode
+ * instances. New data is only transformed after the previous output has
+ * been consumed and at most buffer_length bytes are transformed at once,
+ * so the buffers stay bounded regardless of the amount of data passing
+ * through the stream.
+ **/
+typedef struct _ZStreamCode
+{
+  ZStream super;
+
+  ZCode *encode;        /**< transforms data written to the stream, NULL to pass it through */
+  ZCode *decode;        /**< transforms data read from the child, NULL to pass it through */
+  gsize buffer_length;
+  guchar *read_buf;
+
+  guint32 state;
+  gint shutdown;
+  GIOCondition child_cond;
+} ZStreamCode;
+
+/**
+ * Check whether the encoder has output not yet written to the child.
+ *
+ * @param[in] self ZStreamCode instance
+ **/
+static inline gboolean
+z_stream_code_write_pending(ZStreamCode *self)
+{
+  return self->encode && z_code_get_result_length(self->encode) > 0;
+}
+
+/**
+ * Check whether a read operation would not block.
+ *
+ * @param[in] self ZStreamCode instance
+ **/
+static inline gboolean
+z_stream_code_read_ready(ZStreamCode *self)
+{
+  return (self->child_cond & G_IO_IN) ||
+         (self->state & (Z_SCS_EOF_RECEIVED | Z_SCS_READ_ERROR)) ||
+         (self->decode && z_code_get_result_length(self->decode) > 0);
+}
+
+/**
+ * Check whether a write operation would not block.
+ *
+ * @param[in] self ZStreamCode instance
+ *
+ * New data can be accepted as soon as the output of the previous write
+ * has been written to the child.
+ **/
+static inline gboolean
+z_stream_code_write_ready(ZStreamCode *self)
+{
+  if (self->state & Z_SCS_WRITE_ERROR)
+    return TRUE;
+  if (self->encode)
+    return !z_stream_code_write_pending(self);
+  return !!(self->child_cond & G_IO_OUT);
+}
+
+/**
+ * Write the pending output of the encoder to the child.
+ *
+ * @param[in]  self ZStreamCode instance
+ * @param[out] error error value
+ *
+ * @returns G_IO_STATUS_NORMAL if everything was written, G_IO_STATUS_AGAIN if the child would block
+ **/
+static GIOStatus
+z_stream_code_flush(ZStreamCode *self, GError **error)
+{
+  GIOStatus res = G_IO_STATUS_NORMAL;
+  gsize length, bw;
+
+  z_enter();
+  while ((length = z_code_get_result_length(self->encode)) > 0)
+    {
+      res = z_stream_write(self->super.child, z_code_peek_result(self->encode), length, &bw, error);
+      if (res != G_IO_STATUS_NORMAL)
+        break;
+      if (bw == 0)
+        {
+          res = G_IO_STATUS_AGAIN;
+          break;
+        }
+      z_code_flush_result(self->encode, bw);
+    }
+  if (res != G_IO_STATUS_NORMAL && res != G_IO_STATUS_AGAIN)
+    self->state |= Z_SCS_WRITE_ERROR;
+  z_return(res);
+}
+
+/* I/O callbacks for stacked stream */
+
+static gboolean
+z_stream_code_read_callback(ZStream *stream G_GNUC_UNUSED, GIOCondition poll_cond G_GNUC_UNUSED, gpointer s)
+{
+  ZStreamCode *self = Z_CAST(s, ZStreamCode);
+
+  z_enter();
+  self->child_cond |= G_IO_IN;
+  z_return(TRUE);
+}
+
+static gboolean
+z_stream_code_write_callback(ZStream *stream G_GNUC_UNUSED, GIOCondition poll_cond G_GNUC_UNUSED, gpointer s)
+{
+  ZStreamCode *self = Z_CAST(s, ZStreamCode);
+
+  z_enter();
+  /* write out the pending output first, the stream is writable once it is gone */
+  if (z_stream_code_write_pending(self) &&
+      z_stream_code_flush(self, NULL) != G_IO_STATUS_NORMAL)
+    z_return(TRUE);
+
+  self->child_cond |= G_IO_OUT;
+  z_return(TRUE);
+}
+
+/* virtual methods */
+
+static GIOStatus
+z_stream_code_read_method(ZStream *stream, void *buf, gsize count, gsize *bytes_read, GError **error)
+{
+  ZStreamCode *self = Z_CAST(stream, ZStreamCode);
+  GIOStatus res;
+  gsize length;
+
+  z_enter();
+  self->child_cond &= ~G_IO_IN;
+  if (self->shutdown & G_IO_IN)
+    {
+      g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Read direction already shut down");
+      z_return(G_IO_STATUS_ERROR);
+    }
+
+  if (self->state & Z_SCS_READ_ERROR)
+    {
+      g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Previously stored error condition");
+      z_return(G_IO_STATUS_ERROR);
+    }
+
+  self->super.child->timeout = self->super.timeout;
+  if (!self->decode)
+    z_return(z_stream_read(self->super.child, buf, count, bytes_read, error));
+
+  /* the decoder may swallow input without producing anything (e.g. whitespace) */
+  while (z_code_get_result_length(self->decode) == 0)
+    {
+      if (self->state & Z_SCS_EOF_RECEIVED)
+        z_return(G_IO_STATUS_EOF);
+
+      res = z_stream_read(self->super.child, self->read_buf, self->buffer_length, &length, error);
+      if (res == G_IO_STATUS_AGAIN)
+        {
+          z_return(G_IO_STATUS_AGAIN);
+        }
+      else if (res == G_IO_STATUS_EOF)
+        {
+          self->state |= Z_SCS_EOF_RECEIVED;
+          if (!z_code_finish(self->decode))
+            goto decode_error;
+        }
+      else if (res != G_IO_STATUS_NORMAL)
+        {
+          self->state |= Z_SCS_READ_ERROR;
+          z_return(G_IO_STATUS_ERROR);
+        }
+      else if (!z_code_transform(self->decode, self->read_buf, length))
+        {
+          goto decode_error;
+        }
+    }
+
+  *bytes_read = z_code_get_result(self->decode, buf, count);
+  z_return(G_IO_STATUS_NORMAL);
+
+ decode_error:
+  self->state |= Z_SCS_READ_ERROR;
+  g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Error while decoding data");
+  z_return(G_IO_STATUS_ERROR);
+}
+
+static GIOStatus
+z_stream_code_write_method(ZStream *stream, const void *buf, gsize count, gsize *bytes_written, GError **error)
+{
+  ZStreamCode *self = Z_CAST(stream, ZStreamCode);
+  GIOStatus res;
+
+  z_enter();
+  self->child_cond &= ~G_IO_OUT;
+  if (self->shutdown & G_IO_OUT)
+    {
+      g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Write direction already shut down");
+      z_return(G_IO_STATUS_ERROR);
+    }
+
+  if (self->state & Z_SCS_WRITE_ERROR)
+    {
+      g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Previously stored error condition");
+      z_return(G_IO_STATUS_ERROR);
+    }
+
+  self->super.child->timeout = self->super.timeout;
+  if (!self->encode)
+    z_return(z_stream_write(self->super.child, buf, count, bytes_written, error));
+
+  /* new data is only accepted once the output of the previous write is gone */
+  res = z_stream_code_flush(self, error);
+  if (res != G_IO_STATUS_NORMAL)
+    z_return(res);
+
+  count = MIN(count, self->buffer_length);
+  if (!z_code_transform(self->encode, buf, count))
+    {
+      self->state |= Z_SCS_WRITE_ERROR;
+      g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Error while encoding data");
+      z_return(G_IO_STATUS_ERROR);
+    }
+  *bytes_written = count;
+
+  /* the data is accepted even if the child would block, the output is kept until the next write */
+  res = z_stream_code_flush(self, error);
+  if (res != G_IO_STATUS_NORMAL && res != G_IO_STATUS_AGAIN)
+    z_return(res);
+
+  z_return(G_IO_STATUS_NORMAL);
+}
+
+static GIOStatus
+z_stream_code_shutdown_method(ZStream *stream, int method, GError **error)
+{
+  ZStreamCode *self = Z_CAST(stream, ZStreamCode);
+  GIOStatus res = G_IO_STATUS_NORMAL, ret;
+  GError *local_error = NULL;
+  gboolean nonblock;
+
+  z_enter();
+  if (method == SHUT_RD || method == SHUT_RDWR)
+    self->shutdown |= G_IO_IN;
+
+  if ((method == SHUT_WR || method == SHUT_RDWR) && (self->shutdown & G_IO_OUT) == 0)
+    {
+      self->shutdown |= G_IO_OUT;
+      if (self->encode && (self->state & Z_SCS_WRITE_ERROR) == 0)
+        {
+          /* write out the final output of the encoder */
+          nonblock = z_stream_get_nonblock(self->super.child);
+          z_stream_set_nonblock(self->super.child, FALSE);
+
+          if (!z_code_finish(self->encode))
+            {
+              g_set_error(&local_error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Error while finishing encoding");
+              res = G_IO_STATUS_ERROR;
+            }
+          else
+            {
+              res = z_stream_code_flush(self, &local_error);
+              if (res == G_IO_STATUS_AGAIN)
+                {
+                  g_set_error(&local_error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Error writing encoded data");
+                  res = G_IO_STATUS_ERROR;
+                }
+            }
+          z_stream_set_nonblock(self->super.child, nonblock);
+        }
+    }
+
+  ret = z_stream_shutdown(self->super.child, method, local_error ? NULL : &local_error);
+  if (ret != G_IO_STATUS_NORMAL)
+    res = ret;
+
+  if (local_error)
+    g_propagate_error(error, local_error);
+  z_return(res);
+}
+
+static GIOStatus
+z_stream_code_close_method(ZStream *s, GError **error)
+{
+  GIOStatus st_shutdown, st_close;
+
+  z_enter();
+  st_shutdown = z_stream_code_shutdown_method(s, SHUT_RDWR, NULL);
+  st_close = Z_SUPER(s, ZStream)->close(s, error);
+  if (st_shutdown != G_IO_STATUS_NORMAL)
+    z_return(st_shutdown);
+
+  z_return(st_close);
+}
+
+/**
+ * Process stream control calls.
+ *
+ * @param[in]      stream ZStream instance
+ * @param[in]      function function selector
+ * @param[in, out] value parameter to function
+ * @param[in]      vlen length of value
+ *
+ * @returns TRUE on success
+ **/
+static gboolean
+z_stream_code_ctrl_method(ZStream *stream, guint function, gpointer value, guint vlen)
+{
+  gboolean ret = FALSE;
+
+  z_enter();
+  switch (ZST_CTRL_MSG(function))
+    {
+    case ZST_CTRL_SET_CALLBACK_READ:
+    case ZST_CTRL_SET_CALLBACK_WRITE:
+    case ZST_CTRL_SET_CALLBACK_PRI:
+      ret = z_stream_ctrl_method(stream, function, value, vlen);
+      break;
+
+    default:
+      ret = z_stream_ctrl_method(stream, ZST_CTRL_MSG_FORWARD | function, value, vlen);
+      break;
+    }
+  z_return(ret);
+}
+
+static gboolean
+z_stream_code_watch_prepare(ZStream *s, GSource *src G_GNUC_UNUSED, gint *timeout)
+{
+  ZStreamCode *self = Z_CAST(s, ZStreamCode);
+  gboolean ret = FALSE;
+  gboolean child_enable = FALSE;
+
+  z_enter();
+  *timeout = -1;
+
+  if (s->want_read)
+    {
+      if (z_stream_code_read_ready(self))
+        ret = TRUE;
+      else
+        child_enable = TRUE;
+    }
+  z_stream_set_cond(s->child, G_IO_IN, child_enable);
+
+  if (s->want_write && z_stream_code_write_ready(self))
+    ret = TRUE;
+
+  /* pending output is written from the write callback of the child */
+  if ((self->state & Z_SCS_WRITE_ERROR) == 0 &&
+      (z_stream_code_write_pending(self) || (!self->encode && s->want_write)))
+    z_stream_set_cond(s->child, G_IO_OUT, TRUE);
+  else
+    z_stream_set_cond(s->child, G_IO_OUT, FALSE);
+
+  z_return(ret);
+}
+
+static gboolean
+z_stream_code_watch_check(ZStream *s, GSource *src G_GNUC_UNUSED)
+{
+  ZStreamCode *self = Z_CAST(s, ZStreamCode);
+  gboolean ret = FALSE;
+
+  z_enter();
+  if (s->want_read && z_stream_code_read_ready(self))
+    ret = TRUE;
+
+  if (s->want_write && z_stream_code_write_ready(self))
+    ret = TRUE;
+
+  z_return(ret);
+}
+
+static gboolean
+z_stream_code_watch_dispatch(ZStream *s, GSource *src G_GNUC_UNUSED)
+{
+  ZStreamCode *self = Z_CAST(s, ZStreamCode);
+  gboolean rc = TRUE;
+
+  z_enter();
+  if (s->want_read && rc && z_stream_code_read_ready(self))
+    rc = self->super.read_cb(s, G_IO_IN, self->super.user_data_read);
+
+  if (s->want_write && rc && z_stream_code_write_ready(self))
+    rc = self->super.write_cb(s, G_IO_OUT, self->super.user_data_write);
+
+  z_return(rc);
+}
+
+static void
+z_stream_code_set_child(ZStream *s, ZStream *new_child)
+{
+  z_stream_ref(s);
+
+  Z_SUPER(s, ZStream)->set_child(s, new_child);
+  if (new_child)
+    {
+      z_stream_set_callback(new_child, G_IO_IN, z_stream_code_read_callback, z_stream_ref(s), (GDestroyNotify) z_stream_unref);
+      z_stream_set_callback(new_child, G_IO_OUT, z_stream_code_write_callback, z_stream_ref(s), (GDestroyNotify) z_stream_unref);
+    }
+
+  z_stream_unref(s);
+}
+
+/**
+ * Create a new stream transforming the data passing through it with
+ * ZCode instances.
+ *
+ * @param[in] child child stream
+ * @param[in] encode transforms data written to the stream before passing it to the child, NULL to pass data unchanged (consumed)
+ * @param[in] decode transforms data read from the child, NULL to pass data unchanged (consumed)
+ * @param[in] buffer_length maximum number of bytes transformed at once
+ *
+ * The encoder is finished when the write side of the stream is shut down,
+ * the decoder when end of file is read from the child.
+ *
+ * @returns the new stream
+ **/
+ZStream *
+z_stream_code_new(ZStream *child, ZCode *encode, ZCode *decode, gsize buffer_length)
+{
+  ZStreamCode *self;
+
+  z_enter();
+  self = Z_CAST(z_stream_new(Z_CLASS(ZStreamCode), child ? child->name : "", G_IO_IN | G_IO_OUT), ZStreamCode);
+  self->encode = encode;
+  self->decode = decode;
+  self->buffer_length = buffer_length;
+  self->read_buf = g_new(guchar, buffer_length);
+
+  z_stream_set_child(&self->super, child);
+  z_return((ZStream *) self);
+}
+
+/** destructor */
+static void
+z_stream_code_free_method(ZObject *s)
+{
+  ZStreamCode *self = Z_CAST(s, ZStreamCode);
+
+  z_enter();
+  if (self->encode)
+    z_code_free(self->encode);
+  if (self->decode)
+    z_code_free(self->decode);
+  g_free(self->read_buf);
+  z_stream_free_method(s);
+  z_return();
+}
+
+
+/**
+ * ZStreamCode virtual methods.
+ **/
+ZStreamFuncs z_stream_code_funcs =
+{
+  {
+    Z_FUNCS_COUNT(ZStream),
+    z_stream_code_free_method,
+  },
+  z_stream_code_read_method,
+  z_stream_code_write_method,
+  NULL,
+  NULL,
+  z_stream_code_shutdown_method,
+  z_stream_code_close_method,
+  z_stream_code_ctrl_method,
+
+  NULL, /* attach_source */
+  NULL, /* detach_source */
+  z_stream_code_watch_prepare,
+  z_stream_code_watch_check,
+  z_stream_code_watch_dispatch,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  z_stream_code_set_child,
+  NULL,
+  NULL, /* read_vec */
+  NULL, /* write_vec */
+};
+
+ZClass ZStreamCode__class =
+{
+  Z_CLASS_HEADER,
+  &ZStream__class,
+  "ZStreamCode",
+  sizeof(ZStreamCode),
+  &z_stream_code_funcs.super
+};
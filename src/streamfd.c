@@ -15,6 +15,7 @@
  ***************************************************************************/
 
 #include <zorp/streamfd.h>
+#include <zorp/streamtee.h>
 
 
 #include <zorp/log.h>
@@ -29,8 +30,11 @@
 #  include <zorp/io.h>
 #else
 #  include <fcntl.h>
+#  include <limits.h>
 #  include <sys/socket.h>
 #  include <sys/poll.h>
+#  include <sys/uio.h>
+#  include <unistd.h>
 #endif
 
 /**
@@ -46,6 +50,11 @@ typedef struct _ZStreamFD
   gint fd;
   gint keepalive;
   GPollFD pollfd;
+  gboolean nonblock;        /**< cached O_NONBLOCK state of fd, kept up-to-date by ZST_CTRL_SET_NONBLOCK */
+#if HAVE_SPLICE
+  gint splice_pipe[2];
+  gsize splice_pending;
+#endif
 #ifdef G_OS_WIN32
   int winsock_event;
   gboolean can_write;
@@ -294,11 +303,9 @@ z_stream_wait_fd(ZStreamFD *self, guint cond, gint timeout)
 {
   struct pollfd pfd;
   gint res;
-  GIOFlags flags;
 
   z_enter();
-  flags = g_io_channel_get_flags(self->channel);
-  if ((flags & G_IO_FLAG_NONBLOCK) || timeout == -2)
+  if (self->nonblock || timeout == -2)
     z_return(TRUE);
   errno = 0;
   pfd.fd = self->fd;
@@ -367,6 +374,104 @@ z_stream_wait_fd(ZStreamFD *self, guint cond, gint timeout)
 
 #endif
 
+#ifndef G_OS_WIN32
+
+/**
+ * Read from the fd directly, without going through the GIOChannel.
+ *
+ * @param[in]  self ZStreamFD instance
+ * @param[in]  buf buffer to read to
+ * @param[in]  count number of bytes to ask for
+ * @param[out] bytes_read number of bytes actually read will be put here
+ * @param[out] error error value
+ *
+ * The return values and errors are the same as those of an unbuffered
+ * g_io_channel_read_chars() call.
+ *
+ * @returns GIOStatus value
+ **/
+static inline GIOStatus
+z_stream_fd_read_direct(ZStreamFD *self, void *buf, gsize count, gsize *bytes_read, GError **error)
+{
+  gssize res;
+
+  if (count == 0)
+    {
+      *bytes_read = 0;
+      return G_IO_STATUS_NORMAL;
+    }
+
+  do
+    {
+      res = read(self->fd, buf, count);
+    }
+  while (res == -1 && z_errno_is(EINTR));
+
+  if (res == -1)
+    {
+      *bytes_read = 0;
+      if (z_errno_is(EAGAIN))
+        return G_IO_STATUS_AGAIN;
+
+      g_set_error(error, G_IO_CHANNEL_ERROR,
+                  g_io_channel_error_from_errno(z_errno_get()),
+                  "%s",
+                  g_strerror(z_errno_get()));
+      return G_IO_STATUS_ERROR;
+    }
+  *bytes_read = res;
+  return res > 0 ? G_IO_STATUS_NORMAL : G_IO_STATUS_EOF;
+}
+
+/**
+ * Write to the fd directly, without going through the GIOChannel.
+ *
+ * @param[in]  self ZStreamFD instance
+ * @param[in]  buf buffer to write the contents of
+ * @param[in]  count number of bytes to write
+ * @param[out] bytes_written actual number of bytes written will be returned here
+ * @param[out] error error value
+ *
+ * The return values and errors are the same as those of an unbuffered
+ * g_io_channel_write_chars() call.
+ *
+ * @returns GIOStatus value
+ **/
+static inline GIOStatus
+z_stream_fd_write_direct(ZStreamFD *self, const void *buf, gsize count, gsize *bytes_written, GError **error)
+{
+  gssize res;
+
+  if (count == 0)
+    {
+      *bytes_written = 0;
+      return G_IO_STATUS_NORMAL;
+    }
+
+  do
+    {
+      res = write(self->fd, buf, count);
+    }
+  while (res == -1 && z_errno_is(EINTR));
+
+  if (res == -1)
+    {
+      *bytes_written = 0;
+      if (z_errno_is(EAGAIN))
+        return G_IO_STATUS_AGAIN;
+
+      g_set_error(error, G_IO_CHANNEL_ERROR,
+                  g_io_channel_error_from_errno(z_errno_get()),
+                  "%s",
+                  g_strerror(z_errno_get()));
+      return G_IO_STATUS_ERROR;
+    }
+  *bytes_written = res;
+  return G_IO_STATUS_NORMAL;
+}
+
+#endif
+
 /**
  * Read from the fd encapsulated by a ZStreamFD instance.
  *
@@ -400,7 +505,11 @@ z_stream_fd_read_method(ZStream *stream,
     }
   else
     {
+#ifndef G_OS_WIN32
+      res = z_stream_fd_read_direct(self, buf, count, bytes_read, &local_error);
+#else
       res = g_io_channel_read_chars(self->channel, buf, count, bytes_read, &local_error);
+#endif
     }
   if (!(self->super.umbrella_state & G_IO_IN))
     {
@@ -458,7 +567,11 @@ z_stream_fd_write_method(ZStream *stream,
       z_return(G_IO_STATUS_ERROR);
     }
 
+#ifndef G_OS_WIN32
+  res = z_stream_fd_write_direct(self, buf, count, bytes_written, error);
+#else
   res = g_io_channel_write_chars(self->channel, buf, count, bytes_written, error);
+#endif
   if (!(self->super.umbrella_state & G_IO_OUT))
     {
       /* low-level logging if we're not the toplevel stream */
@@ -475,6 +588,180 @@ z_stream_fd_write_method(ZStream *stream,
   z_return(res);
 }
 
+#ifndef G_OS_WIN32
+
+/**
+ * Log the contents of an I/O vector at the channel level if we're not the
+ * toplevel stream.
+ *
+ * @param[in] self ZStreamFD instance
+ * @param[in] direction G_IO_IN or G_IO_OUT
+ * @param[in] vec I/O vector
+ * @param[in] vec_count number of elements in vec
+ * @param[in] len number of bytes transferred
+ **/
+static void
+z_stream_fd_dump_vec(ZStreamFD *self, gint direction, const struct iovec *vec, gint vec_count, gsize len)
+{
+  gint i;
+
+  if (self->super.umbrella_state & direction)
+    return;
+
+  if (direction == G_IO_IN)
+    {
+      /*LOG
+        This message reports the number of bytes read from the given fd.
+       */
+      z_log(self->super.name, CORE_DUMP, 8, "Reading channel; fd='%d', count='%zd'", self->fd, len);
+    }
+  else
+    {
+      /*LOG
+        This message reports the number of bytes written to the given fd.
+       */
+      z_log(self->super.name, CORE_DUMP, 8, "Writing channel; fd='%d', count='%zd'", self->fd, len);
+    }
+  for (i = 0; i < vec_count && len > 0; i++)
+    {
+      gsize part = MIN(vec[i].iov_len, len);
+
+      z_log_data_dump(self->super.name, CORE_DUMP, 10, vec[i].iov_base, part);
+      len -= part;
+    }
+}
+
+/**
+ * Read from the fd encapsulated by a ZStreamFD instance into several
+ * buffers using a single readv() call.
+ *
+ * @param[in]  stream ZStreamFD instance
+ * @param[in]  vec I/O vector describing the buffers to read to
+ * @param[in]  vec_count number of elements in vec
+ * @param[out] bytes_read number of bytes actually read will be put here
+ * @param[out] error error value
+ *
+ * @returns GIOStatus value
+ **/
+static GIOStatus
+z_stream_fd_read_vec_method(ZStream *stream,
+                            const struct iovec *vec,
+                            gint vec_count,
+                            gsize *bytes_read,
+                            GError **error)
+{
+  ZStreamFD *self = (ZStreamFD *) stream;
+  gssize res;
+  gsize requested = 0;
+  gint i;
+
+  z_enter();
+  g_return_val_if_fail ((error == NULL) || (*error == NULL), G_IO_STATUS_ERROR);
+
+  if (!z_stream_wait_fd(self, G_IO_IN | G_IO_HUP, self->super.timeout))
+    {
+      g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Channel read timed out");
+      z_return(G_IO_STATUS_ERROR);
+    }
+
+  vec_count = MIN(vec_count, IOV_MAX);
+  for (i = 0; i < vec_count; i++)
+    requested += vec[i].iov_len;
+
+  do
+    {
+      res = readv(self->fd, vec, vec_count);
+    }
+  while (res == -1 && z_errno_is(EINTR));
+
+  if (res == -1)
+    {
+      *bytes_read = 0;
+      if (z_errno_is(EAGAIN))
+        z_return(G_IO_STATUS_AGAIN);
+
+      g_set_error(error, G_IO_CHANNEL_ERROR,
+                  g_io_channel_error_from_errno(z_errno_get()),
+                  "%s",
+                  g_strerror(z_errno_get()));
+      z_return(G_IO_STATUS_ERROR);
+    }
+
+  *bytes_read = res;
+  if (res == 0 && requested > 0)
+    {
+      if (!(self->super.umbrella_state & G_IO_IN))
+        {
+          /*LOG
+            This message reports that EOF was read from the given fd.
+           */
+          z_log(self->super.name, CORE_DUMP, 8, "Reading EOF on channel; fd='%d'", self->fd);
+        }
+      z_return(G_IO_STATUS_EOF);
+    }
+
+  z_stream_fd_dump_vec(self, G_IO_IN, vec, vec_count, res);
+  z_return(G_IO_STATUS_NORMAL);
+}
+
+/**
+ * Write the contents of several buffers to the fd encapsulated by a
+ * ZStreamFD instance using a single writev() call.
+ *
+ * @param[in]  stream ZStreamFD instance
+ * @param[in]  vec I/O vector describing the buffers to write
+ * @param[in]  vec_count number of elements in vec
+ * @param[out] bytes_written actual number of bytes written will be returned here
+ * @param[out] error error value
+ *
+ * @returns GIOStatus value
+ **/
+static GIOStatus
+z_stream_fd_write_vec_method(ZStream *stream,
+                             const struct iovec *vec,
+                             gint vec_count,
+                             gsize *bytes_written,
+                             GError **error)
+{
+  ZStreamFD *self = (ZStreamFD *) stream;
+  gssize res;
+
+  z_enter();
+  g_return_val_if_fail ((error == NULL) || (*error == NULL), G_IO_STATUS_ERROR);
+
+  if (!z_stream_wait_fd(self, G_IO_OUT | G_IO_HUP, self->super.timeout))
+    {
+      g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Channel write timed out");
+      z_return(G_IO_STATUS_ERROR);
+    }
+
+  vec_count = MIN(vec_count, IOV_MAX);
+  do
+    {
+      res = writev(self->fd, vec, vec_count);
+    }
+  while (res == -1 && z_errno_is(EINTR));
+
+  if (res == -1)
+    {
+      *bytes_written = 0;
+      if (z_errno_is(EAGAIN))
+        z_return(G_IO_STATUS_AGAIN);
+
+      g_set_error(error, G_IO_CHANNEL_ERROR,
+                  g_io_channel_error_from_errno(z_errno_get()),
+                  "%s",
+                  g_strerror(z_errno_get()));
+      z_return(G_IO_STATUS_ERROR);
+    }
+
+  *bytes_written = res;
+  z_stream_fd_dump_vec(self, G_IO_OUT, vec, vec_count, res);
+  z_return(G_IO_STATUS_NORMAL);
+}
+
+#endif
+
 /**
  * Write priority data to the fd encapsulated by a ZStreamFD instance.
  *
@@ -680,12 +967,15 @@ z_stream_fd_ctrl_method(ZStream *s, guint function, gpointer value, guint vlen)
     case ZST_CTRL_SET_NONBLOCK:
       if (vlen == sizeof(gboolean))
         {
-          gboolean nonblock = *((gboolean *)value);
+          gboolean nonblock = !!*((gboolean *)value);
           GIOStatus ret;
+#ifndef G_OS_WIN32
           GIOFlags flags;
 
+          if (nonblock == self->nonblock)
+            z_return(TRUE);
+
           flags = g_io_channel_get_flags(self->channel);
-#ifndef G_OS_WIN32
           if (nonblock)
             ret = g_io_channel_set_flags(self->channel, flags | G_IO_FLAG_NONBLOCK, NULL);
           else
@@ -695,7 +985,10 @@ z_stream_fd_ctrl_method(ZStream *s, guint function, gpointer value, guint vlen)
           ret = G_IO_STATUS_NORMAL;
 #endif          
           if (ret == G_IO_STATUS_NORMAL)
-            z_return(TRUE);
+            {
+              self->nonblock = nonblock;
+              z_return(TRUE);
+            }
 
           /*LOG
             This message indicates that an internal error, during setting NONBLOCK mode on
@@ -715,10 +1008,14 @@ z_stream_fd_ctrl_method(ZStream *s, guint function, gpointer value, guint vlen)
     case ZST_CTRL_GET_NONBLOCK:
       if (vlen == sizeof(gboolean))
         {
+#ifndef G_OS_WIN32
+          *((gboolean *) value) = self->nonblock;
+#else
           GIOFlags flags;
 
           flags = g_io_channel_get_flags(self->channel);
           *((gboolean *) value) = !!(flags & G_IO_FLAG_NONBLOCK);
+#endif
           z_return(TRUE);
         }
       /*LOG
@@ -888,9 +1185,13 @@ z_stream_fd_new(gint fd, const gchar *name)
   self->channel = g_io_channel_unix_new(fd);
 #endif
   self->keepalive = 0;
+#if HAVE_SPLICE
+  self->splice_pipe[0] = self->splice_pipe[1] = -1;
+#endif
   g_io_channel_set_encoding(self->channel, NULL, NULL);
   g_io_channel_set_buffered(self->channel, FALSE);
   g_io_channel_set_close_on_unref(self->channel, FALSE);
+  self->nonblock = !!(g_io_channel_get_flags(self->channel) & G_IO_FLAG_NONBLOCK);
   z_return(&self->super);
 }
 
@@ -905,6 +1206,22 @@ z_stream_fd_free_method(ZObject *s)
   z_trace(NULL, "WinSock: Event #%d destroyed at %s line %d", self->winsock_event, __FILE__, __LINE__); 
   WSACloseEvent(self->winsock_event); 
 #endif   
+#if HAVE_SPLICE
+  if (self->splice_pipe[0] != -1)
+    {
+      if (self->splice_pending)
+        {
+          /*LOG
+            This message indicates that the stream was freed while spliced
+            data was still waiting in the kernel pipe to be written to the
+            destination, thus that data was lost.
+           */
+          z_log(self->super.name, CORE_ERROR, 3, "Dropping unflushed spliced data; fd='%d', pending='%" G_GSIZE_FORMAT "'", self->fd, self->splice_pending);
+        }
+      close(self->splice_pipe[0]);
+      close(self->splice_pipe[1]);
+    }
+#endif
   g_io_channel_unref(self->channel);
   z_stream_free_method(s);
   z_return();
@@ -940,7 +1257,14 @@ z_stream_fd_funcs =
   z_stream_fd_extra_save_method,
   z_stream_fd_extra_restore_method,
   NULL,
-  NULL
+  NULL,
+#ifndef G_OS_WIN32
+  z_stream_fd_read_vec_method,
+  z_stream_fd_write_vec_method
+#else
+  NULL, /* read_vec */
+  NULL  /* write_vec */
+#endif
 };
 
 /**
@@ -954,3 +1278,274 @@ ZClass ZStreamFD__class =
   sizeof(ZStreamFD),
   &z_stream_fd_funcs.super,
 };
+
+#define Z_STREAM_SPLICE_COPY_BUFSIZE 16384
+
+/**
+ * Relay data from src to dst by copying it through a userspace buffer.
+ *
+ * @param[in]  src stream to read from
+ * @param[in]  dst stream to write to
+ * @param[in]  max maximum number of bytes to transfer
+ * @param[out] bytes_transferred number of bytes written to dst
+ * @param[out] error error value
+ *
+ * This is the fallback used by z_stream_splice() when the fds cannot be
+ * reached directly. Data that dst does not accept is ungot to src, so it
+ * is read again by the next call.
+ *
+ * @returns GIOStatus value
+ **/
+static GIOStatus
+z_stream_splice_copy(ZStream *src, ZStream *dst, gsize max, gsize *bytes_transferred, GError **error)
+{
+  gchar buf[Z_STREAM_SPLICE_COPY_BUFSIZE];
+  gsize bytes_read, bytes_written = 0;
+  GIOStatus res;
+
+  z_enter();
+  res = z_stream_read(src, buf, MIN(max, sizeof(buf)), &bytes_read, error);
+  if (res != G_IO_STATUS_NORMAL)
+    z_return(res);
+
+  res = z_stream_write(dst, buf, bytes_read, &bytes_written, error);
+  if (res == G_IO_STATUS_AGAIN)
+    {
+      bytes_written = 0;
+      res = G_IO_STATUS_NORMAL;
+    }
+  if (res == G_IO_STATUS_NORMAL && bytes_written < bytes_read)
+    {
+      if (!z_stream_unget(src, buf + bytes_written, bytes_read - bytes_written, error))
+        z_return(G_IO_STATUS_ERROR);
+      if (bytes_written == 0)
+        res = G_IO_STATUS_AGAIN;
+    }
+  *bytes_transferred = bytes_written;
+  z_return(res);
+}
+
+#if HAVE_SPLICE
+
+/**
+ * Move the data pending in the splice pipe of src to the fd of dst.
+ *
+ * @param[in]  src ZStreamFD instance owning the pipe
+ * @param[in]  dst ZStreamFD instance to write to
+ * @param[out] bytes_written number of bytes moved
+ * @param[out] error error value
+ *
+ * @returns GIOStatus value, G_IO_STATUS_AGAIN if dst is not writable
+ **/
+static GIOStatus
+z_stream_fd_splice_flush(ZStreamFD *src, ZStreamFD *dst, gsize *bytes_written, GError **error)
+{
+  gssize res;
+
+  *bytes_written = 0;
+  while (src->splice_pending > 0)
+    {
+      if (!z_stream_wait_fd(dst, G_IO_OUT | G_IO_HUP, dst->super.timeout))
+        {
+          g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Channel write timed out");
+          return G_IO_STATUS_ERROR;
+        }
+      do
+        {
+          res = splice(src->splice_pipe[0], NULL, dst->fd, NULL, src->splice_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+      while (res == -1 && z_errno_is(EINTR));
+
+      if (res == -1)
+        {
+          if (z_errno_is(EAGAIN))
+            return *bytes_written ? G_IO_STATUS_NORMAL : G_IO_STATUS_AGAIN;
+          g_set_error(error, G_IO_CHANNEL_ERROR,
+                      g_io_channel_error_from_errno(z_errno_get()),
+                      "%s",
+                      g_strerror(z_errno_get()));
+          return G_IO_STATUS_ERROR;
+        }
+      src->splice_pending -= res;
+      *bytes_written += res;
+    }
+  return G_IO_STATUS_NORMAL;
+}
+
+/**
+ * Relay data between two ZStreamFD instances through a kernel pipe using
+ * splice().
+ *
+ * @param[in]  src ZStreamFD instance to read from
+ * @param[in]  dst ZStreamFD instance to write to
+ * @param[in]  max maximum number of bytes to read from src
+ * @param[out] bytes_transferred number of bytes written to dst
+ * @param[out] error error value
+ *
+ * @returns GIOStatus value
+ **/
+static GIOStatus
+z_stream_fd_splice(ZStreamFD *src, ZStreamFD *dst, gsize max, gsize *bytes_transferred, GError **error)
+{
+  GIOStatus status;
+  gsize flushed;
+  gssize res;
+
+  z_enter();
+  *bytes_transferred = 0;
+  if (src->splice_pipe[0] == -1)
+    {
+      if (pipe(src->splice_pipe) < 0)
+        {
+          src->splice_pipe[0] = src->splice_pipe[1] = -1;
+          g_set_error(error, G_IO_CHANNEL_ERROR,
+                      g_io_channel_error_from_errno(z_errno_get()),
+                      "%s",
+                      g_strerror(z_errno_get()));
+          z_return(G_IO_STATUS_ERROR);
+        }
+      fcntl(src->splice_pipe[0], F_SETFD, FD_CLOEXEC);
+      fcntl(src->splice_pipe[1], F_SETFD, FD_CLOEXEC);
+    }
+
+  /* data left in the pipe by the previous call must be written first */
+  status = z_stream_fd_splice_flush(src, dst, &flushed, error);
+  *bytes_transferred += flushed;
+  if (status != G_IO_STATUS_NORMAL || src->splice_pending > 0)
+    z_return(status);
+
+  if (!z_stream_wait_fd(src, G_IO_IN | G_IO_HUP, src->super.timeout))
+    {
+      g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Channel read timed out");
+      z_return(G_IO_STATUS_ERROR);
+    }
+  do
+    {
+      res = splice(src->fd, NULL, src->splice_pipe[1], NULL, max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    }
+  while (res == -1 && z_errno_is(EINTR));
+
+  if (res == -1)
+    {
+      if (z_errno_is(EAGAIN))
+        z_return(*bytes_transferred ? G_IO_STATUS_NORMAL : G_IO_STATUS_AGAIN);
+      g_set_error(error, G_IO_CHANNEL_ERROR,
+                  g_io_channel_error_from_errno(z_errno_get()),
+                  "%s",
+                  g_strerror(z_errno_get()));
+      z_return(G_IO_STATUS_ERROR);
+    }
+  else if (res == 0)
+    {
+      z_return(*bytes_transferred ? G_IO_STATUS_NORMAL : G_IO_STATUS_EOF);
+    }
+
+  src->splice_pending = res;
+  status = z_stream_fd_splice_flush(src, dst, &flushed, error);
+  *bytes_transferred += flushed;
+  if (status == G_IO_STATUS_AGAIN && *bytes_transferred)
+    status = G_IO_STATUS_NORMAL;
+  z_return(status);
+}
+
+#endif
+
+#if HAVE_SPLICE
+
+/**
+ * Find the ZStreamFD at the bottom of a stream stack if the layers above it
+ * pass the data through untouched in the given direction.
+ *
+ * @param[in] top top of the stream stack
+ * @param[in] direction G_IO_IN or G_IO_OUT
+ *
+ * Unlike z_stream_search_stack() this stops at layers that see the data
+ * without shadowing the direction (ZStreamTee duplicates it) and, in the
+ * read direction, at layers that have ungot data pending.
+ *
+ * @returns the ZStreamFD or NULL if the data has to be copied
+ **/
+static ZStream *
+z_stream_splice_search_fd(ZStream *top, gint direction)
+{
+  ZStream *p;
+
+  for (p = top; p; p = p->child)
+    {
+      if (direction == G_IO_IN && p->ungot_bufs)
+        return NULL;
+      if (z_object_is_instance(&p->super, Z_CLASS(ZStreamFD)))
+        return p;
+      if ((p->umbrella_flags & direction) == direction ||
+          z_object_is_instance(&p->super, Z_CLASS(ZStreamTee)))
+        return NULL;
+    }
+  return NULL;
+}
+
+#endif
+
+/**
+ * Relay data from one stream stack to another without inspecting it.
+ *
+ * @param[in]  src stream to read from (top of the stack)
+ * @param[in]  dst stream to write to (top of the stack)
+ * @param[in]  max maximum number of bytes to transfer
+ * @param[out] bytes_transferred number of bytes written to dst
+ * @param[out] error error value
+ *
+ * If the read side of src and the write side of dst are both transparent
+ * down to a ZStreamFD, the data is moved between the two fds with splice()
+ * through a pipe owned by the source stream, so that it never gets copied
+ * to userspace. Otherwise (e.g. when a ZStreamSsl, ZStreamGzip, ZStreamLine
+ * or ZStreamTee is in between, or ungot data is pending on any layer of
+ * src) the data is copied using z_stream_read() and z_stream_write().
+ *
+ * In both cases data that was read from src but not yet accepted by dst is
+ * kept and written first by the next call, thus the caller should call
+ * this function again when dst becomes writable. Data is only counted in
+ * bytes_transferred once it has been written to dst.
+ *
+ * @returns G_IO_STATUS_NORMAL if some data was transferred,
+ * G_IO_STATUS_AGAIN if neither src had data nor dst accepted any,
+ * G_IO_STATUS_EOF on end of file on src, G_IO_STATUS_ERROR on error
+ **/
+GIOStatus
+z_stream_splice(ZStream *src, ZStream *dst, gsize max, gsize *bytes_transferred, GError **error)
+{
+  GIOStatus res;
+#if HAVE_SPLICE
+  ZStream *src_fd, *dst_fd;
+#endif
+
+  z_enter();
+  g_return_val_if_fail ((error == NULL) || (*error == NULL), G_IO_STATUS_ERROR);
+
+  *bytes_transferred = 0;
+#if HAVE_SPLICE
+  src_fd = z_stream_splice_search_fd(src, G_IO_IN);
+  dst_fd = z_stream_splice_search_fd(dst, G_IO_OUT);
+  if (src_fd && dst_fd)
+    {
+      res = z_stream_fd_splice((ZStreamFD *) src_fd, (ZStreamFD *) dst_fd, max, bytes_transferred, error);
+      if (res == G_IO_STATUS_NORMAL)
+        {
+          src->bytes_recvd += *bytes_transferred;
+          if (src != src_fd)
+            src_fd->bytes_recvd += *bytes_transferred;
+          dst->bytes_sent += *bytes_transferred;
+          if (dst != dst_fd)
+            dst_fd->bytes_sent += *bytes_transferred;
+          /*LOG
+            This message reports the number of bytes moved between two
+            fds without copying them to userspace.
+           */
+          z_log(src->name, CORE_DUMP, 7, "Splicing stream; from_fd='%d', to_fd='%d', count='%" G_GSIZE_FORMAT "'",
+                ((ZStreamFD *) src_fd)->fd, ((ZStreamFD *) dst_fd)->fd, *bytes_transferred);
+        }
+      z_return(res);
+    }
+#endif
+  res = z_stream_splice_copy(src, dst, max, bytes_transferred, error);
+  z_return(res);
+}
@@ -957,6 +957,8 @@ ZStreamFuncs z_stream_gzip_funcs =
   NULL,
   z_stream_gzip_set_child,
   NULL,
+  NULL, /* read_vec */
+  NULL, /* write_vec */
 };
 
 ZClass ZStreamGzip__class = 
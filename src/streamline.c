@@ -32,11 +32,16 @@
 #  include <sys/poll.h>
 #endif
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#  include <emmintrin.h>
+#  define Z_STREAM_LINE_SSE2 1
+#endif
+
 #define ZRL_SAVED_FLAGS_MASK    0x0000FFFF
 
 #define ZRL_IGNORE_TILL_EOL     0x00010000
-#define ZRL_LINE_AVAIL_SET      0x00020000
-#define ZRL_LINE_AVAIL          0x00040000
+#define ZRL_EOL_CACHED          0x00020000
+#define ZRL_NUL_SEEN            0x00040000
 #define ZRL_ERROR		0x00080000
 #define ZRL_EOF                 0x00100000
 
@@ -52,6 +57,8 @@ typedef struct _ZStreamLine
   guint flags;
   gchar *buffer;
   gsize bufsize, pos, end, oldpos;
+  gsize init_bufsize, max_bufsize;
+  gsize scanned;        /**< bytes after pos known to contain no EOL, the EOL is at pos + scanned if ZRL_EOL_CACHED is set */
   GIOCondition child_cond;
             
 } ZStreamLine;
@@ -64,6 +71,119 @@ typedef struct _ZStreamLineExtra
   guint flags;
 } ZStreamLineExtra;
 
+/**
+ * Find the first EOL or NUL character in a buffer.
+ *
+ * @param[in] buf buffer to scan
+ * @param[in] len length of buf
+ * @param[in] eol_char end-of-line character
+ *
+ * Both characters are searched for in a single pass, 16 bytes at a time
+ * when SSE2 is available.
+ *
+ * @returns the offset of the first match or len if there is none
+ **/
+static inline gsize
+z_stream_line_scan(const gchar *buf, gsize len, gchar eol_char)
+{
+  const gchar *nul;
+#ifdef Z_STREAM_LINE_SSE2
+  gsize i = 0;
+#else
+  const gchar *eol;
+#endif
+
+  if (eol_char == '\0')
+    {
+      nul = memchr(buf, '\0', len);
+      return nul ? (gsize) (nul - buf) : len;
+    }
+
+#ifdef Z_STREAM_LINE_SSE2
+  {
+    const __m128i eol_mask = _mm_set1_epi8(eol_char);
+    const __m128i nul_mask = _mm_setzero_si128();
+
+    for (; i + 16 <= len; i += 16)
+      {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (buf + i));
+        gint hits = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, eol_mask), _mm_cmpeq_epi8(chunk, nul_mask)));
+
+        if (hits)
+          return i + __builtin_ctz(hits);
+      }
+  }
+  for (; i < len; i++)
+    {
+      if (buf[i] == eol_char || buf[i] == '\0')
+        return i;
+    }
+  return len;
+#else
+  eol = memchr(buf, eol_char, len);
+  if (eol)
+    len = eol - buf;
+  nul = memchr(buf, '\0', len);
+  return nul ? (gsize) (nul - buf) : len;
+#endif
+}
+
+/**
+ * Forget the cached EOL position, called whenever pos moves or the
+ * data after pos changes.
+ *
+ * @param[in] self ZStreamLine instance
+ **/
+static inline void
+z_stream_line_reset_scan(ZStreamLine *self)
+{
+  self->scanned = 0;
+  self->flags &= ~(ZRL_EOL_CACHED | ZRL_NUL_SEEN);
+}
+
+/**
+ * Look for the end of the current line in the buffer.
+ *
+ * @param[in] self ZStreamLine instance
+ *
+ * Only the bytes appended since the last call are scanned, the EOL
+ * position and the presence of an embedded NUL is cached until the line
+ * is consumed, so watch_prepare and the subsequent get don't scan the
+ * same data again.
+ *
+ * @returns TRUE if an EOL is present, its offset is pos + scanned
+ **/
+static gboolean
+z_stream_line_find_eol(ZStreamLine *self)
+{
+  gchar eol_char = self->flags & ZRL_EOL_NUL ? '\0' : '\n';
+  gchar *start;
+  gsize avail, ofs;
+
+  if (self->flags & ZRL_EOL_CACHED)
+    return TRUE;
+
+  while (self->pos + self->scanned < self->end)
+    {
+      start = self->buffer + self->pos + self->scanned;
+      avail = self->end - self->pos - self->scanned;
+      ofs = z_stream_line_scan(start, avail, eol_char);
+      self->scanned += ofs;
+      if (ofs == avail)
+        break;
+
+      if (start[ofs] == eol_char)
+        {
+          self->flags |= ZRL_EOL_CACHED;
+          return TRUE;
+        }
+      /* embedded NUL, continue after it */
+      self->flags |= ZRL_NUL_SEEN;
+      self->scanned++;
+    }
+  return FALSE;
+}
+
 /**
  * Check if a line can be read from the buffer.
  *
@@ -74,20 +194,11 @@ typedef struct _ZStreamLineExtra
 static inline gboolean
 z_stream_line_have_line(ZStreamLine *self)
 {
-  z_enter();
-  if (!(self->flags & ZRL_LINE_AVAIL_SET))
-    {
-      gsize avail = self->end - self->pos;
-      gchar *eol;
+  gboolean res;
 
-      eol = memchr(self->buffer + self->pos, self->flags & ZRL_EOL_NUL ? '\0' : '\n', avail);
-      self->flags |= ZRL_LINE_AVAIL_SET;
-      if (eol)
-        self->flags |= ZRL_LINE_AVAIL;
-      else
-        self->flags &= ~ZRL_LINE_AVAIL;
-    }
-  z_return(!!(self->flags & ZRL_LINE_AVAIL));
+  z_enter();
+  res = z_stream_line_find_eol(self);
+  z_return(res);
 }
 
 /**
@@ -119,13 +230,15 @@ z_stream_line_buf_empty(ZStreamLine *self)
 static GIOStatus
 z_stream_line_get_from_buf(ZStreamLine *self, gchar **line, gsize *length, GError **error)
 {
-  gsize avail = self->end - self->pos;
-  gchar *eol = memchr(self->buffer + self->pos, self->flags & ZRL_EOL_NUL ? '\0' : '\n', avail);
-  gchar *nul;
+  gchar *eol = NULL;
+  gboolean nul;
   gint eol_len = 0;
 
   z_enter();
 
+  if (z_stream_line_find_eol(self))
+    eol = self->buffer + self->pos + self->scanned;
+
   /* if we encountered eof in the input stream, return all the buffer as a line */
   if (self->flags & ZRL_EOF)
     eol = self->buffer + self->end - 1;
@@ -134,12 +247,16 @@ z_stream_line_get_from_buf(ZStreamLine *self, gchar **line, gsize *length, GErro
     {
       *length = eol - (self->buffer + self->pos) + 1;
       *line = self->buffer + self->pos;
+      if (self->flags & ZRL_EOF)
+        nul = memchr(*line, '\0', *length) != NULL;
+      else
+        nul = !!(self->flags & ZRL_NUL_SEEN);
       self->oldpos = self->pos;
       self->pos += *length;
+      z_stream_line_reset_scan(self);
 
       if (!(self->flags & ZRL_EOL_NUL))
         {
-          nul = memchr(*line, '\0', *length);
           if (nul)
             {
               if (!(self->flags & ZRL_NUL_NONFATAL))
@@ -185,15 +302,60 @@ z_stream_line_get_from_buf(ZStreamLine *self, gchar **line, gsize *length, GErro
         }
       z_return(G_IO_STATUS_NORMAL);
     }
-  else if (self->pos)
+  *length = 0;
+  z_return(G_IO_STATUS_AGAIN);
+}
+
+/**
+ * Make room at the end of the buffer for reading more data when it is full.
+ *
+ * @param[in] self ZStreamLine instance
+ *
+ * The incomplete line is moved to the beginning of the buffer, this is
+ * done lazily, only when the end of the buffer is reached, so a long line
+ * arriving in several chunks is not moved over and over. If the line
+ * fills the whole buffer, it is grown (doubling its size) up to
+ * max_bufsize.
+ *
+ * @returns the number of bytes available at the end of the buffer
+ **/
+static gsize
+z_stream_line_make_room(ZStreamLine *self)
+{
+  if (self->end < self->bufsize)
+    return self->bufsize - self->end;
+
+  if (self->pos)
     {
-      *length = 0;
-      memmove(self->buffer, self->buffer + self->pos, avail);
-      self->end = avail;
+      /* the scan state is relative to pos, so it remains valid */
+      memmove(self->buffer, self->buffer + self->pos, self->end - self->pos);
+      self->end -= self->pos;
       self->pos = 0;
       self->oldpos = 0;
     }
-  z_return(G_IO_STATUS_AGAIN);
+  else if (self->bufsize < self->max_bufsize)
+    {
+      self->bufsize = MIN(self->bufsize * 2, self->max_bufsize);
+      self->buffer = g_realloc(self->buffer, self->bufsize);
+    }
+  return self->bufsize - self->end;
+}
+
+/**
+ * Return the buffer to its initial size after a long line was consumed.
+ *
+ * @param[in] self ZStreamLine instance
+ *
+ * Must only be called when the buffer is empty.
+ **/
+static inline void
+z_stream_line_shrink(ZStreamLine *self)
+{
+  if (self->bufsize > self->init_bufsize)
+    {
+      self->bufsize = self->init_bufsize;
+      self->buffer = g_realloc(self->buffer, self->bufsize);
+    }
 }
 
 /**
@@ -231,7 +393,6 @@ z_stream_line_get_internal(ZStreamLine *self, gchar **line, gsize *length, GErro
     z_return(G_IO_STATUS_EOF);
 
   self->child_cond = 0;
-  self->flags &= ~ZRL_LINE_AVAIL_SET;
   if (self->end != self->pos)
     {
       /* we have something, try to return it */
@@ -250,11 +411,12 @@ z_stream_line_get_internal(ZStreamLine *self, gchar **line, gsize *length, GErro
           self->flags |= ZRL_ERROR;
           z_return(rc);
         }
-      /* the available data is now at the beginning of our buffer */
     }
   else
     {
       self->pos = self->end = self->oldpos = 0;
+      z_stream_line_reset_scan(self);
+      z_stream_line_shrink(self);
     }
 
   *length = 0;
@@ -262,7 +424,7 @@ z_stream_line_get_internal(ZStreamLine *self, gchar **line, gsize *length, GErro
 
   while (1)
     {
-      avail = self->bufsize - self->end;
+      avail = z_stream_line_make_room(self);
       if (!avail)
         {
           /*
@@ -272,6 +434,7 @@ z_stream_line_get_internal(ZStreamLine *self, gchar **line, gsize *length, GErro
           if (self->flags & ZRL_IGNORE_TILL_EOL)
             {
               self->pos = self->end = self->oldpos = 0;
+              z_stream_line_reset_scan(self);
               avail = self->bufsize;
             }
           else if (self->flags & ZRL_TRUNCATE)
@@ -280,6 +443,7 @@ z_stream_line_get_internal(ZStreamLine *self, gchar **line, gsize *length, GErro
               *length = self->bufsize;
               self->super.bytes_recvd += *length;
               self->pos = self->end = self->oldpos = 0;
+              z_stream_line_reset_scan(self);
               self->flags |= ZRL_IGNORE_TILL_EOL;
               z_return(G_IO_STATUS_NORMAL);
             }
@@ -295,6 +459,7 @@ z_stream_line_get_internal(ZStreamLine *self, gchar **line, gsize *length, GErro
               *length = self->bufsize;
               self->super.bytes_recvd += *length;
               self->pos = self->end = self->oldpos = 0;
+              z_stream_line_reset_scan(self);
               z_return(G_IO_STATUS_AGAIN);
             }
           else
@@ -304,7 +469,7 @@ z_stream_line_get_internal(ZStreamLine *self, gchar **line, gsize *length, GErro
                 input line. This may be caused by a cracking attempt. But if
                 not try to increase max_line_length.
                */
-              g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Line too long, buffer=[%.*s], max_line_length=[%d]", (gint) self->bufsize, self->buffer, (gint) self->bufsize);
+              g_set_error(error, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED, "Line too long, buffer=[%.*s], max_line_length=[%d]", (gint) self->bufsize, self->buffer, (gint) self->max_bufsize);
               
               *line = NULL;
               *length = 0;
@@ -398,6 +563,7 @@ z_stream_line_get(ZStream *stream, gchar **line, gsize *length, GError **error)
 
   self = Z_CAST(z_stream_search_stack(stream, G_IO_IN, Z_CLASS(ZStreamLine)), ZStreamLine);
   res = z_stream_line_get_internal(self, line, length, &local_error);
+  z_stream_notify_change(stream);
   
   if (local_error)
     {
@@ -411,6 +577,80 @@ z_stream_line_get(ZStream *stream, gchar **line, gsize *length, GError **error)
   return res;
 }
 
+/**
+ * Read all complete lines already available from a ZStream in a single call.
+ *
+ * @param[in]  stream ZStream instance
+ * @param[out] lines array to return the lines in
+ * @param[in]  max_lines number of elements in lines
+ * @param[out] num_lines number of lines returned
+ * @param[out] error error value
+ *
+ * The first line is fetched like z_stream_line_get() does, reading the
+ * child stream if necessary. After that, further lines are returned only
+ * as long as they are complete in the buffer, the child is not read
+ * again. A line with an embedded NUL character is left in the buffer
+ * for the next call to report the error, so that the lines before it
+ * are not lost, an invalid CRLF sequence is reported by the next call.
+ * This makes it possible to parse a whole header block with a single
+ * call.
+ *
+ * The returned lines point into the buffer of the ZStreamLine instance
+ * and remain valid until the next read operation on the stream.
+ *
+ * @returns GIOStatus value, the status of fetching the first line
+ **/
+GIOStatus
+z_stream_line_get_many(ZStream *stream, ZStreamLineView *lines, guint max_lines, guint *num_lines, GError **error)
+{
+  ZStreamLine *self;
+  GIOStatus res;
+  GError *local_error = NULL;
+  guint n = 0;
+
+  self = Z_CAST(z_stream_search_stack(stream, G_IO_IN, Z_CLASS(ZStreamLine)), ZStreamLine);
+  *num_lines = 0;
+  if (max_lines == 0)
+    return G_IO_STATUS_AGAIN;
+
+  res = z_stream_line_get_internal(self, &lines[0].line, &lines[0].length, &local_error);
+  if (res == G_IO_STATUS_NORMAL || (res == G_IO_STATUS_AGAIN && lines[0].length > 0))
+    n++;
+
+  if (res == G_IO_STATUS_NORMAL)
+    {
+      while (n < max_lines &&
+             !(self->flags & (ZRL_EOF | ZRL_ERROR | ZRL_IGNORE_TILL_EOL)) &&
+             z_stream_line_find_eol(self))
+        {
+          if ((self->flags & ZRL_NUL_SEEN) && !(self->flags & (ZRL_EOL_NUL | ZRL_NUL_NONFATAL)))
+            break;
+
+          if (z_stream_line_get_from_buf(self, &lines[n].line, &lines[n].length, &local_error) != G_IO_STATUS_NORMAL)
+            {
+              /* bad CRLF sequence, return the lines so far and fail the next call */
+              z_log(self->super.name, CORE_ERROR, 3, "Error while fetching line; error='%s'", local_error->message);
+              g_clear_error(&local_error);
+              self->flags |= ZRL_ERROR;
+              break;
+            }
+          self->super.bytes_recvd += lines[n].length;
+          n++;
+        }
+    }
+  z_stream_notify_change(stream);
+
+  if (local_error)
+    {
+      z_log(self->super.name, CORE_ERROR, 3, "Error while fetching line; error='%s'", local_error->message);
+      g_propagate_error(error, local_error);
+    }
+
+  *num_lines = n;
+  for (n = 0; n < *num_lines; n++)
+    z_stream_data_dump(&self->super, G_IO_IN, lines[n].line, lines[n].length);
+  return res;
+}
 
 /**
  * Read a line from a ZStream and copy it into the buffer given.
@@ -445,6 +685,7 @@ z_stream_line_get_copy(ZStream *s, gchar *line, gsize *length, GError **error)
     z_return(G_IO_STATUS_AGAIN);
     
   res = z_stream_line_get_internal(self, &b, &len, &local_error);
+  z_stream_notify_change(s);
   
   if (res == G_IO_STATUS_NORMAL || (res == G_IO_STATUS_AGAIN && len > 0))
     {
@@ -468,6 +709,7 @@ z_stream_line_get_copy(ZStream *s, gchar *line, gsize *length, GError **error)
                 {
                   self->pos = self->oldpos + *length;
                 }
+              z_stream_line_reset_scan(self);
               len = *length;
               res = G_IO_STATUS_AGAIN;
             }
@@ -538,6 +780,7 @@ z_stream_line_unget_packet_method(ZStream *s, ZPktBuf *packet, GError **error)
           self->end = self->end - self->pos + packet->length;
           self->pos = 0;
         }
+      z_stream_line_reset_scan(self);
       z_pktbuf_unref(packet);
       res = TRUE;
     }
@@ -627,7 +870,7 @@ z_stream_line_read_method(ZStream *stream,
       if (self->pos == self->end)
         self->pos = self->end = 0;
         
-      self->flags &= ~ZRL_LINE_AVAIL_SET;
+      z_stream_line_reset_scan(self);
 
       res = G_IO_STATUS_NORMAL;
       z_stream_data_dump(&self->super, G_IO_IN, buf, *bytes_read);
@@ -824,6 +1067,14 @@ z_stream_line_ctrl_method(ZStream *s, guint function, gpointer value, guint vlen
         }
       break;
 
+    case ZST_LINE_SET_MAX_BUFSIZE:
+      if (vlen == sizeof(gsize))
+        {
+          self->max_bufsize = MAX(*((gsize *)value), self->init_bufsize);
+          z_return(TRUE);
+        }
+      break;
+
     case ZST_LINE_GET_TRUNCATE:
       if (vlen == sizeof(gboolean))
         {
@@ -871,6 +1122,14 @@ z_stream_line_ctrl_method(ZStream *s, guint function, gpointer value, guint vlen
           z_return(TRUE);
         }
       break;
+
+    case ZST_LINE_GET_MAX_BUFSIZE:
+      if (vlen == sizeof(gsize))
+        {
+          *(gsize *)value = self->max_bufsize;
+          z_return(TRUE);
+        }
+      break;
       
     case ZST_CTRL_SET_CALLBACK_READ:
     case ZST_CTRL_SET_CALLBACK_WRITE:
@@ -1069,7 +1328,7 @@ z_stream_line_new(ZStream *child, gsize bufsize, guint flags)
   z_enter();
   self = Z_CAST(z_stream_new(Z_CLASS(ZStreamLine), child ? child->name : "", G_IO_IN), ZStreamLine);
   self->flags = flags;
-  self->bufsize = bufsize;
+  self->bufsize = self->init_bufsize = self->max_bufsize = bufsize;
   self->buffer = g_new(gchar, bufsize);
   z_stream_set_child(&self->super, child);
   z_return((ZStream *) self);
@@ -1119,6 +1378,8 @@ ZStreamFuncs z_stream_line_funcs =
   z_stream_line_extra_restore_method,
   z_stream_line_set_child,
   z_stream_line_unget_packet_method,
+  NULL, /* read_vec */
+  NULL, /* write_vec */
 };
 
 /**
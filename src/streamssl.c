@@ -550,7 +550,9 @@ ZStreamFuncs z_stream_ssl_funcs =
   NULL,
   NULL,
   z_stream_ssl_set_child,
-  NULL
+  NULL,
+  NULL, /* read_vec */
+  NULL  /* write_vec */
 };
 
 /**
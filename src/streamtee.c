@@ -18,8 +18,6 @@ typedef struct _ZStreamTee
   GIOCondition tee_direction; 
 } ZStreamTee;
 
-extern ZClass ZStreamTee__class;
-
 /**
  * This function writes the data to the forked stream.
  *
@@ -395,7 +393,9 @@ z_stream_tee_funcs =
   .extra_save = NULL,
   .extra_restore = NULL,
   .set_child = z_stream_tee_set_child,
-  .unget_packet = NULL
+  .unget_packet = NULL,
+  .read_vec = NULL,
+  .write_vec = NULL
 };
 
 /**
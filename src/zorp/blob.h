@@ -15,6 +15,14 @@
 
 struct ZBlob;
 
+/**
+ * Eviction policy of a blob system.
+ *
+ * Returns how cold a blob is, blobs with higher values are swapped out
+ * first and fetched in last.
+ **/
+typedef gdouble (*ZBlobEvictionFunc)(struct ZBlob *blob, time_t now);
+
 /**
  * Central management of blobs.
  **/
@@ -23,11 +31,17 @@ typedef struct ZBlobSystem
   ZRefCount     ref_cnt;                    /**< reference counter */
   gchar         *dir;                       /**< directory to store the blobs in */
   guint64       disk_max, disk_used;        /**< maximal and current disk usage */
-  gsize         mem_max, mem_used;          /**< maximal and current memory usage */
+  gsize         mem_max;                    /**< maximal memory usage */
+  union
+  {
+    gsize       size;                       /**< for non-concurrent access only */
+    gpointer    ptr;                        /**< accessed atomically */
+  }             mem_used;                   /**< current memory usage, see z_blob_system_mem_used() */
   gsize         lowat, hiwat, noswap_max;   /**< control limits - see spec */
   
   GMutex        *mtx_blobsys;               /**< gadgets used for signalling request like allocation, etc. */
   GCond         *cond_thread_started;
+  GCond         *cond_evicted;              /**< signalled when the blobs selected for eviction are done */
   
   GThread       *thr_management;            /**< management thread */
   GError        *thread_error;              /**< error structure for creating thr_management */
@@ -36,6 +50,7 @@ typedef struct ZBlobSystem
   GAsyncQueue   *req_queue;                 /**< queue of blobs who have pending requests */
   GList         *waiting_list;              /**< list of blobs whose requests weren't approved immediately */
   gboolean      active;                     /**< false if the blobsys is 'under destruction' */
+  ZBlobEvictionFunc eviction_score;         /**< eviction policy */
 } ZBlobSystem;
 
 /** global default instance */
@@ -49,8 +64,27 @@ extern gsize z_blob_system_default_noswap_max;      /**< noswap_max = 16 kB */
 
 /* constructor, ref, unref, destructor */
 ZBlobSystem* z_blob_system_new(const char *dir, gint64 dmax, gsize mmax, gsize low, gsize hiw, gsize nosw);
+
+/**
+ * Get the memory usage of a blob system.
+ *
+ * @param[in] self this
+ *
+ * mem_used is updated with atomic operations, as allocations in memory are
+ * approved without holding mtx_blobsys. GLib has no atomic operations on
+ * gsize, so it is accessed through the pointer member of its union.
+ *
+ * @returns The current memory usage
+ **/
+static inline gsize
+z_blob_system_mem_used(ZBlobSystem *self)
+{
+  return GPOINTER_TO_SIZE(g_atomic_pointer_get(&self->mem_used.ptr));
+}
+
 void z_blob_system_ref(ZBlobSystem *self);
 void z_blob_system_unref(ZBlobSystem *self);
+void z_blob_system_set_eviction_policy(ZBlobSystem *self, ZBlobEvictionFunc eviction_score);
 /* create and destroy the default instance */
 void z_blob_system_default_init(void);
 void z_blob_system_default_destroy(void);
@@ -88,9 +122,10 @@ typedef struct ZBlob
   gboolean          is_in_file;             /**< is the blob swapped out */
   gchar             *filename;              /**< swapfile name */
   gint              fd;                     /**< swapfile descriptor */
-  gchar             *data;                  /**< memory image pointer */
+  gchar             **chunks;               /**< memory image, split into fixed size chunks */
   ZBlobSystem       *system;                /**< blob system it belongs to */
-  GMutex            *mtx_lock;              /**< lock for concurrent accesses */
+  GStaticRWLock     lock;                   /**< lock for concurrent accesses, readers of the blob contents share it */
+  GMutex            *mtx_stat;              /**< protects stat against concurrent readers */
   ZBlobStatistic    stat;                   /**< statistics */
 
   GMutex            *mtx_reply;             /**< mutex and conditional for waiting for reply */
@@ -99,11 +134,16 @@ typedef struct ZBlob
   
   gchar             *mapped_ptr;            /**< addr and length of the mapped area */
   gsize             mapped_length;          /**< (when multiple mappings will be implemented, replace with ?GHash?) */
+  gchar             *file_map;              /**< mapping of the whole swap file while the blob is in file */
+  gsize             file_map_length;        /**< length of file_map, follows the length of the swap file */
+  gint              file_map_next;          /**< page following the last access of file_map, see z_blob_file_map_advise() */
+  gint              file_map_advice;        /**< current madvise() advice of file_map */
 
   /* communication with the blobsystems threadproc */
   gssize            alloc_req;              /**< communication with the blobsystems threadproc */
   gboolean          approved;               /**< communication with the blobsystems threadproc */
   gboolean          storage_locked;         /**< communication with the blobsystems threadproc */
+  gboolean          evicting;               /**< selected for eviction, see z_blob_system_evict() */
 } ZBlob;
 
 /* constructor, ref, unref, destructor */
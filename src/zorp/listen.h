@@ -23,6 +23,7 @@ extern "C" {
 #endif
 
 typedef gboolean (*ZAcceptFunc)(ZStream *fdstream, ZSockAddr *client, ZSockAddr *dest, gpointer user_data);
+typedef gboolean (*ZAcceptBatchFunc)(ZStream **fdstreams, ZSockAddr **clients, ZSockAddr **dests, gint count, gpointer user_data);
 
 
 /**
@@ -46,6 +47,8 @@ typedef struct _ZListener
   GStaticRecMutex lock;
   GMainContext *context;
   gchar *session_id;
+  gint accept_budget;
+  ZAcceptBatchFunc batch_callback;
 } ZListener;
 
 /**
@@ -98,6 +101,7 @@ void z_listener_cancel(ZListener *self);
 
 void z_listener_suspend(ZListener *self);
 void z_listener_resume(ZListener *self);
+void z_listener_set_accept_batch(ZListener *self, gint budget, ZAcceptBatchFunc batch_callback);
 
 /**
  * Get session id.
@@ -122,6 +126,28 @@ z_stream_listener_new(const gchar *session_id,
                       ZAcceptFunc callback,
                       gpointer user_data);
 
+/**
+ * A set of stream listeners bound to the same address using
+ * SO_REUSEPORT, each running in its own GMainContext.
+ **/
+typedef struct _ZListenerGroup
+{
+  gint num;
+  ZListener **listeners;
+} ZListenerGroup;
+
+ZListenerGroup *
+z_stream_listener_group_new(const gchar *session_id,
+                            ZSockAddr *local,
+                            guint32 sock_flags,
+                            gint backlog,
+                            ZAcceptFunc callback,
+                            gpointer user_data,
+                            gint num);
+gboolean z_listener_group_start(ZListenerGroup *self, GMainContext **contexts) G_GNUC_WARN_UNUSED_RESULT;
+void z_listener_group_cancel(ZListenerGroup *self);
+void z_listener_group_free(ZListenerGroup *self);
+
 #ifdef __cplusplus
 }
 #endif
@@ -42,6 +42,8 @@ typedef gint (*ZLogMapTagFunc)(const gchar *tag, gsize len);
 #define ZLF_STDERR      0x0008
 #define ZLF_WINDEBUG    0x0010
 #define ZLF_ESCAPE      0x0020
+#define ZLF_ASYNC       0x0040  /**< send syslog messages from a writer thread, see z_log_enable_async() */
+#define ZLF_ASYNC_BLOCK 0x0080  /**< block instead of dropping messages when the async log queue is full */
 
 #ifndef G_OS_WIN32
   #define z_debug(level, format, args...)   z_llog("core.debug", level, format, ##args)
@@ -56,6 +58,9 @@ typedef gint (*ZLogMapTagFunc)(const gchar *tag, gsize len);
 gboolean z_log_init(const gchar *syslog_name, guint flags);
 
 void z_log_enable_syslog(const gchar *syslog_name);
+void z_log_set_syslog_socket(const gchar *path);
+void z_log_enable_async(gboolean block);
+void z_log_enable_deferred(gint min_level);
 void z_log_enable_stderr_redirect(gboolean threaded);
 void z_log_enable_tag_map_cache(ZLogMapTagFunc map_tags, gint max_tag);
 
@@ -73,7 +78,7 @@ gboolean z_log_enabled_len(const gchar *class_, gsize class_len, int level);
 /**
  * Checks if a message with a given class/level combination would actually be written to the log -- with null-terminated tag string.
  *
- * @param[in] class_ message tag
+ * @param[in] class_ message tag, must be a string literal
  * @param[in] level log message level
  *
  * @see z_log_enabled_len in log.c
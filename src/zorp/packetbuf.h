@@ -12,6 +12,10 @@
 
 #include <zorp/zorplib.h>
 
+#ifndef G_OS_WIN32
+#  include <sys/uio.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -25,8 +29,12 @@ typedef enum _ZPktBufFlags
 {
   Z_PB_NONE             = 0x0000,
   Z_PB_BORROWED         = 0x0001,
+  Z_PB_POOLED           = 0x0002,   /**< recycled to the per-thread pool when freed, see z_pktbuf_new_sized() */
+  Z_PB_SHARED           = 0x0004,   /**< data is shared with other buffers, copied before modification, see z_pktbuf_part() */
 } ZPktBufFlags;
 
+typedef struct _ZPktBufStore ZPktBufStore;
+
 /**
  * Buffer intended to hold a single packet.
  **/
@@ -36,7 +44,21 @@ typedef struct _ZPktBuf
   gsize allocated, length, pos;
   ZPktBufFlags flags;
   guchar *data;
+  ZPktBufStore *store;  /**< storage shared with other buffers if Z_PB_SHARED is set */
 } ZPktBuf;
+
+/**
+ * Ordered list of ZPktBuf segments making up a single message, e.g. a
+ * protocol header and the payload. Segments are referenced, not copied,
+ * and the chain can be written with a single writev().
+ **/
+typedef struct _ZPktBufChain
+{
+  GQueue segments;
+  gsize length;
+} ZPktBufChain;
+
+struct iovec;
     
 /* Get attributes */
 static inline void *z_pktbuf_data(ZPktBuf *self) { return self->data; }
@@ -55,14 +77,28 @@ void z_pktbuf_relocate(ZPktBuf *self, void *data, gsize length, gboolean is_borr
 gboolean z_pktbuf_append(ZPktBuf *self, const void *data, gsize length);
 gboolean z_pktbuf_insert(ZPktBuf *self, gsize pos, const void *data, gsize length);
 gboolean z_pktbuf_data_equal(ZPktBuf *lhs, ZPktBuf *rhs);
+void z_pktbuf_make_writable(ZPktBuf *self);
 
 /* Instance control */
 ZPktBuf *z_pktbuf_new(void);
+ZPktBuf *z_pktbuf_new_sized(gsize size);
 ZPktBuf *z_pktbuf_ref(ZPktBuf *self);
 void z_pktbuf_unref(ZPktBuf *self);
 ZPktBuf *z_pktbuf_part(ZPktBuf *self, gsize pos, gsize len);
 void z_pktbuf_dump(const gchar *session_id, const gchar *class_, int level, ZPktBuf *self, const gchar *title);
 
+/* Buffer chains */
+ZPktBufChain *z_pktbuf_chain_new(void);
+void z_pktbuf_chain_free(ZPktBufChain *self);
+void z_pktbuf_chain_append(ZPktBufChain *self, ZPktBuf *segment);
+void z_pktbuf_chain_prepend(ZPktBufChain *self, ZPktBuf *segment);
+ZPktBuf *z_pktbuf_chain_pop(ZPktBufChain *self);
+gint z_pktbuf_chain_iovec(ZPktBufChain *self, gsize offset, struct iovec *vec, gint vec_count);
+
+static inline ZPktBuf *z_pktbuf_chain_head(ZPktBufChain *self) { return (ZPktBuf *) g_queue_peek_head(&self->segments); }
+static inline gsize z_pktbuf_chain_length(const ZPktBufChain *self) { return self->length; }
+static inline guint z_pktbuf_chain_segments(const ZPktBufChain *self) { return self->segments.length; }
+
 static inline void
 z_pktbuf_data_dump(const gchar *session_id, const gchar *class_, int level, ZPktBuf *self)
 {
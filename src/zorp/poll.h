@@ -25,6 +25,7 @@ extern "C" {
 typedef struct _ZPoll ZPoll;
 
 ZPoll *z_poll_new(void);
+ZPoll *z_poll_new_epoll(void);
 void z_poll_ref(ZPoll *);
 void z_poll_unref(ZPoll *);
 
@@ -26,6 +26,10 @@ extern "C" {
 #define ZSF_TRANSPARENT   0x0008
 /** bind to a port in the same group chosen at (truly) random */
 #define ZSF_RANDOM_BIND   0x0010
+/** accepted sockets are non-blocking and close-on-exec (using accept4() if available) */
+#define ZSF_ACCEPT_NONBLOCK 0x0020
+/** allow several sockets to bind to the same address (SO_REUSEPORT) */
+#define ZSF_REUSEPORT     0x0040
 
 static inline const gchar *
 z_socket_type_to_str(gint socket_type)
@@ -20,6 +20,10 @@
 #include <time.h>
 #include <glib.h>
 
+#ifndef G_OS_WIN32
+#  include <sys/uio.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -28,6 +32,15 @@ extern "C" {
   #define SHUT_RDWR SD_BOTH
   #define SHUT_WR SD_SEND
   #define SHUT_RD SD_RECEIVE
+
+/**
+ * Scatter-gather I/O vector, the same as the UNIX struct iovec.
+ **/
+struct iovec
+{
+  void *iov_base;
+  size_t iov_len;
+};
 #endif
 
 #define Z_STREAM_MAX_NAME   128
@@ -78,6 +91,7 @@ typedef struct _ZStreamContext ZStreamContext;
 typedef struct _ZStreamSource ZStreamSource;
 
 typedef gboolean (*ZStreamCallback)(struct _ZStream *stream, GIOCondition cond, gpointer user_data);
+typedef void (*ZStreamNotify)(struct _ZStream *stream, gpointer user_data);
 
 GSource *z_stream_source_new(ZStream *stream);
 
@@ -141,6 +155,8 @@ typedef struct _ZStreamFuncs
   
   void (*set_child)(ZStream *s, ZStream *new_child);
   gboolean (*unget_packet)(ZStream *s, ZPktBuf *packet, GError **error);
+  GIOStatus (*read_vec)(ZStream *stream, const struct iovec *vec, gint vec_count, gsize *bytes_read, GError **err);
+  GIOStatus (*write_vec)(ZStream *stream, const struct iovec *vec, gint vec_count, gsize *bytes_written, GError **err);
 } ZStreamFuncs;
 
 LIBZORPLL_EXTERN ZClass ZStream__class;
@@ -209,6 +225,9 @@ struct _ZStream
   gpointer user_data_write; /**< opaque pointer, can be used by write callback */
   GDestroyNotify user_data_write_notify;
   ZStreamCallback write_cb; /**< pointer to write callback */
+
+  ZStreamNotify poll_notify;    /**< called when the poll state of the stream might have changed, see z_stream_notify_change() */
+  gpointer poll_notify_data;    /**< opaque pointer passed to poll_notify */
 };
 
 
@@ -217,18 +236,23 @@ gboolean z_stream_save_context(ZStream *self, ZStreamContext *context);
 gboolean z_stream_restore_context(ZStream *self, ZStreamContext *context);
 GIOStatus z_stream_read(ZStream *self, void *buf, gsize count, gsize *bytes_read, GError **err);
 GIOStatus z_stream_write(ZStream *self, const void *buf, gsize count, gsize *bytes_written, GError **err);
+GIOStatus z_stream_read_vec(ZStream *self, const struct iovec *vec, gint vec_count, gsize *bytes_read, GError **err);
+GIOStatus z_stream_write_vec(ZStream *self, const struct iovec *vec, gint vec_count, gsize *bytes_written, GError **err);
 gboolean z_stream_set_cond(ZStream *s, guint type, gboolean value);
 gboolean z_stream_set_callback(ZStream *s, guint type, ZStreamCallback callback, gpointer user_data, GDestroyNotify notify);
 ZStream *z_stream_push(ZStream *self, ZStream *new_top);
 ZStream *z_stream_pop(ZStream *self);
 gboolean z_stream_unget(ZStream *self, const void *buf, gsize count, GError **error);
 void z_stream_destroy(ZStream *self);
+GSource *z_stream_get_source(ZStream *self);
 
 
 /* virtual methods for static references like calling the superclass's function in derived classes */
 
 gboolean z_stream_ctrl_method(ZStream *s, guint function, gpointer value, guint vlen);
 void z_stream_free_method(ZObject *s);
+GIOStatus z_stream_read_vec_method(ZStream *s, const struct iovec *vec, gint vec_count, gsize *bytes_read, GError **err);
+GIOStatus z_stream_write_vec_method(ZStream *s, const struct iovec *vec, gint vec_count, gsize *bytes_written, GError **err);
 
 /**
  * Reference a ZStream instance.
@@ -258,6 +282,33 @@ z_stream_unref(ZStream *self)
   z_object_unref(&self->super);
 }
 
+/**
+ * Notify the poll loop that the stream stack containing self might need
+ * to be prepared again.
+ *
+ * @param[in] self ZStream instance
+ *
+ * Poll implementations that do not prepare each registered stream in
+ * every iteration (see z_poll_new_epoll()) install a poll_notify callback
+ * on the stack top, this function looks it up and calls it. Core
+ * functions changing state that affects the result of the prepare
+ * callbacks (conditions, callbacks, buffered data) call this.
+ **/
+static inline void
+z_stream_notify_change(ZStream *self)
+{
+  ZStream *p;
+
+  for (p = self; p; p = p->parent)
+    {
+      if (p->poll_notify)
+        {
+          p->poll_notify(p, p->poll_notify_data);
+          break;
+        }
+    }
+}
+
 /**
  * Set the name of a stream (and its child, if any)
  *
@@ -295,6 +346,31 @@ z_stream_data_dump(ZStream *self, gint direction, const void *data, gsize data_l
 
 }
 
+/**
+ * Log the first data_len bytes of an I/O vector the same way as
+ * z_stream_data_dump() does for a single buffer.
+ *
+ * @param[in] self ZStream instance
+ * @param[in] direction I/O direction (G_IO_IN or G_IO_OUT)
+ * @param[in] vec I/O vector
+ * @param[in] vec_count number of elements in vec
+ * @param[in] data_len number of bytes to dump
+ **/
+static inline void
+z_stream_data_dump_vec(ZStream *self, gint direction, const struct iovec *vec, gint vec_count, gsize data_len)
+{
+  gint i;
+
+  for (i = 0; i < vec_count && data_len > 0; i++)
+    {
+      gsize len = MIN(vec[i].iov_len, data_len);
+
+      if (len)
+        z_stream_data_dump(self, direction, vec[i].iov_base, len);
+      data_len -= len;
+    }
+}
+
 /* virtual functions */
 
 /**
@@ -486,7 +562,11 @@ z_stream_set_child(ZStream *s, ZStream *new_child)
 static inline gboolean 
 z_stream_unget_packet(ZStream *s, ZPktBuf *pack, GError **error)
 {
-  return Z_FUNCS(s, ZStream)->unget_packet(s, pack, error);
+  gboolean res;
+
+  res = Z_FUNCS(s, ZStream)->unget_packet(s, pack, error);
+  z_stream_notify_change(s);
+  return res;
 }
 
 /* helper functions */
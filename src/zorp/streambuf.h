@@ -34,6 +34,7 @@ enum
 gboolean z_stream_buf_space_avail(ZStream *s);
 GIOStatus z_stream_write_buf(ZStream *stream, void *buf, guint buflen, gboolean copy_data, GError **error);
 GIOStatus z_stream_write_packet(ZStream *s, ZPktBuf *packet, GError **error);
+GIOStatus z_stream_write_packet_chain(ZStream *s, ZPktBufChain *chain, GError **error);
 
 ZStream *z_stream_buf_new(ZStream *stream, gsize bufsize_threshold, guint32 flags);
 void z_stream_buf_flush(ZStream *stream);
@@ -0,0 +1,26 @@
+/***************************************************************************
+ *
+ * This file is covered by a dual licence. You can choose whether you
+ * want to use it according to the terms of the GNU GPL version 2, or
+ * under the terms of Zorp Professional Firewall System EULA located
+ * on the Zorp installation CD.
+ *
+ ***************************************************************************/
+
+#ifndef ZORP_STREAMCODE_H_INCLUDED
+#define ZORP_STREAMCODE_H_INCLUDED
+
+#include <zorp/stream.h>
+#include <zorp/code.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+ZStream *z_stream_code_new(ZStream *child, ZCode *encode, ZCode *decode, gsize buffer_length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZORP_STREAMCODE_H_INCLUDED */
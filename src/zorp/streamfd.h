@@ -20,6 +20,7 @@ extern "C" {
 #endif
 
 ZStream *z_stream_fd_new(gint fd, const gchar *name);
+GIOStatus z_stream_splice(ZStream *src, ZStream *dst, gsize max, gsize *bytes_transferred, GError **error);
 
 #ifdef __cplusplus
 }
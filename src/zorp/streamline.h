@@ -38,6 +38,7 @@ extern "C" {
 #define ZST_LINE_GET_POLL_PARTIAL (0x04) | ZST_LINE_OFS
 #define ZST_LINE_GET_NUL_NONFATAL (0x05) | ZST_LINE_OFS
 #define ZST_LINE_GET_RETURN_EOL   (0x06) | ZST_LINE_OFS
+#define ZST_LINE_GET_MAX_BUFSIZE  (0x07) | ZST_LINE_OFS
 #define ZST_LINE_GET_PARTIAL_READ ZST_LINE_GET_POLL_PARTIAL
 
 #define ZST_LINE_SET_TRUNCATE     (0x11) | ZST_LINE_OFS
@@ -46,11 +47,23 @@ extern "C" {
 #define ZST_LINE_SET_POLL_PARTIAL (0x14) | ZST_LINE_OFS
 #define ZST_LINE_SET_NUL_NONFATAL (0x15) | ZST_LINE_OFS
 #define ZST_LINE_SET_RETURN_EOL   (0x16) | ZST_LINE_OFS
+#define ZST_LINE_SET_MAX_BUFSIZE  (0x17) | ZST_LINE_OFS
 #define ZST_LINE_SET_PARTIAL_READ ZST_LINE_SET_POLL_PARTIAL
 
 LIBZORPLL_EXTERN ZClass ZStreamLine__class;
 
+/**
+ * A line returned by z_stream_line_get_many(), pointing into the buffer
+ * of the ZStreamLine instance (not NUL terminated).
+ **/
+typedef struct _ZStreamLineView
+{
+  gchar *line;
+  gsize length;
+} ZStreamLineView;
+
 GIOStatus z_stream_line_get(ZStream *s, gchar **line, gsize *length, GError **error);
+GIOStatus z_stream_line_get_many(ZStream *s, ZStreamLineView *lines, guint max_lines, guint *num_lines, GError **error);
 GIOStatus z_stream_line_get_copy(ZStream *s, gchar *line, gsize *length, GError **error);
 void z_stream_line_unget_line(ZStream *stream);
 gboolean z_stream_line_unget(ZStream *stream, const gchar *unget_line, gsize unget_len);
@@ -81,6 +94,24 @@ z_stream_line_set_nul_nonfatal(ZStream *stream, gboolean enable)
   z_stream_ctrl(stream, ZST_LINE_SET_NUL_NONFATAL, &enable, sizeof(enable));
 }
 
+/**
+ * Let the line buffer grow up to max_bufsize bytes for long lines.
+ *
+ * @param[in] stream ZStream stack containing a ZStreamLine
+ * @param[in] max_bufsize maximum line length
+ *
+ * The buffer starts at the size given to z_stream_line_new(), it is only
+ * grown when a line does not fit and returns to its initial size once
+ * the buffered data is consumed, so a small initial size keeps idle
+ * connections cheap. The ZRL_TRUNCATE and ZRL_SPLIT flags and the "line
+ * too long" error apply to max_bufsize.
+ **/
+static inline void
+z_stream_line_set_max_bufsize(ZStream *stream, gsize max_bufsize)
+{
+  z_stream_ctrl(stream, ZST_LINE_SET_MAX_BUFSIZE, &max_bufsize, sizeof(max_bufsize));
+}
+
 #ifdef __cplusplus
 }
 #endif
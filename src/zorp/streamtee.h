@@ -3,6 +3,8 @@
 
 #include <zorp/stream.h>
 
+LIBZORPLL_EXTERN ZClass ZStreamTee__class;
+
 ZStream *z_stream_tee_new(ZStream *child, ZStream *fork, GIOCondition tee_direction);
 
 #endif
@@ -88,6 +88,50 @@ check_for_error(ZCode *c, const char *src, int srclen, int shall_be_error)
   return 0;
 }
 
+int
+check_bulk(int linelen)
+{
+  ZCode *bulk, *single;
+  unsigned char data[1000], *coded, *decoded;
+  int i, len;
+
+  for (i = 0; i < (int) sizeof(data); i++)
+    data[i] = (i * 7 + 3) & 0xff;
+
+  bulk = z_code_base64_encode_new(0, linelen);
+  single = z_code_base64_encode_new(0, linelen);
+  z_code_transform(bulk, data, sizeof(data));
+  for (i = 0; i < (int) sizeof(data); i++)
+    z_code_transform(single, data + i, 1);
+  z_code_finish(bulk);
+  z_code_finish(single);
+
+  len = z_code_get_result_length(bulk);
+  if (len != (int) z_code_get_result_length(single) ||
+      memcmp(z_code_peek_result(bulk), z_code_peek_result(single), len) != 0)
+    return error("Bulk encoding differs");
+
+  /* decode the wrapped text in one go */
+  coded = (unsigned char *) malloc(len);
+  z_code_get_result(bulk, coded, len);
+  z_code_free(bulk);
+  z_code_free(single);
+
+  bulk = z_code_base64_decode_new(0, FALSE);
+  if (!z_code_transform(bulk, coded, len) || !z_code_finish(bulk))
+    return error("Bulk decoding failed");
+  if (z_code_get_result_length(bulk) != sizeof(data))
+    return error("Bulk decoding length mismatch");
+  decoded = (unsigned char *) z_code_peek_result(bulk);
+  if (memcmp(decoded, data, sizeof(data)) != 0)
+    return error("Bulk decoding differs");
+
+  printf("Bulk conversion OK; linelen='%d'\n", linelen);
+  z_code_free(bulk);
+  free(coded);
+  return 0;
+}
+
 int
 main(void)
 {
@@ -262,6 +306,12 @@ main(void)
   if (check_for_error(dec, "AAA",  3, TRUE )) return 1;
   if (check_for_error(dec, "A!AA", 4, TRUE )) return 1;
 
+
+  /***********************************************************************/
+  /* bulk conversion must produce the same result as the state machine */
+  printf("\nTesting bulk conversion\n");
+  if (check_bulk(0) || check_bulk(76) || check_bulk(5))
+    return 1;
   
   printf("\nDropping en/decoder\n");
   z_code_free(enc);
@@ -11,6 +11,7 @@
 
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define TEST_DELAY    100
 
@@ -221,6 +222,274 @@ test_fetch_in_lock(ZBlobSystem *blobsys)
 }
 
 
+/***********************************************************************
+ * Concurrent read test
+ *
+ ***********************************************************************/
+
+#define TEST_READ_SIZE    3000
+
+gpointer
+read_blob_contents(ZBlob *blob)
+{
+  gchar     buf[TEST_READ_SIZE];
+  gsize     rd;
+  int       i, j;
+
+  for (i = 0; i < 100; i++)
+    {
+      rd = z_blob_get_copy(blob, 0, buf, sizeof(buf), -1);
+      if (rd != sizeof(buf))
+        return GINT_TO_POINTER(FALSE);
+      for (j = 0; j < TEST_READ_SIZE; j++)
+        {
+          if (buf[j] != (gchar) (j % 251))
+            return GINT_TO_POINTER(FALSE);
+        }
+    }
+  return GINT_TO_POINTER(TRUE);
+}
+
+/**
+ * test_concurrent_read:
+ * @blobsys: this
+ *
+ * Reads a swapped out blob from several threads in parallel
+ */
+void
+test_concurrent_read(ZBlobSystem *blobsys)
+{
+  ZBlob         *blob;
+  GThread       *thr[2];
+  gchar         data[TEST_READ_SIZE];
+  gchar         *ptr;
+  gsize         len;
+  gboolean      res[2];
+  int           i;
+
+  for (i = 0; i < TEST_READ_SIZE; i++)
+    data[i] = (gchar) (i % 251);
+
+  send_log(NULL, CORE_DEBUG, 4, "-- creating blob; size='%d'", TEST_READ_SIZE);
+  blob = z_blob_new(blobsys, 0);
+  /* first half goes to memory, the rest is written after the blob was swapped out */
+  z_blob_add_copy(blob, 0, data, TEST_READ_SIZE / 2, -1);
+  z_blob_get_file(blob, NULL, NULL, -1, -1);
+  z_blob_release_file(blob);
+  test_and_log(blob->is_in_file, TRUE, "-- blob->is_in_file: %s", blob->is_in_file ? "yes" : "no");
+  z_blob_add_copy(blob, TEST_READ_SIZE / 2, data + TEST_READ_SIZE / 2, TEST_READ_SIZE - TEST_READ_SIZE / 2, -1);
+
+  send_log(NULL, CORE_DEBUG, 4, "-- creating reader threads");
+  thr[0] = g_thread_create((GThreadFunc)read_blob_contents, (gpointer)blob, TRUE, NULL);
+  thr[1] = g_thread_create((GThreadFunc)read_blob_contents, (gpointer)blob, TRUE, NULL);
+  res[0] = GPOINTER_TO_INT(g_thread_join(thr[0]));
+  res[1] = GPOINTER_TO_INT(g_thread_join(thr[1]));
+  test_and_log(res[0] && res[1], TRUE, "-- concurrent readers got the blob contents");
+
+  len = 1000;
+  ptr = z_blob_get_ptr(blob, 1000, &len, -1);
+  test_and_log(ptr && len == 1000 && memcmp(ptr, data + 1000, len) == 0, TRUE, "-- swapped out blob pointer");
+  if (ptr)
+    z_blob_free_ptr(blob, ptr);
+
+  send_log(NULL, CORE_DEBUG, 4, "-- destroying blob");
+  z_blob_unref(blob);
+}
+
+
+/***********************************************************************
+ * Chunked storage test
+ *
+ ***********************************************************************/
+
+#define TEST_CHUNKED_SIZE   200000
+
+/**
+ * test_chunked_copy:
+ *
+ * Writes and reads back a blob spanning several chunks in pieces
+ * that are not aligned to the chunk boundaries
+ */
+void
+test_chunked_copy(void)
+{
+  ZBlob     *blob;
+  gchar     *data, *buf, *ptr;
+  gsize     pos, len;
+  int       i;
+
+  data = g_new(gchar, TEST_CHUNKED_SIZE);
+  buf = g_new0(gchar, TEST_CHUNKED_SIZE);
+  for (i = 0; i < TEST_CHUNKED_SIZE; i++)
+    data[i] = (gchar) (i % 253);
+
+  blob = z_blob_new(NULL, 0);
+  for (pos = 0; pos < TEST_CHUNKED_SIZE; pos += len)
+    {
+      len = MIN(3000, TEST_CHUNKED_SIZE - pos);
+      z_blob_add_copy(blob, pos, data + pos, len, -1);
+    }
+  test_and_log(blob->size == TEST_CHUNKED_SIZE, TRUE, "-- chunked blob size: %" G_GINT64_FORMAT, blob->size);
+
+  for (pos = 0; pos < TEST_CHUNKED_SIZE; pos += len)
+    {
+      len = z_blob_get_copy(blob, pos, buf + pos, 7000, -1);
+      if (len == 0)
+        break;
+    }
+  test_and_log(memcmp(data, buf, TEST_CHUNKED_SIZE) == 0, TRUE, "-- chunked blob contents read back");
+
+  len = 10000;
+  ptr = z_blob_get_ptr(blob, 60000, &len, -1);
+  test_and_log(ptr && len > 0 && len <= 10000 && memcmp(ptr, data + 60000, len) == 0, TRUE, "-- chunked blob pointer; length='%" G_GSIZE_FORMAT "'", len);
+  if (ptr)
+    z_blob_free_ptr(blob, ptr);
+
+  z_blob_unref(blob);
+  g_free(buf);
+  g_free(data);
+}
+
+
+/***********************************************************************
+ * Eviction test
+ *
+ ***********************************************************************/
+
+/**
+ * test_eviction:
+ * @blobsys: this
+ *
+ * A growing blob evicts a big idle blob instead of going to disk itself,
+ * small blobs stay in memory
+ */
+void
+test_eviction(ZBlobSystem *blobsys)
+{
+  ZBlob     *blob[3];
+  gchar     buf[100], *ptr;
+  gsize     len;
+  gint      i;
+
+  memset(buf, 'x', sizeof(buf));
+  send_log(NULL, CORE_DEBUG, 4, "-- creating blob[0]; size='2000'");
+  blob[0] = z_blob_new(blobsys, 2000);  /* big, will be idle */
+  send_log(NULL, CORE_DEBUG, 4, "-- creating blob[1]; size='400'");
+  blob[1] = z_blob_new(blobsys, 400);   /* below noswap_max, never evicted */
+  send_log(NULL, CORE_DEBUG, 4, "-- creating blob[2]; size='2000'");
+  blob[2] = z_blob_new(blobsys, 2000);
+  send_log(NULL, CORE_DEBUG, 4, "-- accessing blob[2]");
+  for (i = 0; i < 10; i++)              /* every request makes it warmer than the idle blob[0] */
+    {
+      z_blob_add_copy(blob[2], i * sizeof(buf), buf, sizeof(buf), -1);
+      z_blob_get_copy(blob[2], 0, buf, sizeof(buf), -1);
+      len = sizeof(buf);
+      ptr = z_blob_get_ptr(blob[2], 0, &len, -1);
+      if (ptr)
+        z_blob_free_ptr(blob[2], ptr);
+    }
+  send_log(NULL, CORE_DEBUG, 4, "-- growing blob[2]; size='4000'");
+  z_blob_truncate(blob[2], 4000, -1);  /* does not fit, blob[0] is the coldest */
+  test_and_log(blob[0]->is_in_file, TRUE, "-- blob[0]->is_in_file: %s", blob[0]->is_in_file ? "yes" : "no");
+  test_and_log(blob[1]->is_in_file, FALSE, "-- blob[1]->is_in_file: %s", blob[1]->is_in_file ? "yes" : "no");
+  test_and_log(blob[2]->is_in_file, FALSE, "-- blob[2]->is_in_file: %s", blob[2]->is_in_file ? "yes" : "no");
+  send_log(NULL, CORE_DEBUG, 4, "-- destroying blobs");
+  z_blob_unref(blob[2]);
+  z_blob_unref(blob[1]);
+  z_blob_unref(blob[0]);
+}
+
+
+
+/***********************************************************************
+ * Concurrent allocation test
+ *
+ ***********************************************************************/
+
+#define TEST_ALLOC_THREADS  4
+#define TEST_ALLOC_ROUNDS   200
+#define TEST_ALLOC_MEM_MAX  50000
+
+static gboolean alloc_over_limit;
+static gint alloc_running;
+
+/**
+ * check_mem_used:
+ * @blobsys: this
+ *
+ * Records if the memory usage of the blob system is above its limit
+ */
+static void
+check_mem_used(ZBlobSystem *blobsys)
+{
+  if (z_blob_system_mem_used(blobsys) > blobsys->mem_max)
+    alloc_over_limit = TRUE;
+}
+
+/**
+ * alloc_blobs:
+ * @blobsys: this
+ *
+ * Creates, grows and destroys blobs of various sizes
+ */
+static gpointer
+alloc_blobs(ZBlobSystem *blobsys)
+{
+  gchar     data[4000];
+  ZBlob     *blob[4];
+  gint      i, j;
+
+  memset(data, 'x', sizeof(data));
+  for (i = 0; i < TEST_ALLOC_ROUNDS; i++)
+    {
+      for (j = 0; j < 4; j++)
+        {
+          blob[j] = z_blob_new(blobsys, 1000 * (1 + (i + j) % 8));
+          check_mem_used(blobsys);
+          z_blob_add_copy(blob[j], 0, data, sizeof(data), -1);
+          check_mem_used(blobsys);
+        }
+      for (j = 0; j < 4; j++)
+        z_blob_unref(blob[j]);
+      check_mem_used(blobsys);
+    }
+  g_atomic_int_add(&alloc_running, -1);
+  return NULL;
+}
+
+/**
+ * test_concurrent_alloc:
+ *
+ * Allocates blobs from several threads against the memory limit of a
+ * blob system, the limit is never exceeded and all the memory is given
+ * back at the end
+ */
+void
+test_concurrent_alloc(void)
+{
+  ZBlobSystem   *blobsys;
+  GThread       *thr[TEST_ALLOC_THREADS];
+  int           i;
+
+  blobsys = z_blob_system_new("/tmp", 10000000, TEST_ALLOC_MEM_MAX, TEST_ALLOC_MEM_MAX / 2, TEST_ALLOC_MEM_MAX * 3 / 4, 500);
+
+  send_log(NULL, CORE_DEBUG, 4, "-- creating allocator threads");
+  alloc_running = TEST_ALLOC_THREADS;
+  for (i = 0; i < TEST_ALLOC_THREADS; i++)
+    thr[i] = g_thread_create((GThreadFunc)alloc_blobs, (gpointer)blobsys, TRUE, NULL);
+  while (g_atomic_int_get(&alloc_running))
+    {
+      check_mem_used(blobsys);
+      g_thread_yield();
+    }
+  for (i = 0; i < TEST_ALLOC_THREADS; i++)
+    g_thread_join(thr[i]);
+
+  test_and_log(alloc_over_limit, FALSE, "-- memory limit exceeded: %s", alloc_over_limit ? "yes" : "no");
+  test_and_log(z_blob_system_mem_used(blobsys) == 0, TRUE, "-- memory in use after destroying blobs: %" G_GSIZE_FORMAT, z_blob_system_mem_used(blobsys));
+  z_blob_system_unref(blobsys);
+}
+
 
 /***********************************************************************
  * 'Framework'
@@ -250,10 +519,15 @@ main(void)
   test_fetch_in(blobsys);
   test_fetch_in_lock(blobsys);
   test_deferred_alloc(blobsys);
+  test_concurrent_read(blobsys);
+  test_eviction(blobsys);
  
   /* Deinitialie custom blob system */
   z_blob_system_unref(blobsys);
 
+  test_chunked_copy();
+  test_concurrent_alloc();
+
   /* Create blob in the default blob system */
   blob = z_blob_new(NULL, 500);
   blobptr_size = 10;
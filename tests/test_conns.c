@@ -11,7 +11,7 @@ static void
 test_done(void)
 {
   counter++;
-  if (counter == 2)
+  if (counter == 6)
     g_main_quit(loop);
 }
 
@@ -25,6 +25,25 @@ test_accepted(ZStream *stream G_GNUC_UNUSED, ZSockAddr *client, ZSockAddr *dest,
   return TRUE;
 }
 
+static gboolean
+test_accepted_batch(ZStream **streams, ZSockAddr **clients, ZSockAddr **dests, gint count, gpointer user_data G_GNUC_UNUSED)
+{
+  gint i;
+
+  for (i = 0; i < count; i++)
+    {
+      if (!z_stream_get_nonblock(streams[i]))
+        printf("Batch accepted connection is blocking\n");
+      else
+        printf("Connection accepted in batch\n");
+      z_stream_unref(streams[i]);
+      z_sockaddr_unref(clients[i]);
+      z_sockaddr_unref(dests[i]);
+      test_done();
+    }
+  return TRUE;
+}
+
 static void
 test_connected(ZStream *fdstream G_GNUC_UNUSED, GError *error G_GNUC_UNUSED, gpointer user_data G_GNUC_UNUSED)
 {
@@ -35,9 +54,11 @@ test_connected(ZStream *fdstream G_GNUC_UNUSED, GError *error G_GNUC_UNUSED, gpo
 int 
 main(void)
 {
-  ZSockAddr *a;
-  ZListener *l;
-  ZConnector *c;
+  ZSockAddr *a, *b, *g;
+  ZListener *l, *bl;
+  ZConnector *c, *bc, *gc;
+  ZListenerGroup *group;
+  GMainContext *contexts[2];
   ZSockAddr *dest;
   
   loop = g_main_loop_new(NULL, TRUE);
@@ -48,11 +69,37 @@ main(void)
   
   c = z_stream_connector_new("sessionid", NULL, a, 0, test_connected, NULL, NULL);
   z_connector_start(c, &dest);
+
+  b = z_sockaddr_unix_new("sock.batch");
+  bl = z_stream_listener_new("sessionid", b, ZSF_ACCEPT_NONBLOCK, 255, test_accepted, NULL);
+  z_listener_set_accept_batch(bl, 64, test_accepted_batch);
+  z_listener_start(bl);
+
+  bc = z_stream_connector_new("sessionid", NULL, b, 0, test_connected, NULL, NULL);
+  z_connector_start(bc, &dest);
+
+  /* both shards in the default context, the kernel picks one */
+  g = z_sockaddr_inet_new("127.0.0.1", 0);
+  group = z_stream_listener_group_new("sessionid", g, 0, 255, test_accepted, NULL, 2);
+  contexts[0] = contexts[1] = g_main_context_default();
+  if (!z_listener_group_start(group, contexts))
+    {
+      printf("Error starting listener group\n");
+      return 1;
+    }
+
+  gc = z_stream_connector_new("sessionid", NULL, group->listeners[0]->local, 0, test_connected, NULL, NULL);
+  z_connector_start(gc, &dest);
   while (g_main_loop_is_running(loop))
     {
       g_main_context_iteration(NULL, TRUE);
     }
   z_listener_unref(l);
   z_connector_unref(c);
+  z_listener_unref(bl);
+  z_connector_unref(bc);
+  z_listener_group_cancel(group);
+  z_listener_group_free(group);
+  z_connector_unref(gc);
   return 0;
 }
@@ -0,0 +1,173 @@
+#include <zorp/log.h>
+
+#include <stdio.h>
+#include <string.h>
+
+static int
+check_enabled(const gchar *tag, gint enabled_level)
+{
+  /* twice, the second lookup is served from the cache */
+  if (!z_log_enabled_len(tag, strlen(tag), enabled_level) ||
+      z_log_enabled_len(tag, strlen(tag), enabled_level + 1) ||
+      !z_log_enabled_len(tag, strlen(tag), enabled_level) ||
+      z_log_enabled_len(tag, strlen(tag), enabled_level + 1))
+    {
+      fprintf(stderr, "wrong verbosity level for tag; tag='%s', expected='%d'\n", tag, enabled_level);
+      return 1;
+    }
+  return 0;
+}
+
+int
+test_logspec_cache(void)
+{
+  gchar reused[16];
+  gint res = 0;
+
+  res |= check_enabled("core.debug", 6);
+  res |= check_enabled("core.error", 1);
+  res |= check_enabled("other.tag", 3);
+
+  /* a tag at the address of another cached tag is not mistaken for it */
+  strcpy(reused, "core.debug");
+  res |= check_enabled(reused, 6);
+  strcpy(reused, "core.error");
+  res |= check_enabled(reused, 1);
+  if (res)
+    return res;
+
+  /* changing the logspec invalidates the cache */
+  z_log_change_logspec("core.error:5", NULL);
+  res |= check_enabled("core.debug", 3);
+  res |= check_enabled("core.error", 5);
+  res |= check_enabled("other.tag", 3);
+  if (res)
+    return res;
+
+  /* and so does changing the verbosity level */
+  z_log_change_verbose_level(0, 8, NULL);
+  res |= check_enabled("core.error", 5);
+  res |= check_enabled("other.tag", 8);
+  return res;
+}
+
+static const gchar *dump_expected[] =
+{
+  "data line 0x0000: 30 31 32 33 34 35 36 37 38 39 61 62 63 64 65 66  0123456789abcdef",
+  "data line 0x0010: 58 59 5A 00 FF 7F 20                             XYZ... ",
+};
+static guint dump_lines;
+static gboolean dump_mismatch;
+
+static void
+check_dump(const gchar *log_domain G_GNUC_UNUSED,
+           GLogLevelFlags log_flags G_GNUC_UNUSED,
+           const gchar *message,
+           gpointer user_data G_GNUC_UNUSED)
+{
+  const gchar *line = strstr(message, "data line");
+
+  if (!line)
+    return;
+  if (dump_lines >= G_N_ELEMENTS(dump_expected) || strcmp(line, dump_expected[dump_lines]) != 0)
+    {
+      fprintf(stderr, "unexpected dump line; line='%s'\n", line);
+      dump_mismatch = TRUE;
+    }
+  dump_lines++;
+}
+
+int
+test_data_dump(void)
+{
+  g_log_set_handler("Zorp", 0xff, check_dump, NULL);
+  z_log_data_dump(NULL, CORE_DUMP, 1, "0123456789abcdefXYZ\0\xff\x7f ", 23);
+  if (dump_mismatch || dump_lines != G_N_ELEMENTS(dump_expected))
+    {
+      fprintf(stderr, "wrong data dump; lines='%u'\n", dump_lines);
+      return 1;
+    }
+  return 0;
+}
+
+static gint sampled_count, limited_count;
+static guint sampled_reported, limited_reported;
+
+static void
+count_messages(const gchar *log_domain G_GNUC_UNUSED,
+               GLogLevelFlags log_flags G_GNUC_UNUSED,
+               const gchar *message,
+               gpointer user_data G_GNUC_UNUSED)
+{
+  const gchar *report;
+  guint count;
+
+  if (strstr(message, "sampled message"))
+    sampled_count++;
+  else if (strstr(message, "limited message"))
+    limited_count++;
+  else if ((report = strstr(message, "suppressed by rate limit; pattern='core.dump', count='")) &&
+           sscanf(strstr(report, "count='"), "count='%u'", &count) == 1)
+    sampled_reported += count;
+  else if ((report = strstr(message, "suppressed by rate limit; pattern='core.accounting', count='")) &&
+           sscanf(strstr(report, "count='"), "count='%u'", &count) == 1)
+    limited_reported += count;
+}
+
+int
+test_log_limits(void)
+{
+  gint i;
+
+  if (z_log_change_logspec("core.dump:9%10,core.accounting:9@", NULL) ||
+      z_log_change_logspec("core.dump:9%0", NULL) ||
+      z_log_change_logspec("core.accounting:9@5/", NULL))
+    {
+      fprintf(stderr, "invalid rate limit accepted\n");
+      return 1;
+    }
+  if (!z_log_change_logspec("core.dump:9%10,core.accounting:9@5/5", NULL))
+    {
+      fprintf(stderr, "valid rate limit rejected\n");
+      return 1;
+    }
+
+  g_log_set_handler("Zorp", 0xff, count_messages, NULL);
+  for (i = 0; i < 100; i++)
+    {
+      z_log(NULL, CORE_DUMP, 1, "sampled message; i='%d'", i);
+      z_log(NULL, CORE_ACCOUNTING, 1, "limited message; i='%d'", i);
+    }
+
+  /* every 10th message passes the sampling, the burst allows 5 messages, one more may have been refilled meanwhile */
+  if (sampled_count != 10 || limited_count < 5 || limited_count > 6)
+    {
+      fprintf(stderr, "rate limits not applied; sampled='%d', limited='%d'\n", sampled_count, limited_count);
+      return 1;
+    }
+
+  /* the suppressed messages are reported when the limits are removed */
+  z_log_change_logspec("core.*:9", NULL);
+  if (sampled_reported != (guint) (100 - sampled_count) || limited_reported != (guint) (100 - limited_count))
+    {
+      fprintf(stderr, "suppressed messages not reported; sampled='%u', limited='%u'\n", sampled_reported, limited_reported);
+      return 1;
+    }
+  return 0;
+}
+
+int
+main(void)
+{
+  gint res;
+
+  z_log_set_defaults(3, FALSE, FALSE, "core.debug:6,core.*:1");
+  z_log_init("test_log", 0);
+  res = test_logspec_cache();
+  if (!res)
+    res = test_data_dump();
+  if (!res)
+    res = test_log_limits();
+  z_log_destroy();
+  return res;
+}
@@ -0,0 +1,289 @@
+#include <zorp/log.h>
+#include <zorp/thread.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/* more than the log queue and the socket buffer can hold */
+#define TEST_MESSAGES 20000
+#define TEST_QUEUE_SIZE 4096
+
+enum
+{
+  TEST_DROP,
+  TEST_BLOCK,
+  TEST_DEFERRED,
+  TEST_MODES
+};
+
+static gint syslog_conn = -1;
+static gulong reader_delay;
+
+/**
+ * Collect everything sent to the syslog socket, optionally starting late
+ * so that the log writer thread and then the log queue fill up meanwhile.
+ **/
+static gpointer
+read_syslog(gpointer user_data)
+{
+  GString *received = (GString *) user_data;
+  gchar buf[4096];
+  gssize len;
+
+  g_usleep(reader_delay);
+  while ((len = read(syslog_conn, buf, sizeof(buf))) != 0)
+    {
+      if (len < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+      g_string_append_len(received, buf, len);
+    }
+  return NULL;
+}
+
+/**
+ * Check the messages received by syslog.
+ *
+ * Every message must be either received in order or counted as dropped,
+ * the indices strictly increase across the wraparound of the queue
+ * positions. Without dropping every message must arrive.
+ **/
+static gint
+check_syslog(GString *received, gboolean block)
+{
+  gchar *line, *next, *p;
+  gint count = 0, dropped = 0, last = -1, i;
+
+  for (line = received->str; *line; line = next)
+    {
+      next = strchr(line, '\n');
+      if (!next)
+        break;
+      *next++ = 0;
+
+      if ((p = strstr(line, "async message; i='")) && sscanf(p, "async message; i='%d'", &i) == 1)
+        {
+          if (i <= last || (block && i != last + 1))
+            {
+              fprintf(stderr, "message out of order; i='%d', last='%d'\n", i, last);
+              return 1;
+            }
+          last = i;
+          count++;
+        }
+      else if ((p = strstr(line, "messages dropped; count='")) && sscanf(p, "messages dropped; count='%d'", &i) == 1)
+        {
+          dropped += i;
+        }
+    }
+
+  if (count + dropped != TEST_MESSAGES || count < TEST_QUEUE_SIZE || (block && dropped))
+    {
+      fprintf(stderr, "messages lost; block='%d', received='%d', dropped='%d'\n", block, count, dropped);
+      return 1;
+    }
+  return 0;
+}
+
+/**
+ * Log a message and remember how printf formats it.
+ *
+ * errno is set for %m, and the message is formatted by g_strdup_printf()
+ * before logging so that the arguments are evaluated the same way.
+ **/
+#define LOG_FORMAT(expected, format, args...) \
+  do \
+    { \
+      errno = ENOENT; \
+      g_ptr_array_add(expected, g_strdup_printf(format, ##args)); \
+      errno = ENOENT; \
+      z_llog(CORE_ERROR, 1, format, ##args); \
+    } \
+  while (0)
+
+/**
+ * Log messages with deferred formatting and collect the expected text.
+ *
+ * The messages cover every type of value captured by deferred formatting,
+ * star width and precision, and conversions which force immediate
+ * formatting (%m, positional arguments).
+ **/
+static void
+log_deferred(GPtrArray *expected)
+{
+  static const gchar unterminated[3] = { 'x', 'y', 'z' };
+  gint local;
+
+  LOG_FORMAT(expected, "fmt string; value='%s', padded='%-6s|%6s'", "abc", "l", "r");
+  LOG_FORMAT(expected, "fmt precision; value='%.*s', unterminated='%.3s', literal='%.2s'", 3, "abcdef", unterminated, "abcdef");
+  LOG_FORMAT(expected, "fmt width; value='%*d', left='%-*d', both='%*.*f'", 8, -42, 5, 7, 10, 2, 3.14159);
+  LOG_FORMAT(expected, "fmt int; value='%d', unsigned='%u', hex='%#x', short='%hd', char='%c'", INT_MIN, UINT_MAX, 0xbeef, (short) -3, 'q');
+  LOG_FORMAT(expected, "fmt long; value='%ld', long long='%lld', unsigned='%llu'", LONG_MIN, LLONG_MIN, ULLONG_MAX);
+  LOG_FORMAT(expected, "fmt size; value='%zu', signed='%zd'", SIZE_MAX, (ssize_t) -1);
+  LOG_FORMAT(expected, "fmt double; value='%f', exp='%.3e', general='%g'", 3.25, -1234.5678, 1e-10);
+  LOG_FORMAT(expected, "fmt long double; value='%Lf', exp='%Le'", (long double) 1.5, (long double) -2.75e100);
+  LOG_FORMAT(expected, "fmt pointer; value='%p', null='%p'", (void *) &local, (void *) NULL);
+  LOG_FORMAT(expected, "fmt percent; value='100%%', after='%d%%'", 50);
+  LOG_FORMAT(expected, "fmt errno; error='%m', value='%d'", 1);
+  LOG_FORMAT(expected, "fmt positional; value='%2$s %1$s'", "first", "second");
+  LOG_FORMAT(expected, "fmt plain; no conversions");
+}
+
+/**
+ * Check that deferred messages are the same as formatted by printf and
+ * are sent with the same priority as the immediately formatted ones.
+ **/
+static gint
+check_deferred(GString *received, GPtrArray *expected)
+{
+  gchar *line, *next, *msg;
+  guint count = 0;
+  gint pri;
+
+  for (line = received->str; *line; line = next)
+    {
+      next = strchr(line, '\n');
+      if (!next)
+        break;
+      *next++ = 0;
+
+      msg = strstr(line, "]: ");
+      if (!msg || strncmp(msg + 3, "fmt ", 4) != 0)
+        continue;
+      msg += 3;
+      if (count >= expected->len || strcmp(msg, g_ptr_array_index(expected, count)) != 0)
+        {
+          fprintf(stderr, "deferred message mismatch; message='%s', expected='%s'\n",
+                  msg, count < expected->len ? (gchar *) g_ptr_array_index(expected, count) : "");
+          return 1;
+        }
+      if (sscanf(line, "<%d>", &pri) != 1 || pri != (LOG_INFO | ZORP_SYSLOG_FACILITY))
+        {
+          fprintf(stderr, "wrong priority of deferred message; line='%s'\n", line);
+          return 1;
+        }
+      count++;
+    }
+  if (count != expected->len)
+    {
+      fprintf(stderr, "deferred messages lost; received='%u', expected='%u'\n", count, expected->len);
+      return 1;
+    }
+  return 0;
+}
+
+static gint
+test_log_async(const gchar *path, gint mode)
+{
+  struct sockaddr_un s_un;
+  GString *received;
+  GPtrArray *expected = NULL;
+  GThread *reader;
+  gint fd, i, res;
+
+  fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  memset(&s_un, 0, sizeof(s_un));
+  s_un.sun_family = AF_UNIX;
+  g_strlcpy(s_un.sun_path, path, sizeof(s_un.sun_path));
+  if (fd < 0 || bind(fd, (struct sockaddr *) &s_un, sizeof(s_un)) < 0 || listen(fd, 1) < 0)
+    {
+      perror("cannot listen on syslog socket");
+      return 1;
+    }
+
+  z_thread_init();
+  z_log_set_syslog_socket(path);
+  z_log_set_defaults(3, TRUE, FALSE, NULL);
+  z_log_init("test_log_async", ZLF_ASYNC | (mode != TEST_DROP ? ZLF_ASYNC_BLOCK : 0));
+
+  syslog_conn = accept(fd, NULL, NULL);
+  if (syslog_conn < 0)
+    {
+      perror("cannot accept syslog connection");
+      return 1;
+    }
+
+  received = g_string_sized_new(TEST_MESSAGES * 64);
+  if (mode == TEST_DEFERRED)
+    {
+      expected = g_ptr_array_new();
+      z_log_enable_deferred(0);
+      reader = g_thread_create(read_syslog, received, TRUE, NULL);
+      log_deferred(expected);
+    }
+  else
+    {
+      /* start reading late so that the queue fills up */
+      reader_delay = 300000;
+      reader = g_thread_create(read_syslog, received, TRUE, NULL);
+      for (i = 0; i < TEST_MESSAGES; i++)
+        z_log(NULL, CORE_ERROR, 1, "async message; i='%d'", i);
+    }
+
+  /* stopping the writer sends everything still queued, then closes the connection */
+  z_log_destroy();
+  g_thread_join(reader);
+
+  if (mode == TEST_DEFERRED)
+    {
+      res = check_deferred(received, expected);
+      for (i = 0; i < (gint) expected->len; i++)
+        g_free(g_ptr_array_index(expected, i));
+      g_ptr_array_free(expected, TRUE);
+    }
+  else
+    {
+      res = check_syslog(received, mode == TEST_BLOCK);
+    }
+  g_string_free(received, TRUE);
+  close(syslog_conn);
+  close(fd);
+  return res;
+}
+
+int
+main(void)
+{
+  gchar dir[] = "/tmp/test_log_async.XXXXXX";
+  gchar *path;
+  gint mode, status, res = 0;
+  pid_t pid;
+
+#if !HAVE_BUGGY_SYSLOG_IN_LIBC
+  /* libc syslog() cannot be pointed to a test socket */
+  printf("private syslog implementation not used, skipping\n");
+  return 0;
+#endif
+  if (!mkdtemp(dir))
+    {
+      perror("cannot create temporary directory");
+      return 1;
+    }
+
+  /* the log subsystem can be initialized only once per process */
+  for (mode = 0; mode < TEST_MODES && !res; mode++)
+    {
+      path = g_strdup_printf("%s/log-%d", dir, mode);
+      pid = fork();
+      if (pid == 0)
+        exit(test_log_async(path, mode));
+      if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        res = 1;
+      unlink(path);
+      g_free(path);
+    }
+  rmdir(dir);
+  return res;
+}
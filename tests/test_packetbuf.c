@@ -0,0 +1,188 @@
+#include <zorp/packetbuf.h>
+#include <zorp/log.h>
+
+#include <stdio.h>
+#include <string.h>
+
+int
+test_pktbuf_pool(void)
+{
+  ZPktBuf *pack, *pack2;
+  guchar *data;
+
+  /* sizes far from a class size are not rounded up */
+  pack = z_pktbuf_new_sized(100);
+  pack2 = z_pktbuf_new_sized(5000);
+  if (z_pktbuf_size(pack) != 100 || (z_pktbuf_flags(pack) & Z_PB_POOLED) ||
+      z_pktbuf_size(pack2) != 5000 || (z_pktbuf_flags(pack2) & Z_PB_POOLED))
+    {
+      fprintf(stderr, "small packet is pooled; size='%zu', size2='%zu'\n", z_pktbuf_size(pack), z_pktbuf_size(pack2));
+      return 1;
+    }
+  z_pktbuf_unref(pack);
+  z_pktbuf_unref(pack2);
+
+  pack = z_pktbuf_new_sized(2000);
+  if (z_pktbuf_size(pack) != 2048 || !(z_pktbuf_flags(pack) & Z_PB_POOLED))
+    {
+      fprintf(stderr, "pooled packet has wrong size; size='%zu'\n", z_pktbuf_size(pack));
+      return 1;
+    }
+  z_pktbuf_copy(pack, "abcdef", 6);
+  data = pack->data;
+  z_pktbuf_unref(pack);
+
+  /* the same header and payload is returned */
+  pack2 = z_pktbuf_new_sized(1600);
+  if (pack2 != pack || pack2->data != data || z_pktbuf_length(pack2) != 0 || z_pktbuf_pos(pack2) != 0)
+    {
+      fprintf(stderr, "pooled packet was not recycled\n");
+      return 1;
+    }
+
+  /* growing close to a class size stays within the classes */
+  z_pktbuf_resize(pack2, 15000);
+  if (z_pktbuf_size(pack2) != 16384)
+    {
+      fprintf(stderr, "pooled packet grew to wrong size; size='%zu'\n", z_pktbuf_size(pack2));
+      return 1;
+    }
+  z_pktbuf_unref(pack2);
+
+  pack = z_pktbuf_new_sized(13000);
+  if (pack != pack2)
+    {
+      fprintf(stderr, "grown pooled packet was not recycled\n");
+      return 1;
+    }
+
+  /* growing far from a class size leaves the classes */
+  z_pktbuf_resize(pack, 20000);
+  if (z_pktbuf_size(pack) != 20000)
+    {
+      fprintf(stderr, "pooled packet was rounded up; size='%zu'\n", z_pktbuf_size(pack));
+      return 1;
+    }
+  z_pktbuf_unref(pack);
+
+  /* oversized buffers are not pooled */
+  pack = z_pktbuf_new_sized(100000);
+  if (z_pktbuf_size(pack) != 100000 || (z_pktbuf_flags(pack) & Z_PB_POOLED))
+    {
+      fprintf(stderr, "oversized packet is pooled\n");
+      return 1;
+    }
+  z_pktbuf_unref(pack);
+  return 0;
+}
+
+int
+test_pktbuf_part(void)
+{
+  ZPktBuf *pack, *part, *part2;
+
+  pack = z_pktbuf_new();
+  z_pktbuf_copy(pack, "0123456789", 10);
+  part = z_pktbuf_part(pack, 2, 6);
+  part2 = z_pktbuf_part(part, 1, 100);
+  if (part->data != pack->data + 2 || z_pktbuf_length(part) != 6 ||
+      part2->data != pack->data + 3 || z_pktbuf_length(part2) != 5)
+    {
+      fprintf(stderr, "slice does not share data with its parent\n");
+      return 1;
+    }
+
+  /* modifying a slice copies it */
+  z_pktbuf_seek(part, G_SEEK_SET, 0);
+  z_pktbuf_put_u8(part, 'x');
+  if (part->data == pack->data + 2 || memcmp(part->data, "x34567", 6) != 0 ||
+      memcmp(pack->data, "0123456789", 10) != 0 || memcmp(part2->data, "34567", 5) != 0)
+    {
+      fprintf(stderr, "slice was not copied on write\n");
+      return 1;
+    }
+  z_pktbuf_unref(part);
+
+  /* the parent keeps the storage alive */
+  z_pktbuf_unref(pack);
+  if (memcmp(part2->data, "34567", 5) != 0)
+    {
+      fprintf(stderr, "slice lost its data\n");
+      return 1;
+    }
+  z_pktbuf_make_writable(part2);
+  if ((z_pktbuf_flags(part2) & Z_PB_SHARED) || memcmp(part2->data, "34567", 5) != 0)
+    {
+      fprintf(stderr, "slice could not be made writable\n");
+      return 1;
+    }
+  z_pktbuf_unref(part2);
+  return 0;
+}
+
+int
+test_pktbuf_chain(void)
+{
+  ZPktBufChain *chain;
+  ZPktBuf *header, *body, *empty;
+  struct iovec vec[4];
+  gint count;
+
+  header = z_pktbuf_new();
+  z_pktbuf_copy(header, "HDR:", 4);
+  body = z_pktbuf_new();
+  z_pktbuf_copy(body, "payload", 7);
+  empty = z_pktbuf_new();
+
+  chain = z_pktbuf_chain_new();
+  z_pktbuf_chain_append(chain, body);
+  z_pktbuf_chain_append(chain, empty);
+  z_pktbuf_chain_prepend(chain, header);
+  z_pktbuf_unref(header);
+  z_pktbuf_unref(body);
+  z_pktbuf_unref(empty);
+  if (z_pktbuf_chain_length(chain) != 11 || z_pktbuf_chain_segments(chain) != 2)
+    {
+      fprintf(stderr, "chain has wrong length; length='%zu'\n", z_pktbuf_chain_length(chain));
+      return 1;
+    }
+
+  count = z_pktbuf_chain_iovec(chain, 0, vec, 4);
+  if (count != 2 || vec[0].iov_base != header->data || vec[0].iov_len != 4 ||
+      vec[1].iov_base != body->data || vec[1].iov_len != 7)
+    {
+      fprintf(stderr, "chain iovec is wrong; count='%d'\n", count);
+      return 1;
+    }
+
+  /* skip the header and part of the payload */
+  count = z_pktbuf_chain_iovec(chain, 6, vec, 4);
+  if (count != 1 || memcmp(vec[0].iov_base, "yload", 5) != 0 || vec[0].iov_len != 5)
+    {
+      fprintf(stderr, "chain iovec with offset is wrong; count='%d'\n", count);
+      return 1;
+    }
+
+  header = z_pktbuf_chain_pop(chain);
+  if (z_pktbuf_chain_length(chain) != 7 || z_pktbuf_chain_head(chain) != body)
+    {
+      fprintf(stderr, "chain pop failed\n");
+      return 1;
+    }
+  z_pktbuf_unref(header);
+  z_pktbuf_chain_free(chain);
+  return 0;
+}
+
+int
+main(void)
+{
+  gint res;
+
+  res = test_pktbuf_pool();
+  if (res == 0)
+    res = test_pktbuf_part();
+  if (res == 0)
+    res = test_pktbuf_chain();
+  return res;
+}
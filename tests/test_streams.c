@@ -3,6 +3,9 @@
 #include <zorp/streambuf.h>
 #include <zorp/streamline.h>
 #include <zorp/streamgzip.h>
+#include <zorp/streamcode.h>
+#include <zorp/streamtee.h>
+#include <zorp/code_base64.h>
 #include <zorp/log.h>
 #include <zorp/poll.h>
 
@@ -66,6 +69,118 @@ test_stream_unget(void)
   return res;
 }
 
+int 
+test_stream_splice(void)
+{
+  ZStream *src, *dst;
+  gint src_fds[2], dst_fds[2];
+  gint res = 1;
+  gchar buf[16];
+  gsize length;
+  
+  if (socketpair(PF_UNIX, SOCK_STREAM, 0, src_fds) < 0 ||
+      socketpair(PF_UNIX, SOCK_STREAM, 0, dst_fds) < 0)
+    {
+      perror("socketpair");
+      return 1;
+    }
+  src = z_stream_fd_new(src_fds[0], "src");
+  dst = z_stream_fd_new(dst_fds[0], "dst");
+
+  write(src_fds[1], "spliced", 7);
+  if (z_stream_splice(src, dst, sizeof(buf), &length, NULL) != G_IO_STATUS_NORMAL || length != 7)
+    {
+      fprintf(stderr, "z_stream_splice returned non-normal status\n");
+      goto exit;
+    }
+  if (read(dst_fds[1], buf, 7) != 7 || memcmp(buf, "spliced", 7) != 0)
+    {
+      fprintf(stderr, "comparison mismatch after splice\n");
+      goto exit;
+    }
+
+  /* ungot data forces the copying path */
+  z_stream_unget(src, "copied", 6, NULL);
+  if (z_stream_splice(src, dst, sizeof(buf), &length, NULL) != G_IO_STATUS_NORMAL || length != 6)
+    {
+      fprintf(stderr, "z_stream_splice returned non-normal status while copying\n");
+      goto exit;
+    }
+  if (read(dst_fds[1], buf, 6) != 6 || memcmp(buf, "copied", 6) != 0)
+    {
+      fprintf(stderr, "comparison mismatch after copy\n");
+      goto exit;
+    }
+
+  close(src_fds[1]);
+  src_fds[1] = -1;
+  if (z_stream_splice(src, dst, sizeof(buf), &length, NULL) != G_IO_STATUS_EOF)
+    {
+      fprintf(stderr, "z_stream_splice did not report EOF\n");
+      goto exit;
+    }
+  res = 0;
+
+ exit:
+  z_stream_close(src, NULL);
+  z_stream_unref(src);
+  z_stream_close(dst, NULL);
+  z_stream_unref(dst);
+  if (src_fds[1] != -1)
+    close(src_fds[1]);
+  close(dst_fds[1]);
+  return res;
+}
+
+int 
+test_stream_splice_tee(void)
+{
+  ZStream *src, *dst;
+  gint src_fds[2], dst_fds[2], fork_fds[2];
+  gint res = 1;
+  gchar buf[16];
+  gsize length;
+  
+  if (socketpair(PF_UNIX, SOCK_STREAM, 0, src_fds) < 0 ||
+      socketpair(PF_UNIX, SOCK_STREAM, 0, dst_fds) < 0 ||
+      socketpair(PF_UNIX, SOCK_STREAM, 0, fork_fds) < 0)
+    {
+      perror("socketpair");
+      return 1;
+    }
+  src = z_stream_fd_new(src_fds[0], "src");
+  dst = z_stream_tee_new(z_stream_fd_new(dst_fds[0], "dst"), z_stream_fd_new(fork_fds[0], "fork"), G_IO_OUT);
+
+  /* the tee has to see the data, it must not be spliced below it */
+  write(src_fds[1], "teed", 4);
+  if (z_stream_splice(src, dst, sizeof(buf), &length, NULL) != G_IO_STATUS_NORMAL || length != 4)
+    {
+      fprintf(stderr, "z_stream_splice returned non-normal status with tee\n");
+      goto exit;
+    }
+  if (read(dst_fds[1], buf, 4) != 4 || memcmp(buf, "teed", 4) != 0)
+    {
+      fprintf(stderr, "comparison mismatch after splice with tee\n");
+      goto exit;
+    }
+  if (read(fork_fds[1], buf, 4) != 4 || memcmp(buf, "teed", 4) != 0)
+    {
+      fprintf(stderr, "tee did not receive the spliced data\n");
+      goto exit;
+    }
+  res = 0;
+
+ exit:
+  z_stream_close(src, NULL);
+  z_stream_unref(src);
+  z_stream_close(dst, NULL);
+  z_stream_unref(dst);
+  close(src_fds[1]);
+  close(dst_fds[1]);
+  close(fork_fds[1]);
+  return res;
+}
+
 int 
 test_streambuf(void)
 {
@@ -125,6 +240,240 @@ test_streambuf(void)
   return res;
 }
 
+static gboolean
+test_poll_epoll_read(ZStream *stream, GIOCondition cond G_GNUC_UNUSED, gpointer user_data)
+{
+  gsize *nread = (gsize *) user_data;
+  gchar buf[16];
+  gsize br;
+
+  if (z_stream_read(stream, buf, sizeof(buf), &br, NULL) == G_IO_STATUS_NORMAL)
+    *nread += br;
+  return TRUE;
+}
+
+int 
+test_poll_epoll(void)
+{
+  ZStream *reader, *writer;
+  gint fds[2];
+  ZPoll *poll, *poll2 = NULL;
+  gsize bw, nread = 0;
+  gint res = 1, i;
+  
+  if (socketpair(PF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+      perror("socketpair");
+      return 1;
+    }
+  
+  poll = z_poll_new_epoll();
+  reader = z_stream_fd_new(fds[0], "epollreader");
+  z_stream_set_nonblock(reader, TRUE);
+  z_stream_set_callback(reader, G_IO_IN, test_poll_epoll_read, &nread, NULL);
+  z_stream_set_cond(reader, G_IO_IN, TRUE);
+  z_poll_add_stream(poll, reader);
+
+  writer = z_stream_buf_new(z_stream_fd_new(fds[1], "epollwriter"), 4096, 0);
+  z_poll_add_stream(poll, writer);
+
+  /* buffered data is flushed only if the poll notices the write */
+  for (i = 0; i < 100; i++) 
+    {
+      if (z_stream_write(writer, "ABCDEF", 6, &bw, NULL) != G_IO_STATUS_NORMAL)
+        {
+          fprintf(stderr, "z_stream_write returned non-normal status\n");
+          goto exit;
+        }
+    }
+  
+  for (i = 0; i < 1000 && nread < 600; i++)
+    z_poll_iter_timeout(poll, 100);
+
+  if (nread != 600)
+    {
+      fprintf(stderr, "epoll based poll delivered wrong amount of data; nread='%zu'\n", nread);
+      goto exit;
+    }
+
+  /* a stream moved to a different poll must be left alone by the old one */
+  poll2 = z_poll_new_epoll();
+  z_poll_remove_stream(poll, reader);
+  z_poll_add_stream(poll2, reader);
+  for (i = 0; i < 10; i++) 
+    {
+      if (z_stream_write(writer, "ABCDEF", 6, &bw, NULL) != G_IO_STATUS_NORMAL)
+        {
+          fprintf(stderr, "z_stream_write returned non-normal status\n");
+          goto exit;
+        }
+    }
+  for (i = 0; i < 10; i++)
+    z_poll_iter_timeout(poll, 10);
+  if (nread != 600 || !reader->poll_notify)
+    {
+      fprintf(stderr, "old poll touched a stream moved to a different poll; nread='%zu'\n", nread);
+      goto exit;
+    }
+  for (i = 0; i < 1000 && nread < 660; i++)
+    z_poll_iter_timeout(poll2, 100);
+  if (nread != 660)
+    {
+      fprintf(stderr, "epoll based poll delivered wrong amount of data after move; nread='%zu'\n", nread);
+      goto exit;
+    }
+  res = 0;
+ exit:
+  z_poll_remove_stream(poll, reader);
+  z_poll_remove_stream(poll, writer);
+  z_stream_close(reader, NULL);
+  z_stream_close(writer, NULL);
+  z_stream_unref(reader);
+  z_stream_unref(writer);
+  z_poll_unref(poll);
+  if (poll2)
+    z_poll_unref(poll2);
+  return res;
+}
+
+typedef struct _TestStackedState
+{
+  gint lines;
+  gint spurious;
+  gboolean drain;
+} TestStackedState;
+
+static gboolean
+test_poll_epoll_stacked_read(ZStream *stream, GIOCondition cond G_GNUC_UNUSED, gpointer user_data)
+{
+  TestStackedState *state = (TestStackedState *) user_data;
+  gchar *line;
+  gsize length;
+  GIOStatus st;
+
+  st = z_stream_line_get(stream, &line, &length, NULL);
+  if (st == G_IO_STATUS_AGAIN)
+    state->spurious++;
+  while (st == G_IO_STATUS_NORMAL)
+    {
+      state->lines++;
+      if (!state->drain)
+        break;
+      st = z_stream_line_get(stream, &line, &length, NULL);
+    }
+  return TRUE;
+}
+
+int 
+test_poll_epoll_stacked(void)
+{
+  TestStackedState state = { 0, 0, FALSE };
+  ZStream *stream;
+  gint fds[2];
+  ZPoll *poll;
+  gint res = 1, i;
+  
+  if (socketpair(PF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+      perror("socketpair");
+      return 1;
+    }
+  
+  poll = z_poll_new_epoll();
+  stream = z_stream_line_new(z_stream_fd_new(fds[0], "stacked"), 4096, ZRL_EOL_NL);
+  z_stream_set_nonblock(stream, TRUE);
+  z_stream_set_callback(stream, G_IO_IN, test_poll_epoll_stacked_read, &state, NULL);
+  z_stream_set_cond(stream, G_IO_IN, TRUE);
+  z_poll_add_stream(poll, stream);
+
+  /* the fd layer is dispatched, the second line stays buffered */
+  write(fds[1], "a\nb\n", 4);
+  for (i = 0; i < 100 && state.lines < 1; i++)
+    z_poll_iter_timeout(poll, 100);
+
+  /* the line layer is dispatched while epoll reports the fd readable, and
+   * the callback consumes the new data too, the fd layer must not be
+   * dispatched again for the same event */
+  write(fds[1], "c\n", 2);
+  state.drain = TRUE;
+  for (i = 0; i < 100 && state.lines < 3; i++)
+    z_poll_iter_timeout(poll, 100);
+  for (i = 0; i < 5; i++)
+    z_poll_iter_timeout(poll, 10);
+
+  if (state.lines != 3 || state.spurious != 0)
+    {
+      fprintf(stderr, "stacked stream dispatched incorrectly; lines='%d', spurious='%d'\n", state.lines, state.spurious);
+      goto exit;
+    }
+  res = 0;
+ exit:
+  z_poll_remove_stream(poll, stream);
+  z_stream_close(stream, NULL);
+  z_stream_unref(stream);
+  z_poll_unref(poll);
+  close(fds[1]);
+  return res;
+}
+
+int 
+test_stream_vec(void)
+{
+  ZStream *stream;
+  gint fds[2];
+  gint res = 1;
+  gchar head[4], tail[16];
+  struct iovec vec[3];
+  gsize length;
+  
+  if (socketpair(PF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+      perror("socketpair");
+      return 1;
+    }
+  stream = z_stream_fd_new(fds[0], "fdstream");
+
+  vec[0].iov_base = "ABC";
+  vec[0].iov_len = 3;
+  vec[1].iov_base = "";
+  vec[1].iov_len = 0;
+  vec[2].iov_base = "DEFGHIJ";
+  vec[2].iov_len = 7;
+  if (z_stream_write_vec(stream, vec, 3, &length, NULL) != G_IO_STATUS_NORMAL || length != 10)
+    {
+      fprintf(stderr, "z_stream_write_vec returned non-normal status\n");
+      goto exit;
+    }
+  if (read(fds[1], tail, 10) != 10 || memcmp(tail, "ABCDEFGHIJ", 10) != 0)
+    {
+      fprintf(stderr, "comparison mismatch after write_vec\n");
+      goto exit;
+    }
+
+  write(fds[1], "0123456789", 10);
+  vec[0].iov_base = head;
+  vec[0].iov_len = sizeof(head);
+  vec[1].iov_base = tail;
+  vec[1].iov_len = sizeof(tail);
+  if (z_stream_read_vec(stream, vec, 2, &length, NULL) != G_IO_STATUS_NORMAL || length != 10)
+    {
+      fprintf(stderr, "z_stream_read_vec returned non-normal status\n");
+      goto exit;
+    }
+  if (memcmp(head, "0123", 4) != 0 || memcmp(tail, "456789", 6) != 0)
+    {
+      fprintf(stderr, "comparison mismatch after read_vec\n");
+      goto exit;
+    }
+  res = 0;
+
+ exit:
+  z_stream_close(stream, NULL);
+  z_stream_unref(stream);
+  close(fds[1]);
+  return res;
+}
+
 int 
 test_streamline(void)
 {
@@ -153,6 +502,139 @@ test_streamline(void)
       fprintf(stderr, "comparison mismatch, line='%.*s'", length, line);
       goto exit;
     }
+
+  /* a long line arriving in two parts, the EOL scan continues where it stopped */
+  z_stream_set_nonblock(stream, TRUE);
+  write(fds[1], "0123456789abcdefghijklmnop", 26);
+  if (z_stream_line_get(stream, &line, &length, NULL) != G_IO_STATUS_AGAIN)
+    {
+      fprintf(stderr, "z_stream_line_get returned a partial line\n");
+      goto exit;
+    }
+  write(fds[1], "qrstuvwxyz\r\nnext\n", 17);
+  if (z_stream_line_get(stream, &line, &length, NULL) != G_IO_STATUS_NORMAL ||
+      length != 38 || strncmp(line, "0123456789abcdefghijklmnopqrstuvwxyz\r\n", 38) != 0)
+    {
+      fprintf(stderr, "long line mismatch, line='%.*s'\n", (gint) length, line);
+      goto exit;
+    }
+  if (z_stream_line_get(stream, &line, &length, NULL) != G_IO_STATUS_NORMAL ||
+      length != 5 || strncmp(line, "next\n", 5) != 0)
+    {
+      fprintf(stderr, "line after long line mismatch, line='%.*s'\n", (gint) length, line);
+      goto exit;
+    }
+
+  /* embedded NUL past the first 16 bytes is still detected */
+  write(fds[1], "0123456789abcdefgh\0ij\n", 22);
+  if (z_stream_line_get(stream, &line, &length, NULL) != G_IO_STATUS_ERROR)
+    {
+      fprintf(stderr, "embedded NUL was not detected\n");
+      goto exit;
+    }
+  res = 0;
+
+ exit:
+  z_stream_close(stream, NULL);
+  z_stream_unref(stream);
+  close(fds[1]);
+  return res;
+}
+
+int
+test_streamline_many(void)
+{
+  ZStream *stream;
+  ZStreamLineView lines[8];
+  const gchar *expected[] = { "A: 1", "B: 2", "C: 3", "" };
+  gint fds[2];
+  gint res = 1;
+  guint num, i;
+
+  if (socketpair(PF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+      perror("socketpair");
+      return 1;
+    }
+  stream = z_stream_line_new(z_stream_fd_new(fds[0], "fdstream"), 4096, ZRL_EOL_CRLF);
+
+  write(fds[1], "A: 1\r\nB: 2\r\nC: 3\r\n\r\npartial", 27);
+
+  if (z_stream_line_get_many(stream, lines, 8, &num, NULL) != G_IO_STATUS_NORMAL || num != 4)
+    {
+      fprintf(stderr, "z_stream_line_get_many returned wrong number of lines; num='%u'\n", num);
+      goto exit;
+    }
+  for (i = 0; i < num; i++)
+    {
+      if (lines[i].length != strlen(expected[i]) || strncmp(lines[i].line, expected[i], lines[i].length) != 0)
+        {
+          fprintf(stderr, "line mismatch; line='%.*s'\n", (gint) lines[i].length, lines[i].line);
+          goto exit;
+        }
+    }
+
+  /* the partial line is completed by the next read */
+  write(fds[1], "\r\n", 2);
+  if (z_stream_line_get_many(stream, lines, 8, &num, NULL) != G_IO_STATUS_NORMAL ||
+      num != 1 || lines[0].length != 7 || strncmp(lines[0].line, "partial", 7) != 0)
+    {
+      fprintf(stderr, "partial line mismatch; num='%u'\n", num);
+      goto exit;
+    }
+  res = 0;
+
+ exit:
+  z_stream_close(stream, NULL);
+  z_stream_unref(stream);
+  close(fds[1]);
+  return res;
+}
+
+int
+test_streamline_grow(void)
+{
+  ZStream *stream;
+  gint fds[2];
+  gint res = 1;
+  gchar *line;
+  gsize length;
+  gchar longline[101];
+
+  if (socketpair(PF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+      perror("socketpair");
+      return 1;
+    }
+  stream = z_stream_line_new(z_stream_fd_new(fds[0], "fdstream"), 16, ZRL_EOL_NL);
+  z_stream_line_set_max_bufsize(stream, 128);
+
+  memset(longline, 'x', 100);
+  longline[100] = '\n';
+  write(fds[1], longline, 101);
+  write(fds[1], "short\n", 6);
+
+  if (z_stream_line_get(stream, &line, &length, NULL) != G_IO_STATUS_NORMAL || length != 100)
+    {
+      fprintf(stderr, "long line was not returned by a growing buffer; length='%zu'\n", length);
+      goto exit;
+    }
+  if (z_stream_line_get(stream, &line, &length, NULL) != G_IO_STATUS_NORMAL ||
+      length != 5 || strncmp(line, "short", 5) != 0)
+    {
+      fprintf(stderr, "line after long line mismatch; line='%.*s'\n", (gint) length, line);
+      goto exit;
+    }
+
+  /* lines longer than the maximum are still rejected */
+  memset(longline, 'y', 100);
+  write(fds[1], longline, 100);
+  write(fds[1], longline, 101);
+  if (z_stream_line_get(stream, &line, &length, NULL) != G_IO_STATUS_ERROR)
+    {
+      fprintf(stderr, "overlong line was accepted\n");
+      goto exit;
+    }
   res = 0;
 
  exit:
@@ -285,19 +767,100 @@ test_streamgzip_no_headers(void)
   return res;
 }
 
+int
+test_streamcode(void)
+{
+  ZStream *stream, *fdstream;
+  gint fds[2];
+  gint res = 1;
+  gchar contents[32];
+  gsize length, bw, pos;
+  gssize rd;
+  gchar plain[] = "abcdefghijk";
+  gchar encoded[] = "YWJj\nZGVm\r\nZ2hp\nams=";
+
+  if (socketpair(PF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+      perror("socketpair");
+      return 1;
+    }
+  fdstream = z_stream_fd_new(fds[0], "fdstream");
+
+  /* buffer length smaller than the data, writes are accepted in parts */
+  stream = z_stream_code_new(fdstream, z_code_base64_encode_new(0, 0), z_code_base64_decode_new(0, FALSE), 4);
+
+  for (pos = 0; pos < sizeof(plain) - 1; pos += bw)
+    {
+      if (z_stream_write(stream, plain + pos, sizeof(plain) - 1 - pos, &bw, NULL) != G_IO_STATUS_NORMAL || bw > 4)
+        {
+          fprintf(stderr, "z_stream_write returned non-normal status\n");
+          goto exit;
+        }
+    }
+  if (z_stream_shutdown(stream, SHUT_WR, NULL) != G_IO_STATUS_NORMAL)
+    {
+      fprintf(stderr, "z_stream_shutdown returned non-normal status\n");
+      goto exit;
+    }
+
+  length = 0;
+  while ((rd = read(fds[1], contents + length, sizeof(contents) - length)) > 0)
+    length += rd;
+  if (length != 16 || strncmp(contents, "YWJjZGVmZ2hpams=", 16) != 0)
+    {
+      fprintf(stderr, "encoded mismatch, content='%.*s'\n", (gint) length, contents);
+      goto exit;
+    }
+
+  write(fds[1], encoded, sizeof(encoded) - 1);
+  shutdown(fds[1], SHUT_WR);
+
+  pos = 0;
+  while (z_stream_read(stream, contents + pos, sizeof(contents) - pos, &length, NULL) == G_IO_STATUS_NORMAL)
+    pos += length;
+  if (pos != 11 || strncmp(contents, plain, 11) != 0)
+    {
+      fprintf(stderr, "decoded mismatch, content='%.*s'\n", (gint) pos, contents);
+      goto exit;
+    }
+  res = 0;
+
+ exit:
+  z_stream_close(stream, NULL);
+  z_stream_unref(stream);
+  close(fds[1]);
+  return res;
+}
+
 int 
 main(void)
 { 
   gint res;
   
   res = test_stream_unget();
+  if (res == 0)
+    res = test_stream_vec();
+  if (res == 0)
+    res = test_stream_splice();
+  if (res == 0)
+    res = test_stream_splice_tee();
   if (res == 0)
     res = test_streambuf();
+  if (res == 0)
+    res = test_poll_epoll();
+  if (res == 0)
+    res = test_poll_epoll_stacked();
   if (res == 0)
     res = test_streamline();
+  if (res == 0)
+    res = test_streamline_many();
+  if (res == 0)
+    res = test_streamline_grow();
   if (res == 0)
     res = test_streamgzip_with_headers();
   if (res == 0)
     res = test_streamgzip_no_headers();
+  if (res == 0)
+    res = test_streamcode();
   return res;
 }